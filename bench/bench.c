@@ -0,0 +1,380 @@
+#include "bench.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Every benchmark runs at least this many times, and no more than
+// the cap, however long or short min_time makes it.
+#define MIN_ITERATIONS 5
+#define MAX_ITERATIONS 100000
+
+typedef struct {
+    char name[128];
+    size_t iterations;
+    double ops_per_sec;
+    double items_per_sec;
+    double p50_us;
+    double p99_us;
+    long peak_rss_kb;
+} bench_result;
+
+typedef struct {
+    char name[128];
+    double value;
+} bench_value;
+
+static struct {
+    double min_time;
+    const char *filter;
+    int failed;
+
+    bench_result *results;
+    size_t nresults;
+
+    bench_value *metrics;
+    size_t nmetrics;
+} state = {
+    .min_time = 1.0
+};
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reset_peak_rss()
+{
+    // Resets VmHWM to the current RSS (Linux 4.0+)
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0)
+        return;
+
+    if (write(fd, "5", 1) < 0) {
+        // Left as the peak of the whole process
+    }
+
+    close(fd);
+}
+
+static long peak_rss_kb()
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    if (fp) {
+        while (fgets(line, sizeof(line), fp))
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                break;
+
+        fclose(fp);
+    }
+
+    if (kb < 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+
+    return kb;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double q)
+{
+    return sorted[(size_t) ((n - 1) * q + 0.5)];
+}
+
+// Whether name passes the filter given on the command line.
+int bench_selected(const char *name)
+{
+    return !state.filter || strstr(name, state.filter) != NULL;
+}
+
+// Runs a benchmark if it passes the name filter, and records its result.
+void bench_run(const bench_case *bc)
+{
+    if (!bench_selected(bc->name))
+        return;
+
+    size_t cap = 1024;
+    size_t n = 0;
+    double *latencies = (double *) malloc(cap * sizeof(double));
+    double timed = 0;
+
+    if (!latencies)
+        return;
+
+    reset_peak_rss();
+
+    // One untimed run to warm caches and lazy initialization
+    int ok = (!bc->setup || bc->setup(bc->arg)) && bc->run(bc->arg);
+    if (bc->teardown)
+        bc->teardown(bc->arg);
+
+    while (ok && n < MAX_ITERATIONS && (n < MIN_ITERATIONS || timed < state.min_time)) {
+        if (bc->setup && !bc->setup(bc->arg)) {
+            ok = 0;
+            break;
+        }
+
+        double start = now_sec();
+        ok = bc->run(bc->arg);
+        double elapsed = now_sec() - start;
+
+        if (bc->teardown)
+            bc->teardown(bc->arg);
+
+        if (n == cap) {
+            cap *= 2;
+            double *grown = (double *) realloc(latencies, cap * sizeof(double));
+            if (!grown)
+                break;
+
+            latencies = grown;
+        }
+
+        latencies[n++] = elapsed;
+        timed += elapsed;
+    }
+
+    if (!ok || !n) {
+        fprintf(stderr, "%-44s FAILED\n", bc->name);
+        state.failed++;
+        free(latencies);
+        return;
+    }
+
+    bench_result *grown = (bench_result *) realloc(state.results, (state.nresults + 1) * sizeof(bench_result));
+    if (!grown) {
+        free(latencies);
+        return;
+    }
+
+    state.results = grown;
+
+    bench_result *r = &state.results[state.nresults++];
+    memset(r, 0, sizeof(*r));
+
+    qsort(latencies, n, sizeof(double), &compare_double);
+
+    snprintf(r->name, sizeof(r->name), "%s", bc->name);
+    r->iterations    = n;
+    r->ops_per_sec   = n / timed;
+    r->items_per_sec = r->ops_per_sec * (bc->items > 0 ? bc->items : 1);
+    r->p50_us        = percentile(latencies, n, 0.50) * 1e6;
+    r->p99_us        = percentile(latencies, n, 0.99) * 1e6;
+    r->peak_rss_kb   = peak_rss_kb();
+
+    printf("%-44s %10.1f ops/s %12.1f items/s  p50 %10.1f us  p99 %10.1f us  rss %7ld kB\n",
+        r->name, r->ops_per_sec, r->items_per_sec, r->p50_us, r->p99_us, r->peak_rss_kb);
+    fflush(stdout);
+
+    free(latencies);
+}
+
+// Records a value which is not a timing, such as an error or a counter.
+void bench_metric(const char *name, double value)
+{
+    if (!bench_selected(name))
+        return;
+
+    bench_value *grown = (bench_value *) realloc(state.metrics, (state.nmetrics + 1) * sizeof(bench_value));
+    if (!grown)
+        return;
+
+    state.metrics = grown;
+
+    bench_value *m = &state.metrics[state.nmetrics++];
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->value = value;
+
+    printf("%-44s %g\n", name, value);
+    fflush(stdout);
+}
+
+static int write_json(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        return 0;
+
+    // One entry per line, which is all load_baseline parses
+    fprintf(fp, "{\n  \"results\": [\n");
+
+    for (size_t i = 0; i < state.nresults; ++i) {
+        bench_result *r = &state.results[i];
+
+        fprintf(fp, "    {\"name\": \"%s\", \"iterations\": %zu, \"ops_per_sec\": %.3f, \"items_per_sec\": %.3f, "
+            "\"p50_us\": %.3f, \"p99_us\": %.3f, \"peak_rss_kb\": %ld}%s\n",
+            r->name, r->iterations, r->ops_per_sec, r->items_per_sec,
+            r->p50_us, r->p99_us, r->peak_rss_kb,
+            i + 1 < state.nresults ? "," : "");
+    }
+
+    fprintf(fp, "  ],\n  \"metrics\": [\n");
+
+    for (size_t i = 0; i < state.nmetrics; ++i)
+        fprintf(fp, "    {\"name\": \"%s\", \"value\": %.9g}%s\n",
+            state.metrics[i].name, state.metrics[i].value,
+            i + 1 < state.nmetrics ? "," : "");
+
+    fprintf(fp, "  ]\n}\n");
+
+    return fclose(fp) == 0;
+}
+
+static bench_result *load_baseline(const char *filename, size_t *n)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return NULL;
+
+    bench_result *base = NULL;
+    char line[1024];
+
+    *n = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        bench_result r = { 0 };
+
+        if (sscanf(line, " {\"name\": \"%127[^\"]\", \"iterations\": %zu, \"ops_per_sec\": %lf, \"items_per_sec\": %lf, "
+                "\"p50_us\": %lf, \"p99_us\": %lf, \"peak_rss_kb\": %ld",
+                r.name, &r.iterations, &r.ops_per_sec, &r.items_per_sec,
+                &r.p50_us, &r.p99_us, &r.peak_rss_kb) != 7)
+            continue;
+
+        bench_result *grown = (bench_result *) realloc(base, (*n + 1) * sizeof(bench_result));
+        if (!grown)
+            break;
+
+        base = grown;
+        base[(*n)++] = r;
+    }
+
+    fclose(fp);
+
+    return base;
+}
+
+static int compare_baseline(const char *filename, double threshold)
+{
+    // Returns how many benchmarks lost more than threshold
+    // percent of their throughput.
+    size_t n = 0;
+    bench_result *base = load_baseline(filename, &n);
+    int regressions = 0;
+
+    if (!base) {
+        fprintf(stderr, "could not read baseline %s\n", filename);
+        return 0;
+    }
+
+    printf("\n%-44s %12s %12s %8s %8s\n", "compared to baseline", "ops/s", "was", "change", "p99");
+
+    for (size_t i = 0; i < state.nresults; ++i) {
+        bench_result *r = &state.results[i];
+        bench_result *b = NULL;
+
+        for (size_t j = 0; j < n && !b; ++j)
+            if (strcmp(base[j].name, r->name) == 0)
+                b = &base[j];
+
+        if (!b || b->ops_per_sec <= 0)
+            continue;
+
+        double change = 100 * (r->ops_per_sec / b->ops_per_sec - 1);
+        double p99    = b->p99_us > 0 ? 100 * (r->p99_us / b->p99_us - 1) : 0;
+        int regressed = change < -threshold;
+
+        regressions += regressed;
+
+        printf("%-44s %12.1f %12.1f %+7.1f%% %+7.1f%%%s\n",
+            r->name, r->ops_per_sec, b->ops_per_sec, change, p99, regressed ? "  REGRESSED" : "");
+    }
+
+    free(base);
+
+    return regressions;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-q] [-L] [-t seconds] [-f filter] [-o out.json] [-c baseline.json] [-r percent]\n"
+        "  -q  small inputs only\n"
+        "  -L  include 1920x1080 inputs\n"
+        "  -t  minimum timed seconds per benchmark (default 1)\n"
+        "  -f  only run benchmarks whose names contain filter\n"
+        "  -o  write results as JSON\n"
+        "  -c  compare against results from an earlier -o\n"
+        "  -r  throughput loss counted as a regression (default 10)\n",
+        argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    corpus_size max_size = SIZE_MEDIUM;
+    const char *output = NULL;
+    const char *baseline = NULL;
+    double threshold = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qLt:f:o:c:r:h")) != -1) {
+        switch (opt) {
+        case 'q': max_size = SIZE_SMALL; break;
+        case 'L': max_size = SIZE_LARGE; break;
+        case 't': state.min_time = atof(optarg); break;
+        case 'f': state.filter = optarg; break;
+        case 'o': output = optarg; break;
+        case 'c': baseline = optarg; break;
+        case 'r': threshold = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    corpus c = { 0 };
+
+    double start = now_sec();
+    if (!corpus_generate(&c, max_size)) {
+        fprintf(stderr, "could not generate the corpus\n");
+        corpus_free(&c);
+        return 1;
+    }
+
+    printf("generated %zu inputs in %.1fs\n\n", c.len, now_sec() - start);
+
+    bench_all(&c);
+    corpus_free(&c);
+
+    // Compared first, so a run can replace the baseline it was compared to
+    int regressions = baseline ? compare_baseline(baseline, threshold) : 0;
+
+    if (output && !write_json(output))
+        fprintf(stderr, "could not write %s: %s\n", output, strerror(errno));
+
+    free(state.results);
+    free(state.metrics);
+
+    return state.failed || regressions ? 1 : 0;
+}
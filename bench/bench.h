@@ -0,0 +1,74 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "common.h"
+#include "fingerprint.h"
+
+typedef enum {
+    SIZE_SMALL,  // 320x240
+    SIZE_MEDIUM, // 1280x720
+    SIZE_LARGE,  // 1920x1080
+    SIZE_COUNT
+} corpus_size;
+
+// A generated input, kept in memory and written to the corpus directory
+typedef struct {
+    file_type type;
+    corpus_size size;
+    const char *name;   /// Short format name, as in result names
+    dim_t dimensions;
+    size_t frames;
+    buf_t buf;
+    char path[256];
+} corpus_item;
+
+typedef struct {
+    corpus_item *items;
+    size_t len;
+    char dir[64];
+} corpus;
+
+// bench/corpus.c
+
+// Generates every format at each size up to max_size, into memory and
+// a temporary directory. Returns 0 if anything failed to encode.
+int corpus_generate(corpus *c, corpus_size max_size);
+
+// Removes the corpus directory and frees every item.
+void corpus_free(corpus *c);
+
+// Gets the generated item of this type and size, or NULL.
+corpus_item *corpus_find(corpus *c, file_type type, corpus_size size);
+
+const char *corpus_size_name(corpus_size size);
+
+// bench/bench.c
+
+// One benchmark. setup and teardown run around every call of run,
+// untimed, and may be NULL. run returns 0 on failure, which stops the
+// benchmark. items is how many things each call processes (files,
+// frames, bytes), reported as items/sec alongside ops/sec.
+typedef struct {
+    const char *name;
+    int (*setup)(void *arg);
+    int (*run)(void *arg);
+    void (*teardown)(void *arg);
+    void *arg;
+    double items;
+} bench_case;
+
+// Runs a benchmark if it passes the name filter, and records its result.
+void bench_run(const bench_case *bc);
+
+// Records a value which is not a timing, such as an error or a counter.
+void bench_metric(const char *name, double value);
+
+// Whether name passes the filter given on the command line.
+int bench_selected(const char *name);
+
+// bench/cases.c
+
+// Runs every benchmark against the corpus.
+void bench_all(corpus *c);
+
+#endif // _BENCH_H
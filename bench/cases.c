@@ -0,0 +1,1044 @@
+#include "bench.h"
+
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "job.h"
+#include "kernels.h"
+#include "pool.h"
+#include "raster_image.h"
+#include "server.h"
+#include "trace.h"
+#include "video.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Jobs per timed run of the engine benchmarks
+#define JOB_COUNT 32
+
+// Paths per timed run of the batch reader
+#define BATCH_PATHS 64
+
+typedef struct {
+    corpus_item *item;
+
+    raster_image *ri;   /// Input loaded before timing
+    raster_image *out;
+    buf_t out_buf;
+
+    void *copy;         /// Input buffer handed over to a video
+    video *v;
+    video_options opts;
+    video_decode_mode mode;
+    int workers;
+
+    job_engine *engine;
+    const char **paths;
+    size_t npaths;
+    uint8_t *rgb;
+    cache *cache;
+    cache_key key;
+    const char *startup; /// What the startup process does
+    server_conn *conn;
+    server_request req;
+    buf_t oriented;     /// JPEG with an EXIF orientation added
+    raster_transform_options transform;
+    raster_transform_path path; /// Expected of every transform
+} bench_ctx;
+
+extern char **environ;
+
+static void run_case(const char *op, corpus_item *it, int (*setup)(void *), int (*run)(void *), void (*teardown)(void *), bench_ctx *ctx, double items)
+{
+    char name[128];
+
+    if (it)
+        snprintf(name, sizeof(name), "%s/%s/%s", op, it->name, corpus_size_name(it->size));
+    else
+        snprintf(name, sizeof(name), "%s", op);
+
+    ctx->item = it;
+
+    bench_case bc = {
+        .name     = name,
+        .setup    = setup,
+        .run      = run,
+        .teardown = teardown,
+        .arg      = ctx,
+        .items    = items
+    };
+
+    bench_run(&bc);
+}
+
+//
+// Images
+//
+
+static int run_fingerprint(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    return fingerprint_buffer(ctx->item->buf.buf, ctx->item->buf.len) == ctx->item->type;
+}
+
+static int run_load(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    ctx->out = raster_image_from_buffer(ctx->item->buf.buf, ctx->item->buf.len);
+    return ctx->out != NULL;
+}
+
+static int setup_load(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    ctx->ri = raster_image_from_buffer(ctx->item->buf.buf, ctx->item->buf.len);
+    return ctx->ri != NULL;
+}
+
+static int setup_traced(void *arg)
+{
+    trace_stats *stats = (trace_stats *) calloc(1, sizeof(trace_stats));
+
+    trace_collect(stats);
+    trace_enable(1);
+
+    return stats != NULL;
+}
+
+static void free_outputs(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+
+    raster_image_free(ctx->out);
+    free(ctx->out_buf.buf);
+
+    ctx->out = NULL;
+    ctx->out_buf = (buf_t) { 0 };
+}
+
+static void free_all(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+
+    free_outputs(ctx);
+    raster_image_free(ctx->ri);
+    ctx->ri = NULL;
+}
+
+static void teardown_traced(void *arg)
+{
+    trace_enable(0);
+    free(trace_collect(NULL));
+    free_outputs(arg);
+}
+
+static int run_image_intensities(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    intensity_t i = raster_image_get_intensities(ctx->ri);
+    return i.avg >= 0;
+}
+
+static int run_scale(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    dim_t d = ctx->item->dimensions;
+
+    ctx->out = raster_image_scale(ctx->ri, d.width / 4, d.height / 4);
+    return ctx->out != NULL;
+}
+
+static int run_encode(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    ctx->out_buf = raster_image_to_buffer(ctx->ri);
+    return ctx->out_buf.buf != NULL;
+}
+
+static int run_optimize(void *arg)
+{
+    // Not every animation can be optimized further
+    bench_ctx *ctx = (bench_ctx *) arg;
+    raster_image_optimize(ctx->ri);
+    return 1;
+}
+
+static void bench_image(corpus_item *it)
+{
+    bench_ctx ctx = { 0 };
+
+    run_case("fingerprint", it, NULL, &run_fingerprint, NULL, &ctx, 1);
+    run_case("load", it, NULL, &run_load, &free_outputs, &ctx, 1);
+
+    if (it->type == IMAGE_PNG && it->size == SIZE_SMALL)
+        run_case("load_traced", it, &setup_traced, &run_load, &teardown_traced, &ctx, 1);
+
+    if (it->type == IMAGE_GIF)
+        run_case("optimize", it, &setup_load, &run_optimize, &free_all, &ctx, 1);
+
+    ctx.item = it;
+    if (!setup_load(&ctx))
+        return;
+
+    run_case("intensities", it, NULL, &run_image_intensities, NULL, &ctx, 1);
+    run_case("scale", it, NULL, &run_scale, &free_outputs, &ctx, it->frames);
+    run_case("encode", it, NULL, &run_encode, &free_outputs, &ctx, it->frames);
+
+    free_all(&ctx);
+}
+
+//
+// Videos
+//
+
+static int setup_copy(void *arg)
+{
+    // video_from_buffer takes ownership of its input
+    bench_ctx *ctx = (bench_ctx *) arg;
+
+    ctx->copy = malloc(ctx->item->buf.len);
+    if (!ctx->copy)
+        return 0;
+
+    memcpy(ctx->copy, ctx->item->buf.buf, ctx->item->buf.len);
+    return 1;
+}
+
+static int run_open(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+
+    ctx->v = video_from_buffer_ex(ctx->copy, ctx->item->buf.len, &ctx->opts);
+    ctx->copy = NULL;
+
+    return ctx->v != NULL;
+}
+
+static int setup_open(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+
+    if (!setup_copy(ctx) || !run_open(ctx))
+        return 0;
+
+    return video_set_decode_mode(ctx->v, ctx->mode);
+}
+
+static void free_video(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+
+    if (ctx->v)
+        video_free(ctx->v);
+
+    raster_image_free(ctx->out);
+    free(ctx->copy);
+
+    ctx->v = NULL;
+    ctx->out = NULL;
+    ctx->copy = NULL;
+}
+
+static int run_demux(void *arg)
+{
+    // Building the index reads every packet, and decodes nothing
+    bench_ctx *ctx = (bench_ctx *) arg;
+
+    video *v = video_from_file_ex(ctx->item->path, &ctx->opts);
+    if (!v)
+        return 0;
+
+    buf_t index = video_build_index(v);
+    video_free(v);
+    free(index.buf);
+
+    return index.buf != NULL;
+}
+
+static int run_video_intensities(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    intensity_t i;
+    return video_get_intensities(ctx->v, &i);
+}
+
+static int run_next_frame(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    video_frame f;
+    size_t frames = 0;
+
+    while (video_next_frame(ctx->v, &f)) {
+        video_frame_release(&f);
+        frames++;
+    }
+
+    return frames > 0;
+}
+
+static int run_frame_at(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    dim_t d = ctx->item->dimensions;
+
+    ctx->out = video_frame_at(ctx->v, 1.0, d.width, d.height);
+    return ctx->out != NULL;
+}
+
+static int run_validate(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    video_validation result;
+    return video_validate(ctx->v, ctx->workers, 0, &result);
+}
+
+static int run_video_scale(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    dim_t d = ctx->item->dimensions;
+    video *scaled;
+
+    if (ctx->workers > 1)
+        scaled = video_scale_parallel(ctx->v, d.width / 2, d.height / 2, ctx->workers);
+    else
+        scaled = video_scale(ctx->v, d.width / 2, d.height / 2);
+
+    if (!scaled)
+        return 0;
+
+    video_free(scaled);
+    return 1;
+}
+
+static void analysis_error(corpus_item *it)
+{
+    // How far analysis mode intensities are from the full decode
+    bench_ctx ctx = { .item = it };
+    intensity_t full, fast;
+    char name[128];
+
+    if (!setup_open(&ctx) || !video_get_intensities(ctx.v, &full))
+        goto done;
+
+    free_video(&ctx);
+    ctx.mode = VIDEO_DECODE_ANALYSIS;
+
+    if (!setup_open(&ctx) || !video_get_intensities(ctx.v, &fast))
+        goto done;
+
+    float error = fabsf(full.nw - fast.nw);
+    error = MAX(error, fabsf(full.ne - fast.ne));
+    error = MAX(error, fabsf(full.sw - fast.sw));
+    error = MAX(error, fabsf(full.se - fast.se));
+    error = MAX(error, fabsf(full.avg - fast.avg));
+
+    snprintf(name, sizeof(name), "analysis_error/%s/%s", it->name, corpus_size_name(it->size));
+    bench_metric(name, error);
+
+done:
+    free_video(&ctx);
+}
+
+static void bench_video(corpus_item *it)
+{
+    static const size_t io_sizes[] = { 32 * 1024, 256 * 1024, 1024 * 1024 };
+    static const int workers[] = { 1, 2, 4 };
+
+    bench_ctx ctx = { 0 };
+    char op[64];
+
+    run_case("fingerprint", it, NULL, &run_fingerprint, NULL, &ctx, 1);
+    run_case("open", it, &setup_copy, &run_open, &free_video, &ctx, 1);
+
+    ctx.opts.fast_open = 1;
+    run_case("open_fast", it, &setup_copy, &run_open, &free_video, &ctx, 1);
+    ctx.opts.fast_open = 0;
+
+    for (size_t i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); ++i) {
+        snprintf(op, sizeof(op), "demux_io%zuk", io_sizes[i] / 1024);
+
+        ctx.opts.io_buffer_size = io_sizes[i];
+        run_case(op, it, NULL, &run_demux, NULL, &ctx, it->buf.len);
+    }
+
+    ctx.opts.io_buffer_size = 0;
+
+    run_case("intensities", it, &setup_open, &run_video_intensities, &free_video, &ctx, 1);
+
+    ctx.mode = VIDEO_DECODE_ANALYSIS;
+    run_case("intensities_analysis", it, &setup_open, &run_video_intensities, &free_video, &ctx, 1);
+    ctx.mode = VIDEO_DECODE_FULL;
+
+    analysis_error(it);
+
+    run_case("next_frame", it, &setup_open, &run_next_frame, &free_video, &ctx, it->frames);
+    run_case("frame_at", it, &setup_open, &run_frame_at, &free_video, &ctx, 1);
+
+    for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+        snprintf(op, sizeof(op), "validate_w%d", workers[i]);
+
+        ctx.workers = workers[i];
+        run_case(op, it, &setup_open, &run_validate, &free_video, &ctx, it->frames);
+    }
+
+    // Encoding is slow enough that larger sizes would dominate the run
+    if (it->size != SIZE_SMALL)
+        return;
+
+    for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+        snprintf(op, sizeof(op), "scale_w%d", workers[i]);
+
+        ctx.workers = workers[i];
+        run_case(op, it, &setup_open, &run_video_scale, &free_video, &ctx, it->frames);
+    }
+}
+
+//
+// Job engine, batch reader and cache
+//
+
+static int run_jobs(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    job *jobs[JOB_COUNT];
+    int ok = 1;
+
+    job_request req = {
+        .kind = JOB_LOAD_IMAGE,
+        .buf  = ctx->item->buf.buf,
+        .len  = ctx->item->buf.len
+    };
+
+    for (size_t i = 0; i < JOB_COUNT; ++i)
+        jobs[i] = job_submit(ctx->engine, &req);
+
+    for (size_t i = 0; i < JOB_COUNT; ++i) {
+        job_result result = { 0 };
+
+        if (!jobs[i] || !job_wait(jobs[i], &result))
+            ok = 0;
+
+        raster_image_free(result.image);
+        job_free(jobs[i]);
+    }
+
+    return ok;
+}
+
+static void bench_jobs(corpus *c)
+{
+    int workers[] = { 1, 2, 4, (int) sysconf(_SC_NPROCESSORS_ONLN) };
+    bench_ctx ctx = { 0 };
+    char op[64];
+
+    corpus_item *it = corpus_find(c, IMAGE_PNG, SIZE_SMALL);
+    if (!it)
+        return;
+
+    for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+        // The last is all CPUs, which may repeat one of the others
+        if (i > 0 && workers[i] <= workers[i - 1])
+            break;
+
+        snprintf(op, sizeof(op), "job_load_w%d", workers[i]);
+
+        ctx.engine = job_engine_new(&(job_engine_options) { .workers = workers[i] });
+        if (!ctx.engine)
+            continue;
+
+        run_case(op, it, NULL, &run_jobs, NULL, &ctx, JOB_COUNT);
+
+        job_engine_free(ctx.engine);
+    }
+}
+
+static int run_batch(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    batch_item item;
+    size_t read = 0;
+
+    batch_reader *b = batch_open(ctx->paths, ctx->npaths, NULL);
+    if (!b)
+        return 0;
+
+    while (batch_next(b, &item)) {
+        read += item.error == 0;
+        batch_release(b, &item);
+    }
+
+    batch_close(b);
+
+    return read == ctx->npaths;
+}
+
+static void bench_batch(corpus *c)
+{
+    bench_ctx ctx = { .npaths = BATCH_PATHS };
+
+    ctx.paths = (const char **) calloc(BATCH_PATHS, sizeof(char *));
+    if (!ctx.paths)
+        return;
+
+    for (size_t i = 0; i < BATCH_PATHS; ++i)
+        ctx.paths[i] = c->items[i % c->len].path;
+
+    run_case("batch_read", NULL, NULL, &run_batch, NULL, &ctx, BATCH_PATHS);
+
+    free(ctx.paths);
+}
+
+static int run_cache_get(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    buf_t out;
+
+    if (!cache_get(ctx->cache, ctx->key, &out))
+        return 0;
+
+    free(out.buf);
+    return 1;
+}
+
+static int run_cache_thumbnail(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    ctx->out_buf = cache_thumbnail(ctx->cache, ctx->item->buf.buf, ctx->item->buf.len, 100, 100);
+    return ctx->out_buf.buf != NULL;
+}
+
+static void bench_cache(corpus *c)
+{
+    bench_ctx ctx = { 0 };
+
+    corpus_item *it = corpus_find(c, IMAGE_JPG, SIZE_SMALL);
+    if (!it)
+        return;
+
+    ctx.cache = cache_open(NULL);
+    if (!ctx.cache)
+        return;
+
+    ctx.key = cache_key_for(it->buf.buf, it->buf.len, "bench", NULL, 0);
+
+    if (cache_put(ctx.cache, ctx.key, it->buf.buf, it->buf.len)) {
+        run_case("cache_get", it, NULL, &run_cache_get, NULL, &ctx, 1);
+        run_case("cache_thumbnail", it, NULL, &run_cache_thumbnail, &free_outputs, &ctx, 1);
+    }
+
+    cache_stats stats = cache_get_stats(ctx.cache);
+    bench_metric("cache/memory_hits", stats.memory_hits);
+    bench_metric("cache/memory_misses", stats.memory_misses);
+
+    cache_close(ctx.cache);
+}
+
+static int run_rect_sum(void *arg)
+{
+    // The five regions of an intensity calculation
+    bench_ctx *ctx = (bench_ctx *) arg;
+    uint32_t w = ctx->item->dimensions.width;
+    uint32_t h = ctx->item->dimensions.height;
+
+    rect_sum_t all = kernel_rect_sum(ctx->rgb, w, (rect_t) { 0, 0, w, h });
+    kernel_rect_sum(ctx->rgb, w, (rect_t) { 0, 0, w/2, h/2 });
+    kernel_rect_sum(ctx->rgb, w, (rect_t) { w/2, 0, w, h/2 });
+    kernel_rect_sum(ctx->rgb, w, (rect_t) { 0, h/2, w/2, h });
+    kernel_rect_sum(ctx->rgb, w, (rect_t) { w/2, h/2, w, h });
+
+    return all.r + all.g + all.b > 0;
+}
+
+static void bench_kernels(corpus *c)
+{
+    // Each kernel variant this CPU supports, directly and through
+    // the operations which spend most of their time in one
+    static const char *variants[] = { "baseline", "sse4.2", "avx2", "avx512" };
+
+    char *best = strdup(kernels_active());
+    corpus_item *png = corpus_find(c, IMAGE_PNG, SIZE_MEDIUM);
+    corpus_item *gif = corpus_find(c, IMAGE_GIF, SIZE_SMALL);
+    bench_ctx ctx = { 0 };
+    char op[64];
+
+    if (!png)
+        png = corpus_find(c, IMAGE_PNG, SIZE_SMALL);
+
+    if (!best || !png || !gif)
+        goto done;
+
+    ctx.item = png;
+    size_t npixels = (size_t) png->dimensions.width * png->dimensions.height;
+
+    ctx.rgb = (uint8_t *) malloc(npixels * 3);
+    if (!ctx.rgb || !setup_load(&ctx))
+        goto done;
+
+    for (size_t i = 0; i < npixels * 3; ++i)
+        ctx.rgb[i] = (uint8_t) (i * 2654435761u >> 24);
+
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i) {
+        if (!kernels_select(variants[i]))
+            continue;
+
+        snprintf(op, sizeof(op), "kernel_rect_sum_%s", variants[i]);
+        run_case(op, png, NULL, &run_rect_sum, NULL, &ctx, 2.0 * npixels);
+
+        snprintf(op, sizeof(op), "intensities_%s", variants[i]);
+        run_case(op, png, NULL, &run_image_intensities, NULL, &ctx, 1);
+
+        bench_ctx opt = { 0 };
+        snprintf(op, sizeof(op), "optimize_%s", variants[i]);
+        run_case(op, gif, &setup_load, &run_optimize, &free_all, &opt, 1);
+    }
+
+    kernels_select(best);
+
+done:
+    free_all(&ctx);
+    free(ctx.rgb);
+    free(best);
+}
+
+//
+// Lossless transforms
+//
+
+// Copies a JPEG with an EXIF APP1 segment holding only this orientation
+// inserted after its SOI marker.
+static buf_t with_orientation(buf_t jpg, uint8_t orientation)
+{
+    static const uint8_t app1[] = {
+        0xFF, 0xE1, 0x00, 0x22, 'E', 'x', 'i', 'f', 0, 0,
+        'M', 'M', 0x00, 0x2A, 0x00, 0x00, 0x00, 0x08,   // TIFF header
+        0x00, 0x01,                                     // One IFD0 entry:
+        0x01, 0x12, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01, // Orientation, SHORT
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00                          // No IFD1
+    };
+
+    buf_t out = { 0 };
+
+    if (jpg.len < 2)
+        return out;
+
+    out.buf = malloc(jpg.len + sizeof(app1));
+    if (!out.buf)
+        return out;
+
+    uint8_t *p = (uint8_t *) out.buf;
+
+    memcpy(p, jpg.buf, 2);
+    memcpy(p + 2, app1, sizeof(app1));
+    p[2 + 29] = orientation;
+    memcpy(p + 2 + sizeof(app1), (uint8_t *) jpg.buf + 2, jpg.len - 2);
+    out.len = jpg.len + sizeof(app1);
+
+    return out;
+}
+
+static int run_transform(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    raster_transform_path path;
+
+    ctx->out_buf = raster_image_transform(ctx->oriented.buf, ctx->oriented.len, &ctx->transform, &path);
+    return ctx->out_buf.buf != NULL && path == ctx->path;
+}
+
+// Times one way of transforming, and records the size of what it wrote
+static void transform_case(const char *op, corpus_item *it, bench_ctx *ctx, raster_transform_path path)
+{
+    char name[128];
+
+    ctx->item = it;
+    ctx->path = path;
+    run_case(op, it, NULL, &run_transform, &free_outputs, ctx, 1);
+
+    if (!run_transform(ctx))
+        return;
+
+    snprintf(name, sizeof(name), "%s/%s/%s/bytes", op, it->name, corpus_size_name(it->size));
+    bench_metric(name, ctx->out_buf.len);
+    free_outputs(ctx);
+}
+
+static void bench_transform(corpus *c)
+{
+    // Rotating a photo upright, and cropping its center, in the DCT
+    // domain against a decode, AutoOrientImage and re-encode. The large
+    // size is not a whole number of MCUs high, so rotating it drops the
+    // partial row of MCUs.
+    for (int s = 0; s < SIZE_COUNT; ++s) {
+        corpus_item *it = corpus_find(c, IMAGE_JPG, (corpus_size) s);
+        bench_ctx ctx = { 0 };
+        char name[128];
+
+        if (!it)
+            continue;
+
+        ctx.oriented = with_orientation(it->buf, 6);
+        if (!ctx.oriented.buf)
+            continue;
+
+        snprintf(name, sizeof(name), "transform/%s/%s/input_bytes", it->name, corpus_size_name(it->size));
+        bench_metric(name, ctx.oriented.len);
+
+        ctx.transform = (raster_transform_options) { .allow_block_alignment = 1 };
+        transform_case("transform_lossless", it, &ctx, RASTER_TRANSFORM_LOSSLESS);
+
+        ctx.transform.force_reencode = 1;
+        transform_case("transform_reencode", it, &ctx, RASTER_TRANSFORM_REENCODED);
+
+        uint32_t w = it->dimensions.height, h = it->dimensions.width;
+
+        ctx.transform = (raster_transform_options) {
+            .crop   = 1,
+            .region = { w / 4, h / 4, w * 3 / 4, h * 3 / 4 },
+            .allow_block_alignment = 1
+        };
+        transform_case("crop_lossless", it, &ctx, RASTER_TRANSFORM_LOSSLESS);
+
+        ctx.transform.force_reencode = 1;
+        transform_case("crop_reencode", it, &ctx, RASTER_TRANSFORM_REENCODED);
+
+        free(ctx.oriented.buf);
+    }
+}
+
+//
+// Startup
+//
+
+static char startup_path[PATH_MAX];
+
+// Finds a program built with the bench, at rel from its directory.
+// Returns 0, with a note, if it has not been built.
+static int find_program(char *path, size_t size, const char *rel)
+{
+    ssize_t len = readlink("/proc/self/exe", path, size - 1);
+    if (len <= 0)
+        return 0;
+
+    path[len] = '\0';
+
+    char *slash = strrchr(path, '/');
+    if (!slash || (size_t) (slash + 1 - path) + strlen(rel) >= size)
+        return 0;
+
+    strcpy(slash + 1, rel);
+
+    if (access(path, X_OK) != 0) {
+        fprintf(stderr, "%s not built, skipping its benchmarks\n", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int run_startup(void *arg)
+{
+    // A whole process, from exec to exit, against the release .so
+    bench_ctx *ctx = (bench_ctx *) arg;
+    char *argv[] = { startup_path, (char *) ctx->startup, ctx->item ? ctx->item->path : NULL, NULL };
+    pid_t pid;
+    int status;
+
+    if (posix_spawn(&pid, startup_path, NULL, NULL, argv, environ) != 0)
+        return 0;
+
+    if (waitpid(pid, &status, 0) != pid)
+        return 0;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void bench_startup(corpus *c)
+{
+    // Only the process which loads an image should pay for
+    // initializing GraphicsMagick
+    static const char *modes[] = { "exec", "fingerprint", "init", "load" };
+    static const int needs_input[] = { 0, 1, 0, 1 };
+
+    corpus_item *jpg = corpus_find(c, IMAGE_JPG, SIZE_SMALL);
+    bench_ctx ctx = { 0 };
+    char op[64];
+
+    if (!jpg || !find_program(startup_path, sizeof(startup_path), "startup"))
+        return;
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        snprintf(op, sizeof(op), "startup_%s", modes[i]);
+        ctx.startup = modes[i];
+        run_case(op, needs_input[i] ? jpg : NULL, NULL, &run_startup, NULL, &ctx, 1);
+    }
+}
+
+//
+// Worker daemon
+//
+
+// Seconds each load runs, and the most latencies kept per client
+#define LOAD_SECONDS 2.0
+#define LOAD_SAMPLES 65536
+
+typedef struct {
+    const char *sock_path;
+    const server_request *req;
+    double deadline;
+    double *latencies; /// Microseconds
+    size_t n;
+    size_t errors;
+} load_client;
+
+static double load_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int run_daemon_call(void *arg)
+{
+    bench_ctx *ctx = (bench_ctx *) arg;
+    server_result result;
+
+    int ok = server_call(ctx->conn, &ctx->req, &result);
+    server_result_free(&result);
+
+    return ok;
+}
+
+static void *load_client_main(void *arg)
+{
+    load_client *lc = (load_client *) arg;
+    server_conn *conn = server_connect(lc->sock_path);
+
+    if (!conn) {
+        lc->errors++;
+        return NULL;
+    }
+
+    for (double start = load_now(); start < lc->deadline; start = load_now()) {
+        server_result result;
+
+        if (!server_call(conn, lc->req, &result))
+            lc->errors++;
+        else if (lc->n < LOAD_SAMPLES)
+            lc->latencies[lc->n++] = (load_now() - start) * 1e6;
+
+        server_result_free(&result);
+    }
+
+    server_disconnect(conn);
+    return NULL;
+}
+
+// Drives the daemon from clients concurrent connections at once, as fast
+// as each is answered, and reports requests/sec and tail latency.
+static void load_test(const char *sock_path, const char *op, const server_request *req, int clients)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "loadgen/%s/c%d", op, clients);
+
+    if (!bench_selected(name))
+        return;
+
+    load_client *lc = (load_client *) calloc(clients, sizeof(load_client));
+    pthread_t *threads = (pthread_t *) calloc(clients, sizeof(pthread_t));
+    double *all = (double *) malloc((size_t) clients * LOAD_SAMPLES * sizeof(double));
+    int started = 0;
+
+    if (!lc || !threads || !all)
+        goto done;
+
+    double start = load_now();
+
+    for (; started < clients; ++started) {
+        lc[started].sock_path = sock_path;
+        lc[started].req       = req;
+        lc[started].deadline  = start + LOAD_SECONDS;
+        lc[started].latencies = all + (size_t) started * LOAD_SAMPLES;
+
+        if (pthread_create(&threads[started], NULL, &load_client_main, &lc[started]) != 0)
+            break;
+    }
+
+    size_t n = 0;
+    size_t errors = 0;
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+
+        memmove(all + n, lc[i].latencies, lc[i].n * sizeof(double));
+        n += lc[i].n;
+        errors += lc[i].errors;
+    }
+
+    double elapsed = load_now() - start;
+
+    qsort(all, n, sizeof(double), &compare_latency);
+
+    char metric[160];
+    double p50  = n ? all[(size_t) (0.5 * (n - 1))] : 0;
+    double p99  = n ? all[(size_t) (0.99 * (n - 1))] : 0;
+    double p999 = n ? all[(size_t) (0.999 * (n - 1))] : 0;
+
+    printf("%-44s %10.1f req/s  p50 %9.1fus  p99 %9.1fus  p99.9 %9.1fus  %zu errors\n",
+        name, n / elapsed, p50, p99, p999, errors);
+
+    snprintf(metric, sizeof(metric), "%s/rps", name);
+    bench_metric(metric, n / elapsed);
+    snprintf(metric, sizeof(metric), "%s/p50_us", name);
+    bench_metric(metric, p50);
+    snprintf(metric, sizeof(metric), "%s/p99_us", name);
+    bench_metric(metric, p99);
+    snprintf(metric, sizeof(metric), "%s/p999_us", name);
+    bench_metric(metric, p999);
+    snprintf(metric, sizeof(metric), "%s/errors", name);
+    bench_metric(metric, errors);
+
+done:
+    free(all);
+    free(threads);
+    free(lc);
+}
+
+static void bench_daemon(corpus *c)
+{
+    char daemon_path[PATH_MAX];
+    char sock_path[sizeof(c->dir) + 16];
+    char workers[16];
+    pid_t pid;
+
+    corpus_item *items[] = {
+        corpus_find(c, IMAGE_JPG, SIZE_SMALL),
+        corpus_find(c, IMAGE_PNG, SIZE_SMALL),
+        corpus_find(c, IMAGE_JPG, SIZE_SMALL),
+        corpus_find(c, VIDEO_WEBM, SIZE_SMALL)
+    };
+
+    server_request reqs[] = {
+        { .op = SERVER_FINGERPRINT },
+        { .op = SERVER_INTENSITIES },
+        { .op = SERVER_SCALE, .max_w = 160, .max_h = 120 },
+        { .op = SERVER_FRAME_AT, .max_w = 160, .max_h = 120, .seconds = 1 }
+    };
+
+    static const char *ops[] = { "fingerprint", "intensities", "scale", "frame_at" };
+
+    size_t nreqs = sizeof(reqs) / sizeof(reqs[0]);
+
+    for (size_t i = 0; i < nreqs; ++i)
+        if (!items[i])
+            return;
+
+    if (!find_program(daemon_path, sizeof(daemon_path), "../daemon/image_procd"))
+        return;
+
+    // Inputs are sent as memfds made once, as a service holding its
+    // input in shared memory would
+    for (size_t i = 0; i < nreqs; ++i)
+        reqs[i].fd = server_memfd(items[i]->buf.buf, items[i]->buf.len);
+
+    for (size_t i = 0; i < nreqs; ++i)
+        if (reqs[i].fd < 0)
+            goto done;
+
+    int nworkers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    snprintf(sock_path, sizeof(sock_path), "%s/procd.sock", c->dir);
+    snprintf(workers, sizeof(workers), "%d", nworkers);
+
+    char *argv[] = { daemon_path, "-w", workers, sock_path, NULL };
+
+    if (posix_spawn(&pid, daemon_path, NULL, NULL, argv, environ) != 0)
+        goto done;
+
+    bench_ctx ctx = { 0 };
+
+    for (int i = 0; i < 500 && !ctx.conn; ++i)
+        if (!(ctx.conn = server_connect(sock_path)))
+            usleep(10000);
+
+    if (ctx.conn) {
+        char op[64];
+
+        // One client: the latency of a round trip, and the floor
+        // of the transport with fingerprint
+        for (size_t i = 0; i < nreqs; ++i) {
+            snprintf(op, sizeof(op), "daemon_%s", ops[i]);
+            ctx.req = reqs[i];
+            run_case(op, items[i], NULL, &run_daemon_call, NULL, &ctx, 1);
+        }
+
+        server_disconnect(ctx.conn);
+
+        // Saturated: twice as many clients as workers
+        for (size_t i = 0; i < nreqs; ++i)
+            load_test(sock_path, ops[i], &reqs[i], 2 * nworkers);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+done:
+    for (size_t i = 0; i < nreqs; ++i)
+        if (reqs[i].fd >= 0)
+            close(reqs[i].fd);
+}
+
+static void pool_metrics()
+{
+    pool_stats stats = pool_get_stats();
+
+    bench_metric("pool/hits", stats.hits);
+    bench_metric("pool/misses", stats.misses);
+    bench_metric("pool/huge", stats.huge);
+    bench_metric("pool/system", stats.system);
+    bench_metric("pool/trimmed_bytes", stats.trimmed);
+    bench_metric("pool/retained_bytes", stats.retained);
+}
+
+// Runs every benchmark against the corpus.
+void bench_all(corpus *c)
+{
+    for (size_t i = 0; i < c->len; ++i) {
+        corpus_item *it = &c->items[i];
+
+        if (it->type == VIDEO_WEBM || it->type == VIDEO_MP4)
+            bench_video(it);
+        else
+            bench_image(it);
+    }
+
+    bench_kernels(c);
+    bench_transform(c);
+    bench_jobs(c);
+    bench_batch(c);
+    bench_cache(c);
+    bench_startup(c);
+    bench_daemon(c);
+    pool_metrics();
+}
@@ -0,0 +1,214 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "raster_image.h"
+#include "video.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Frames of the animations, and of the videos encoded from them
+#define GIF_FRAMES   10
+#define VIDEO_FRAMES 50
+#define FRAME_DELAY  4 // centiseconds, 25fps
+
+static const dim_t sizes[SIZE_COUNT] = {
+    [SIZE_SMALL]  = { 320, 240 },
+    [SIZE_MEDIUM] = { 1280, 720 },
+    [SIZE_LARGE]  = { 1920, 1080 }
+};
+
+static const char *size_names[SIZE_COUNT] = {
+    [SIZE_SMALL]  = "small",
+    [SIZE_MEDIUM] = "medium",
+    [SIZE_LARGE]  = "large"
+};
+
+const char *corpus_size_name(corpus_size size)
+{
+    return size_names[size];
+}
+
+static void fill_frame(void *pixels, size_t stride, int depth, dim_t dim, size_t frame)
+{
+    // Gradients for the encoders to predict, with a square moving
+    // across them and a little noise so that nothing is trivial.
+    uint32_t seed = 0x9e3779b9u * (frame + 1);
+    uint32_t side = dim.height / 4;
+    uint32_t sx = (frame * dim.width / VIDEO_FRAMES) % (dim.width - side);
+    uint32_t sy = dim.height / 3;
+
+    for (uint32_t y = 0; y < dim.height; ++y) {
+        uint8_t *row = (uint8_t *) pixels + y * stride;
+
+        for (uint32_t x = 0; x < dim.width; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+
+            uint32_t noise = (seed >> 24) & 7;
+            uint32_t r = (x * 255 / dim.width + frame * 3 + noise) & 255;
+            uint32_t g = (y * 255 / dim.height + noise) & 255;
+            uint32_t b = ((x ^ y) + frame * 8) & 255;
+
+            if (x >= sx && x < sx + side && y >= sy && y < sy + side)
+                r = g = b = 240;
+
+            // PixelPackets are BGRA, at the library's quantum depth
+            if (depth == 8) {
+                uint8_t *p = row + x * 4;
+                p[0] = b; p[1] = g; p[2] = r; p[3] = 0;
+            } else {
+                uint16_t *p = (uint16_t *) row + x * 4;
+                p[0] = b * 257; p[1] = g * 257; p[2] = r * 257; p[3] = 0;
+            }
+        }
+    }
+}
+
+static raster_image *generate_image(dim_t dim, const char *magick, size_t frames)
+{
+    void *pixels;
+    size_t stride;
+    int depth;
+
+    raster_image *ri = raster_image_new_pixels(dim.width, dim.height, magick, &pixels, &stride, &depth);
+    if (!ri)
+        return NULL;
+
+    for (size_t f = 0; f < frames; ++f) {
+        if (f > 0 && !raster_image_add_frame(ri, &pixels, &stride))
+            goto error;
+
+        fill_frame(pixels, stride, depth, dim, f);
+
+        if (frames > 1)
+            raster_image_set_delay(ri, FRAME_DELAY);
+
+        if (!raster_image_sync_pixels(ri))
+            goto error;
+    }
+
+    return ri;
+
+error:
+    raster_image_free(ri);
+    return NULL;
+}
+
+static corpus_item *add_item(corpus *c, file_type type, corpus_size size, const char *name, size_t frames, buf_t buf)
+{
+    corpus_item *grown = (corpus_item *) realloc(c->items, (c->len + 1) * sizeof(corpus_item));
+    if (!grown) {
+        free(buf.buf);
+        return NULL;
+    }
+
+    c->items = grown;
+
+    corpus_item *it = &c->items[c->len++];
+    memset(it, 0, sizeof(*it));
+
+    it->type       = type;
+    it->size       = size;
+    it->name       = name;
+    it->dimensions = sizes[size];
+    it->frames     = frames;
+    it->buf        = buf;
+
+    snprintf(it->path, sizeof(it->path), "%s/%s_%s", c->dir, size_names[size], name);
+
+    FILE *fp = fopen(it->path, "wb");
+    if (!fp)
+        return NULL;
+
+    size_t written = fwrite(buf.buf, 1, buf.len, fp);
+
+    if (fclose(fp) != 0 || written != buf.len)
+        return NULL;
+
+    return it;
+}
+
+static int add_image(corpus *c, corpus_size size, file_type type, const char *name, const char *magick, size_t frames)
+{
+    raster_image *ri = generate_image(sizes[size], magick, frames);
+    if (!ri)
+        return 0;
+
+    buf_t buf = raster_image_to_buffer(ri);
+    raster_image_free(ri);
+
+    return buf.buf && add_item(c, type, size, name, frames, buf);
+}
+
+static int add_video(corpus *c, corpus_size size, file_type type, const char *name)
+{
+    raster_image *ri = generate_image(sizes[size], "GIF", VIDEO_FRAMES);
+    if (!ri)
+        return 0;
+
+    video *v = video_from_raster_image(ri, type);
+    raster_image_free(ri);
+
+    if (!v)
+        return 0;
+
+    buf_t buf = video_to_buffer(v);
+    video_free(v);
+
+    return buf.buf && add_item(c, type, size, name, VIDEO_FRAMES, buf);
+}
+
+// Generates every format at each size up to max_size, into memory and
+// a temporary directory. Returns 0 if anything failed to encode.
+int corpus_generate(corpus *c, corpus_size max_size)
+{
+    snprintf(c->dir, sizeof(c->dir), "/tmp/image_proc_bench.XXXXXX");
+
+    if (!mkdtemp(c->dir)) {
+        c->dir[0] = '\0';
+        return 0;
+    }
+
+    // GraphicsMagick writes no APNG, so animations are GIF only
+    for (corpus_size s = 0; s <= max_size; ++s) {
+        if (!add_image(c, s, IMAGE_JPG, "jpg", "JPEG", 1) ||
+            !add_image(c, s, IMAGE_PNG, "png", "PNG", 1) ||
+            !add_image(c, s, IMAGE_GIF, "gif", "GIF", GIF_FRAMES) ||
+            !add_video(c, s, VIDEO_WEBM, "webm") ||
+            !add_video(c, s, VIDEO_MP4, "mp4"))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Removes the corpus directory and frees every item.
+void corpus_free(corpus *c)
+{
+    for (size_t i = 0; i < c->len; ++i) {
+        unlink(c->items[i].path);
+        free(c->items[i].buf.buf);
+    }
+
+    if (c->dir[0])
+        rmdir(c->dir);
+
+    free(c->items);
+
+    c->items = NULL;
+    c->len = 0;
+}
+
+// Gets the generated item of this type and size, or NULL.
+corpus_item *corpus_find(corpus *c, file_type type, corpus_size size)
+{
+    for (size_t i = 0; i < c->len; ++i)
+        if (c->items[i].type == type && c->items[i].size == size)
+            return &c->items[i];
+
+    return NULL;
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fingerprint.h"
+#include "raster_image.h"
+
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Does one thing a short-lived process might do, then exits, so that
+// the benchmarks can time a process from exec to exit.
+//
+//   startup exec                 nothing beyond loading the library
+//   startup fingerprint <file>   fingerprint_buffer only
+//   startup init                 image_proc_init
+//   startup load <file>          raster_image_from_buffer
+
+static buf_t read_file(const char *filename)
+{
+    buf_t buf = { 0 };
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return buf;
+
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf.buf = malloc(MAX(len, 1));
+    if (buf.buf && fread(buf.buf, 1, len, fp) == (size_t) len)
+        buf.len = len;
+
+    fclose(fp);
+
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        return 2;
+
+    const char *mode = argv[1];
+
+    if (strcmp(mode, "exec") == 0)
+        return 0;
+
+    if (strcmp(mode, "init") == 0) {
+        image_proc_init();
+        return 0;
+    }
+
+    if (argc < 3)
+        return 2;
+
+    buf_t buf = read_file(argv[2]);
+    if (!buf.len)
+        return 1;
+
+    int ok = 0;
+
+    if (strcmp(mode, "fingerprint") == 0) {
+        ok = fingerprint_buffer(buf.buf, buf.len) != UNKNOWN;
+    } else if (strcmp(mode, "load") == 0) {
+        raster_image *ri = raster_image_from_buffer(buf.buf, buf.len);
+        ok = ri != NULL;
+        raster_image_free(ri);
+    }
+
+    free(buf.buf);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+
+static server *srv;
+
+static void stop(int sig)
+{
+    server_stop(srv);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-w workers] [-n requests] [-t seconds] [-m megabytes] socket\n"
+        "  -w  worker processes (default: online CPUs)\n"
+        "  -n  requests a worker serves before it is replaced (default 1000)\n"
+        "  -t  seconds a request may run before its worker is killed (default 30)\n"
+        "  -m  address space limit of each worker (default none)\n",
+        argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    server_options opts = { 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:n:t:m:h")) != -1) {
+        switch (opt) {
+        case 'w': opts.workers = atoi(optarg); break;
+        case 'n': opts.max_requests = strtoull(optarg, NULL, 10); break;
+        case 't': opts.timeout = atof(optarg); break;
+        case 'm': opts.memory_limit = strtoull(optarg, NULL, 10) << 20; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    srv = server_new(argv[optind], &opts);
+    if (!srv) {
+        fprintf(stderr, "could not listen on %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    struct sigaction sa = { .sa_handler = &stop };
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    server_run(srv);
+
+    server_stats stats = server_get_stats(srv);
+    server_free(srv);
+
+    fprintf(stderr, "workers started %lu, recycled %lu, crashed %lu, killed %lu; %lu requests\n",
+        (unsigned long) stats.started, (unsigned long) stats.recycled, (unsigned long) stats.crashed,
+        (unsigned long) stats.killed, (unsigned long) stats.requests);
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "common.h"
+
+typedef struct batch_reader batch_reader;
+
+// Options for batch_open. Zero-initialize for the defaults.
+typedef struct {
+    // Bytes being read, or read and not yet released, at once. A single
+    // file larger than this is still read, on its own. Defaults to 256MB.
+    size_t max_in_flight;
+
+    // Reads outstanding at once. Defaults to 64.
+    int queue_depth;
+
+    // Reader threads, when io_uring is unavailable. Defaults to 8.
+    int threads;
+} batch_options;
+
+// A file read by a batch_reader.
+typedef struct {
+    size_t index;     // Position of the path in the list
+    const char *path;
+    buf_t buf;        // Whole contents, or empty on error
+    int error;        // errno of the failed open or read, or 0
+} batch_item;
+
+// Starts reading every file in paths, in the background, as fast as the
+// device allows within the in-flight limit. Uses io_uring when built
+// with it and the kernel allows it, and a pool of pread threads
+// otherwise. paths are borrowed until batch_close. opts may be NULL.
+IMAGE_PROC_API batch_reader *batch_open(const char *const *paths, size_t n, const batch_options *opts);
+
+// Waits for the next file to be read, in order of completion rather than
+// of paths, and fills in item. Safe to call from many decode workers at
+// once. Returns 0 once every file has been handed out.
+IMAGE_PROC_API int batch_next(batch_reader *b, batch_item *item);
+
+// Frees the contents of item, making room for more reads.
+IMAGE_PROC_API void batch_release(batch_reader *b, batch_item *item);
+
+// Makes room for more reads as batch_release does, but hands ownership
+// of the contents to the caller, e.g. for video_from_buffer. You must
+// free() them.
+IMAGE_PROC_API void batch_detach(batch_reader *b, batch_item *item);
+
+// Stops reading and frees this batch_reader. Items not yet handed out
+// are dropped; ones already handed out must be released first.
+IMAGE_PROC_API void batch_close(batch_reader *b);
+
+#endif // _BATCH_H
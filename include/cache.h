@@ -0,0 +1,83 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "common.h"
+
+typedef struct cache cache;
+
+// Identifies a cached result: a hash of the input bytes, and
+// a hash of the operation and its parameters.
+typedef struct {
+    uint64_t input;
+    uint64_t op;
+} cache_key;
+
+// Options for cache_open. Zero-initialize for the defaults.
+typedef struct {
+    // Bytes kept in this process, least recently used first
+    // out. Defaults to 64MB.
+    size_t memory_limit;
+
+    // Directory of the disk tier, shared by every process which opens
+    // it. NULL keeps the cache in memory only.
+    const char *directory;
+
+    // Bytes of segment files in the disk tier. Whole segments are
+    // evicted, oldest first. Defaults to 1GB.
+    size_t disk_limit;
+
+    // Size of each segment file, and so the largest result the disk
+    // tier can hold. Defaults to 64MB.
+    size_t segment_size;
+
+    // Entries in the disk tier's index. Defaults to 1 per 16KB of
+    // disk_limit.
+    size_t index_slots;
+} cache_options;
+
+typedef struct {
+    uint64_t memory_hits;
+    uint64_t memory_misses;
+    uint64_t memory_evictions;
+
+    // Shared by every process using the same directory
+    uint64_t disk_hits;
+    uint64_t disk_misses;
+    uint64_t disk_evictions;
+    uint64_t disk_insertions;
+} cache_stats;
+
+// Opens a cache, creating the disk tier if it does not exist. An existing
+// disk tier keeps the sizes it was created with. opts may be NULL.
+// Returns NULL if the disk tier could not be opened.
+IMAGE_PROC_API cache *cache_open(const cache_options *opts);
+
+// Closes this cache. The disk tier stays for the next to open it.
+IMAGE_PROC_API void cache_close(cache *c);
+
+// Hashes input bytes with XXH64. Fast enough to key on whole files.
+IMAGE_PROC_API uint64_t cache_hash(const void *buf, size_t len, uint64_t seed);
+
+// Builds the key for the result of op, with params, on these input bytes.
+IMAGE_PROC_API cache_key cache_key_for(const void *input, size_t len, const char *op, const void *params, size_t params_len);
+
+// Looks up a result, memory first and then disk. On a hit, a copy is
+// written to out; you must free() it. Returns 1 on a hit.
+IMAGE_PROC_API int cache_get(cache *c, cache_key key, buf_t *out);
+
+// Stores a result in both tiers. Returns 0 if neither could hold it.
+IMAGE_PROC_API int cache_put(cache *c, cache_key key, const void *data, size_t len);
+
+// Gets the counters of this cache.
+IMAGE_PROC_API cache_stats cache_get_stats(cache *c);
+
+// Scales the image in buf proportionally to fit within max_w x max_h,
+// and encodes it, from the cache when possible. You must free() the
+// returned memory, which is empty on failure.
+IMAGE_PROC_API buf_t cache_thumbnail(cache *c, const void *buf, size_t len, size_t max_w, size_t max_h);
+
+// Gets corner intensities for the image or video in buf, from the cache
+// when possible. Returns 0 if the input could not be read.
+IMAGE_PROC_API int cache_intensities(cache *c, const void *buf, size_t len, intensity_t *i);
+
+#endif // _CACHE_H
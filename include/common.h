@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// Marks the public API. Release builds hide every other symbol.
+#define IMAGE_PROC_API __attribute__((visibility("default")))
+
 typedef struct {
     uint32_t width;
     uint32_t height;
@@ -35,4 +38,9 @@ typedef struct {
     uint32_t end_y;
 } rect_t;
 
+// Initializes GraphicsMagick now, rather than on the first call which
+// needs it. Servers which fork workers can call this before forking, so
+// that no worker pays for it. Safe to call more than once, from any thread.
+IMAGE_PROC_API void image_proc_init(void);
+
 #endif // _IMAGE_COMMON_H
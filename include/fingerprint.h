@@ -1,6 +1,8 @@
 #ifndef _FINGERPRINT_H
 #define _FINGERPRINT_H
 
+#include "common.h"
+
 typedef enum {
   IMAGE_PNG,
   IMAGE_JPG,
@@ -13,10 +15,10 @@ typedef enum {
 
 // Returns the associated enum value of the MIME type of
 // this buffer, or UNKNOWN.
-file_type fingerprint_buffer(const void *buf, size_t len);
+IMAGE_PROC_API file_type fingerprint_buffer(const void *buf, size_t len);
 
 // Returns the associated enum value of the MIME type of
 // this file, or UNKNOWN.
-file_type fingerprint_file(const char *path);
+IMAGE_PROC_API file_type fingerprint_file(const char *path);
 
 #endif // _FINGERPRINT_H
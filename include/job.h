@@ -0,0 +1,112 @@
+#ifndef _JOB_H
+#define _JOB_H
+
+#include "common.h"
+#include "fingerprint.h"
+#include "raster_image.h"
+#include "trace.h"
+#include "video.h"
+
+typedef struct job_engine job_engine;
+typedef struct job job;
+
+typedef enum {
+    JOB_FINGERPRINT,    // buf, len -> type
+    JOB_LOAD_IMAGE,     // buf, len -> image
+    JOB_LOAD_VIDEO,     // buf, len -> video
+    JOB_SCALE_IMAGE,    // image, max_w, max_h -> image
+    JOB_SCALE_VIDEO,    // video, max_w, max_h -> video
+    JOB_OPTIMIZE_IMAGE, // image, optimized in place
+    JOB_INTENSITIES,    // image or video -> intensities
+    JOB_CUSTOM          // fn(arg, threads) -> custom
+} job_kind;
+
+// Result of a job. Images and videos it produced belong to the caller.
+typedef struct {
+    int ok;
+    file_type type;
+    raster_image *image;
+    video *video;
+    intensity_t intensities;
+    void *custom;
+
+    // Stages the job ran on its worker, while tracing is enabled
+    trace_stats trace;
+} job_result;
+
+// A job to submit. Inputs (buf, image, video) are borrowed, and must
+// stay valid and otherwise unused until the job completes.
+typedef struct {
+    job_kind kind;
+
+    const void *buf;
+    size_t len;
+    raster_image *image;
+    video *video;
+    size_t max_w;
+    size_t max_h;
+
+    // Threads this job may use itself (GOP segments of a video, or
+    // whatever fn does with them), taken out of the engine's workers
+    // while it runs. 0 for the engine default. Image jobs always run on
+    // one thread, as GraphicsMagick is limited to one per process.
+    int threads;
+
+    void *(*fn)(void *arg, int threads);
+    void *arg;
+
+    // Called on the worker thread when the job completes, before
+    // job_wait returns. May be NULL.
+    void (*done)(const job_result *result, void *user);
+    void *user;
+} job_request;
+
+// Options for job_engine_new. Zero-initialize for the defaults.
+typedef struct {
+    // Worker threads. Defaults to the number of online CPUs.
+    int workers;
+
+    // Jobs waiting to run before job_submit blocks and job_try_submit
+    // fails. Defaults to 4 per worker.
+    size_t queue_limit;
+
+    // Default thread budget of each job. Defaults to 1, so that whole
+    // jobs run in parallel rather than the parts of one.
+    int job_threads;
+} job_engine_options;
+
+// Returns a new job engine with its workers started, or NULL if it
+// could not be started. opts may be NULL.
+IMAGE_PROC_API job_engine *job_engine_new(const job_engine_options *opts);
+
+// Runs every job already submitted, then stops and frees this engine.
+IMAGE_PROC_API void job_engine_free(job_engine *e);
+
+// Queues a job, blocking while the queue is full. Jobs submitted from a
+// job running on this engine are never blocked, run within the budget
+// of the job that submitted them, and stay on its worker unless another
+// steals them. Returns NULL if the engine is stopping or out of memory.
+IMAGE_PROC_API job *job_submit(job_engine *e, const job_request *req);
+
+// As job_submit, but returns NULL with errno set to EAGAIN instead of
+// blocking while the queue is full.
+IMAGE_PROC_API job *job_try_submit(job_engine *e, const job_request *req);
+
+// Waits for this job to complete and copies out its result. Called from
+// a job, runs other queued jobs while it waits. Returns result->ok.
+IMAGE_PROC_API int job_wait(job *j, job_result *result);
+
+// Whether this job has completed, without waiting.
+IMAGE_PROC_API int job_done(job *j);
+
+// Releases this job. A job still running completes as usual,
+// and its results must then be taken by its done callback.
+IMAGE_PROC_API void job_free(job *j);
+
+// Used by the library's other modules; not exported.
+
+// The engine whose worker is calling, or NULL on any other thread. Work
+// split up by a job is submitted here, to run within the job's budget.
+job_engine *job_current_engine(void);
+
+#endif // _JOB_H
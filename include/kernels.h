@@ -0,0 +1,30 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include "common.h"
+
+// The pixel loops behind intensities and GIF optimization are compiled
+// for several instruction sets: "baseline", and on x86 "sse4.2", "avx2"
+// and "avx512". The best one this CPU supports is used, unless the
+// IMAGE_PROC_KERNELS environment variable names another.
+
+// Gets the name of the variant in use.
+IMAGE_PROC_API const char *kernels_active(void);
+
+// Switches every thread to the named variant. Returns 0, changing
+// nothing, if it is unknown or this CPU does not support it.
+IMAGE_PROC_API int kernels_select(const char *name);
+
+// Used by the library's other modules and its benchmarks; not exported.
+
+// Sums the RGB24 pixels of an image width pixels wide within bounds.
+rect_sum_t kernel_rect_sum(const uint8_t *rgb, uint32_t width, rect_t bounds);
+
+// Sums npixels PixelPackets, scaled to 8 bits.
+rect_sum_t kernel_pixel_sum(const void *pixels, long npixels);
+
+// Finds the first and last of npixels PixelPackets which visibly differ
+// between two rows. Returns 0 if none do.
+int kernel_row_changes(const void *prev, const void *this, long npixels, long *first, long *last);
+
+#endif // _KERNELS_H
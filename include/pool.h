@@ -0,0 +1,55 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "common.h"
+
+// GraphicsMagick allocates through these pools once the library is
+// loaded. Allocations the size of pixel rows or frames are served from
+// size-classed free lists kept per thread; smaller ones go straight to
+// malloc. Set IMAGE_PROC_NO_POOL in the environment to leave
+// GraphicsMagick on the system allocator.
+
+typedef struct {
+    uint64_t hits;     // Pooled allocations served from a free list
+    uint64_t misses;   // Pooled allocations which mapped new memory
+    uint64_t huge;     // Mappings backed by huge pages where possible
+    uint64_t system;   // Allocations too small to pool
+    uint64_t trimmed;  // Bytes returned to the OS from free lists
+    size_t retained;   // Bytes on free lists, across all threads
+    size_t in_use;     // Bytes of pooled allocations not yet freed
+} pool_stats;
+
+// Gets allocation counters for every thread.
+IMAGE_PROC_API pool_stats pool_get_stats(void);
+
+// Returns every free block held by the calling thread to the OS. Blocks
+// idle for a few seconds are returned anyway, as the thread allocates.
+// Each thread keeps at most 64MB of free blocks, and all threads
+// together at most 256MB.
+IMAGE_PROC_API void pool_trim(void);
+
+// Used by the library's other modules; not exported.
+
+// Allocates like malloc, from the calling thread's pools when
+// the size is worth pooling.
+void *pool_malloc(size_t size);
+
+// Frees memory from pool_malloc or pool_realloc. Aborts on anything else.
+void pool_free(void *ptr);
+
+// Resizes memory from pool_malloc, moving it only when it
+// outgrows its block or shrinks well below it.
+void *pool_realloc(void *ptr, size_t size);
+
+// Resets the calling thread's high-water mark to what it has allocated
+// now, and returns that.
+int64_t pool_thread_mark(void);
+
+// Most the calling thread has had allocated since pool_thread_mark.
+int64_t pool_thread_peak(void);
+
+// Raises the calling thread's high-water mark back to peak, as it
+// was before a nested pool_thread_mark.
+void pool_thread_restore(int64_t peak);
+
+#endif // _POOL_H
@@ -5,38 +5,113 @@
 
 typedef struct raster_image raster_image;
 
+// How raster_image_transform produced its output.
+typedef enum {
+    RASTER_TRANSFORM_FAILED,
+    RASTER_TRANSFORM_REENCODED, // Decoded, oriented, cropped and encoded again
+    RASTER_TRANSFORM_LOSSLESS   // JPEG DCT coefficients moved; nothing decoded
+} raster_transform_path;
+
+// Options for raster_image_transform. Zero-initialize to only orient.
+typedef struct {
+    // Crop to region, given in pixels of the oriented image.
+    // The end is clamped to the image.
+    int crop;
+    rect_t region;
+
+    // Let a JPEG stay lossless where it could not exactly: the crop start
+    // moves up and left to the nearest iMCU boundary, and partial iMCUs
+    // on edges which orientation moves to the top or left are dropped.
+    // An iMCU is 8 pixels times the largest sampling factor, so either
+    // is at most 31 pixels (7 or 15 for most JPEGs). Without this, those
+    // JPEGs are re-encoded instead.
+    int allow_block_alignment;
+
+    // Decode and re-encode even when the JPEG could be transformed losslessly.
+    int force_reencode;
+} raster_transform_options;
+
 // Returns a new raster_image pointer if this buffer was
 // successfully loaded, or NULL if it failed to load.
-raster_image *raster_image_from_buffer(const void *buf, size_t len);
+IMAGE_PROC_API raster_image *raster_image_from_buffer(const void *buf, size_t len);
 
 // Returns a new raster_image pointer if this file was
 // successfully loaded, or NULL if it failed to load.
-raster_image *raster_image_from_file(const char *filename);
+IMAGE_PROC_API raster_image *raster_image_from_file(const char *filename);
 
 // Invalidates and frees this raster_image.
-void raster_image_free(raster_image *ri);
+IMAGE_PROC_API void raster_image_free(raster_image *ri);
 
 // Gets the dimensions of this raster_image.
-dim_t raster_image_dimensions(raster_image *ri);
+IMAGE_PROC_API dim_t raster_image_dimensions(raster_image *ri);
 
 // Gets the frame count of this raster_image.
 // May be more than 1 for APNG or GIF.
-size_t raster_image_frame_count(raster_image *ri);
+IMAGE_PROC_API size_t raster_image_frame_count(raster_image *ri);
 
 // Gets corner intensities for this raster_image.
 // This takes the median frame for GIF.
-intensity_t raster_image_get_intensities(raster_image *ri);
+IMAGE_PROC_API intensity_t raster_image_get_intensities(raster_image *ri);
+
+// Gets corner intensities at n uniformly spaced times through the
+// animation into points, and how much each differs from the one before
+// it into scene (scene[0] is 0). A still image repeats its only frame.
+// Comparable to video_get_signature for the same content.
+IMAGE_PROC_API int raster_image_get_signature(raster_image *ri, size_t n, intensity_t *points, float *scene);
 
 // Scale this raster_image proportionally to either a height of max_h,
 // or a width of max_w, whichever is lesser. This preserves GIF animation.
-raster_image *raster_image_scale(raster_image *ri, size_t max_w, size_t max_h);
+IMAGE_PROC_API raster_image *raster_image_scale(raster_image *ri, size_t max_w, size_t max_h);
 
 // Write this raster_image to memory. You must free() the returned memory.
-buf_t raster_image_to_buffer(raster_image *ri);
+IMAGE_PROC_API buf_t raster_image_to_buffer(raster_image *ri);
 
 // Write this raster_image to a file.
-int raster_image_to_file(raster_image *ri, const char *filename);
+IMAGE_PROC_API int raster_image_to_file(raster_image *ri, const char *filename);
+
+IMAGE_PROC_API int raster_image_optimize(raster_image *ri);
+
+// Writes this buffer upright, with any EXIF orientation applied and
+// metadata stripped, and cropped if opts asks, in the format it is in.
+// JPEGs are transformed losslessly in the DCT domain where they can be,
+// and anything else is decoded and re-encoded; cropping an animation
+// fails. opts may be NULL.
+// The path taken is written to *path, if not NULL. You must free() the
+// returned memory, which is empty on failure.
+IMAGE_PROC_API buf_t raster_image_transform(const void *buf, size_t len, const raster_transform_options *opts, raster_transform_path *path);
+
+// Used by the library's other modules; not exported.
+
+// Transforms a JPEG to its EXIF orientation and crops it, without
+// decoding it. Returns 0, with *out empty, if that cannot be done exactly.
+// See src/jpeg_transform.c.
+int jpeg_transform(const void *buf, size_t len, const rect_t *crop, int align, buf_t *out);
+
+// Writes this raster_image to fd, which is left open. Returns 1 on success.
+int raster_image_to_fd(raster_image *ri, int fd);
+
+// Creates a single-frame raster_image with a blank pixel cache, to be
+// written through *pixels and committed with raster_image_sync_pixels.
+raster_image *raster_image_new_pixels(uint32_t width, uint32_t height, const char *magick, void **pixels, size_t *stride, int *depth);
+
+// Appends a blank frame the size of the first, exposed the same way.
+int raster_image_add_frame(raster_image *ri, void **pixels, size_t *stride);
+
+// Sets the delay, in centiseconds, of the last frame.
+void raster_image_set_delay(raster_image *ri, size_t delay);
+
+// Commits pixels written to the last frame.
+int raster_image_sync_pixels(raster_image *ri);
+
+typedef struct raster_frame_iter raster_frame_iter;
+
+// Composes the frames of a raster_image one at a time, on a single canvas.
+// raster_frame_iter_next returns NULL after the last frame.
+raster_frame_iter *raster_frame_iter_new(raster_image *ri);
+const void *raster_frame_iter_next(raster_frame_iter *it, size_t *stride, int *depth, int *delay);
+void raster_frame_iter_free(raster_frame_iter *it);
 
-int raster_image_optimize(raster_image *ri);
+// How much two sets of intensities differ, as a scene change score.
+float intensity_distance(intensity_t a, intensity_t b);
 
 #endif // _RASTER_IMAGE_H
@@ -0,0 +1,116 @@
+#ifndef _SERVER_H
+#define _SERVER_H
+
+#include "common.h"
+#include "fingerprint.h"
+
+// A supervisor process keeping a pool of forked workers, which serve
+// requests over a Unix socket. Each worker is one process, so a decode
+// which crashes or hangs takes down only its worker, and only its
+// request fails. Input and output bytes are passed as memfds, and never
+// go through the socket: workers map their input, and encode their
+// output straight into its memfd, which the client maps.
+
+typedef struct server server;
+typedef struct server_conn server_conn;
+
+typedef enum {
+    SERVER_FINGERPRINT, // -> type
+    SERVER_PROBE,       // -> type, dimensions, frames or duration
+    SERVER_SCALE,       // max_w, max_h -> output, in the input's format
+    SERVER_OPTIMIZE,    // Animated GIF -> optimized GIF output
+    SERVER_INTENSITIES, // -> intensities
+    SERVER_FRAME_AT,    // Video, seconds, max_w, max_h -> JPEG output
+    SERVER_VALIDATE     // Video -> error_time, frames, duration
+} server_op;
+
+// Options for server_new. Zero-initialize for the defaults.
+typedef struct {
+    // Worker processes. Defaults to the number of online CPUs.
+    int workers;
+
+    // Requests a worker serves before it is replaced, bounding what
+    // leaks or fragmentation can build up. Defaults to 1000.
+    size_t max_requests;
+
+    // Seconds one request may run before its worker is killed.
+    // Defaults to 30.
+    double timeout;
+
+    // Address space of each worker, in bytes. 0 for no limit.
+    size_t memory_limit;
+} server_options;
+
+// Counts kept by the supervisor
+typedef struct {
+    uint64_t started;  // Workers forked
+    uint64_t recycled; // Exited after max_requests
+    uint64_t crashed;  // Died on their own, by signal or error
+    uint64_t killed;   // Killed for exceeding the timeout
+    uint64_t requests; // Served by workers which have exited
+} server_stats;
+
+// A request. The input is fd when it is not negative, read from its
+// start to its end, and otherwise buf, which is copied into a memfd.
+typedef struct {
+    server_op op;
+
+    const void *buf;
+    size_t len;
+    int fd;
+
+    size_t max_w;
+    size_t max_h;
+    double seconds;
+} server_request;
+
+typedef struct {
+    int ok;
+    file_type type;
+    dim_t dimensions;
+    size_t frames;
+    double duration;
+    intensity_t intensities;
+    double error_time;  // Seconds to the first corrupt frame, or -1
+    buf_t output;       // Mapped read-only; freed by server_result_free
+    int worker_pid;     // Worker which ran the request
+} server_result;
+
+// Binds a socket at path, replacing any stale one, initializes the
+// library and forks the workers. Call from a single-threaded process.
+// Returns NULL if the socket could not be bound. opts may be NULL.
+IMAGE_PROC_API server *server_new(const char *path, const server_options *opts);
+
+// Replaces workers as they exit, crash or time out, until server_stop.
+IMAGE_PROC_API void server_run(server *s);
+
+// Makes server_run return. Safe to call from a signal handler.
+IMAGE_PROC_API void server_stop(server *s);
+
+// Gets the supervisor's counts so far.
+IMAGE_PROC_API server_stats server_get_stats(server *s);
+
+// Kills every worker, removes the socket, and frees this server.
+IMAGE_PROC_API void server_free(server *s);
+
+// Returns a connection to the server at path, or NULL if there is none.
+// A connection serves one request at a time. Each call is sent over a
+// socket of its own, so keeping a connection holds no worker between calls.
+IMAGE_PROC_API server_conn *server_connect(const char *path);
+
+// Runs a request on a worker. Returns result->ok. If the worker died
+// while running it, returns 0 with errno set to ECONNRESET; the next
+// call goes to another worker.
+IMAGE_PROC_API int server_call(server_conn *c, const server_request *req, server_result *result);
+
+// Unmaps the output of a result.
+IMAGE_PROC_API void server_result_free(server_result *result);
+
+// Closes this connection.
+IMAGE_PROC_API void server_disconnect(server_conn *c);
+
+// Returns a sealed memfd holding a copy of buf, which may be passed as
+// the input of any number of requests, or -1 if it could not be created.
+IMAGE_PROC_API int server_memfd(const void *buf, size_t len);
+
+#endif // _SERVER_H
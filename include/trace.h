@@ -0,0 +1,88 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "common.h"
+
+// Instrumentation of the stages library calls spend their time in.
+// Nothing is measured until trace_enable(1); while disabled, each stage
+// costs a call and a load of the switch.
+
+typedef enum {
+    TRACE_LOAD,      // BlobToImage, ReadImage
+    TRACE_ORIENT,    // AutoOrientImage
+    TRACE_COALESCE,  // Composing animation frames
+    TRACE_RESIZE,    // ResizeImage, every frame of one scale
+    TRACE_OPTIMIZE,  // gif_optimize
+    TRACE_ENCODE,    // ImageToBlob, WriteImage
+    TRACE_PROBE,     // avformat_find_stream_info
+    TRACE_DECODE,    // Decoding one video frame
+    TRACE_TRANSFORM, // Lossless JPEG orientation and crop
+    TRACE_STAGES
+} trace_stage;
+
+// One run of a stage, as passed to the callback. Times are in
+// nanoseconds; start is CLOCK_MONOTONIC.
+typedef struct {
+    trace_stage stage;
+    int64_t start;
+    int64_t wall;
+    int64_t cpu;        // CPU time of the calling thread
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t frames;
+    size_t peak_bytes;  // Most bytes the thread had allocated through
+                        // the pools above what it had at the start
+} trace_event;
+
+// Totals of every run of a stage
+typedef struct {
+    uint64_t calls;
+    int64_t wall;
+    int64_t cpu;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t frames;
+    size_t peak_bytes;  // Largest of any one run
+} trace_stage_stats;
+
+typedef struct {
+    trace_stage_stats stages[TRACE_STAGES];
+} trace_stats;
+
+// Measurement in progress. Used by the library around each stage.
+typedef struct {
+    int64_t start;
+    int64_t cpu;
+    int64_t allocated;
+    int64_t outer_peak; /// High-water mark of the span this one is in
+} trace_span;
+
+// Turns measurement on or off for every thread.
+IMAGE_PROC_API void trace_enable(int enabled);
+
+// Calls cb with every stage run, on the thread which ran it. Set
+// while tracing is disabled. cb may be NULL.
+IMAGE_PROC_API void trace_set_callback(void (*cb)(const trace_event *ev, void *user), void *user);
+
+// Adds stages run on the calling thread into stats, until replaced.
+// Returns the previous stats, to restore when the operation is done.
+// stats may be NULL.
+IMAGE_PROC_API trace_stats *trace_collect(trace_stats *stats);
+
+// Writes every stage run to filename as Chrome trace-event JSON, viewable
+// in chrome://tracing or Perfetto. Returns 0 if it could not be created.
+IMAGE_PROC_API int trace_chrome_open(const char *filename);
+
+// Finishes and closes the Chrome trace, if one is open.
+IMAGE_PROC_API void trace_chrome_close(void);
+
+// Gets a short name for this stage.
+IMAGE_PROC_API const char *trace_stage_name(trace_stage stage);
+
+// Starts measuring a stage on the calling thread.
+IMAGE_PROC_API trace_span trace_begin(void);
+
+// Finishes measuring a stage, and reports it.
+IMAGE_PROC_API void trace_end(trace_stage stage, trace_span *span, uint64_t bytes_in, uint64_t bytes_out, uint64_t frames);
+
+#endif // _TRACE_H
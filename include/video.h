@@ -2,9 +2,89 @@
 #define _VIDEO_H
 
 #include "common.h"
+#include "fingerprint.h"
+#include "raster_image.h"
 
 typedef struct video video;
 
+// Options for video_from_buffer_ex and video_from_file_ex.
+// Zero-initialize for the default behavior.
+typedef struct {
+    // Cap format probing, and skip stream analysis entirely when
+    // the container already describes every stream completely.
+    int fast_open;
+
+    // Bytes of a streamed input (video_from_fd) retained in memory so
+    // that the demuxer can seek back over them. Defaults to 4MB.
+    size_t stream_window;
+
+    // Size of the buffer the demuxer reads through. Defaults to 256KB.
+    // In-memory and mapped inputs bypass it for packet payloads, which
+    // are still copied once, from the input into each packet.
+    size_t io_buffer_size;
+
+    // A blob from video_build_index for this same input, which is opened
+    // and seeked without probing or scanning. A blob for other data, or
+    // one that can't be read, is ignored. Only read while opening.
+    const void *index;
+    size_t index_len;
+} video_options;
+
+// How a video decodes frames; see video_set_decode_mode.
+typedef enum {
+    VIDEO_DECODE_FULL,    // Every frame at full quality (the default)
+    VIDEO_DECODE_ANALYSIS // Reduced size and quality, for intensities and thumbnails
+} video_decode_mode;
+
+// Pixel layouts video_next_frame can produce.
+typedef enum {
+    VIDEO_PIX_RGB24, // Packed 8-bit RGB (the default)
+    VIDEO_PIX_RGBA,  // Packed 8-bit RGBA, alpha opaque unless the video has it
+    VIDEO_PIX_GRAY8  // 8-bit luma
+} video_pix_fmt;
+
+// A decoded frame from video_next_frame. The pixels stay valid until
+// the frame is passed to video_frame_release, even after video_free.
+typedef struct {
+    const uint8_t *data;
+    size_t stride;
+    dim_t dimensions;
+    double time;  /// Seconds from the start of the video
+    int keyframe;
+    void *ref;    /// Pooled buffer holding data
+} video_frame;
+
+// Result of video_validate.
+typedef struct {
+    int64_t error_pts;  // pts of the first corrupt frame, in the video
+                        // stream's time base, or INT64_MIN if none
+    double error_time;  // Seconds from the start to it, or -1 if none
+    size_t frames;      // Frames decoded
+    double duration;    // Seconds from the start to the end of the last frame
+} video_validation;
+
+// How video_scale_ex produced its result.
+typedef enum {
+    VIDEO_SCALE_FAILED,
+    VIDEO_SCALE_TRANSCODED, // Decoded, scaled and re-encoded
+    VIDEO_SCALE_REMUXED     // Already fit; packets copied to a new container
+} video_scale_path;
+
+// Options for video_scale_ex. Zero-initialize for the defaults.
+typedef struct {
+    // Segments transcoded concurrently, split on keyframes.
+    // 0 or 1 transcodes serially. Either way, the encoded video is
+    // held in memory until every segment is done, and then muxed.
+    int workers;
+
+    // Move the MP4 moov atom ahead of the media data, so that
+    // the output can be played while it downloads.
+    int faststart;
+
+    // Re-encode even when the input already fits and could be copied.
+    int force_transcode;
+} video_scale_options;
+
 // Returns a new video pointer if this buffer was
 // successfully loaded, or NULL if it failed to load.
 //
@@ -12,33 +92,153 @@ typedef struct video video;
 // it internally. Do not free or modify this memory after
 // passing it to video_from_buffer; it will be freed
 // automatically.
-video *video_from_buffer(void *buf, size_t len);
+IMAGE_PROC_API video *video_from_buffer(void *buf, size_t len);
 
 // Returns a new video pointer if this file was
 // successfully loaded, or NULL if it failed to load.
-video *video_from_file(const char *filename);
+IMAGE_PROC_API video *video_from_file(const char *filename);
+
+// As video_from_buffer, with options. opts may be NULL.
+IMAGE_PROC_API video *video_from_buffer_ex(void *buf, size_t len, const video_options *opts);
+
+// As video_from_file, with options. opts may be NULL.
+IMAGE_PROC_API video *video_from_file_ex(const char *filename, const video_options *opts);
+
+// Returns a new video pointer reading from this descriptor, which may
+// be a pipe or socket, or NULL if it failed to load. The input is read
+// strictly forward, with only opts->stream_window bytes kept for seeking
+// back; operations which need to seek further fail with errno set to
+// ESPIPE. Duration and intensities are found in one forward pass.
+// The descriptor is not closed by video_free.
+IMAGE_PROC_API video *video_from_fd(int fd, const video_options *opts);
+
+// Encodes the frames of this raster_image (typically an animated GIF)
+// as a new in-memory video, with container VIDEO_WEBM (VP9) or VIDEO_MP4
+// (H.264). Frame delays are kept as variable frame timing. Frames are
+// composed and encoded one at a time, never all coalesced at once.
+// Returns NULL if it failed to encode.
+IMAGE_PROC_API video *video_from_raster_image(raster_image *ri, file_type container);
 
 // Invalidates and frees this video.
-void video_free(video *v);
+IMAGE_PROC_API void video_free(video *v);
 
 // Gets the dimensions of this video.
-dim_t video_dimensions(video *v);
+IMAGE_PROC_API dim_t video_dimensions(video *v);
 
 // Gets the duration, in seconds, of this video.
-double video_duration(video *v);
+IMAGE_PROC_API double video_duration(video *v);
 
 // Gets corner intensities for the median time of this video.
 // This method may fail if the video is unreadable.
-int video_get_intensities(video *v, intensity_t *i);
+IMAGE_PROC_API int video_get_intensities(video *v, intensity_t *i);
+
+// Gets corner intensities at n uniformly spaced times through this video
+// into points, and how much each differs from the one before it into
+// scene (scene[0] is 0), in one forward pass. Each point is the frame on
+// screen at its time; with keyframes_only, the last keyframe before it,
+// which is much cheaper to find. Comparable to raster_image_get_signature
+// for the same content, so animations and their conversions match.
+IMAGE_PROC_API int video_get_signature(video *v, size_t n, int keyframes_only, intensity_t *points, float *scene);
+
+// Decodes the frame displayed at the given time, seeking to the
+// preceding keyframe, and scales it proportionally to fit within
+// max_w x max_h. Returns NULL if no frame could be decoded.
+IMAGE_PROC_API raster_image *video_frame_at(video *v, double seconds, size_t max_w, size_t max_h);
+
+// Captures n frames at evenly spaced times in one pass over the stream,
+// scaling each to fit within cell_w x cell_h and tiling them cols per
+// row into a single image. Each cell holds the first frame at or after
+// its time (the first keyframe, with keyframes_only). If timestamps is
+// not NULL, the time of each captured frame is written to it, or -1 for
+// a cell left empty. Returns NULL if no frame could be decoded.
+IMAGE_PROC_API raster_image *video_storyboard(video *v, size_t n, size_t cols, size_t cell_w, size_t cell_h, int keyframes_only, double *timestamps);
+
+// Builds a short looping preview of this video from clips evenly
+// spaced excerpts, each clip_len seconds long. Each clip is decoded from
+// the keyframe before it, with frames dropped down to fps, and scaled to
+// fit within max_w x max_h. format is IMAGE_GIF (optimized, through
+// raster_image), VIDEO_WEBM or VIDEO_MP4. You must free() the returned
+// memory, which is empty if the preview could not be made.
+IMAGE_PROC_API buf_t video_preview(video *v, size_t clips, double clip_len, double fps, size_t max_w, size_t max_h, file_type format);
+
+// Sets how this video decodes frames for video_get_intensities,
+// video_get_signature and video_next_frame, until changed again.
+// VIDEO_DECODE_ANALYSIS decodes at reduced size where the codec supports
+// it, skips non-reference frames and loop filtering, and scales with a
+// fast filter, straight to a small size for intensities. Results are
+// approximate and frame sizes may be smaller than video_dimensions.
+// Every other operation decodes every frame at full quality in either
+// mode. Changing mode restarts video_next_frame.
+IMAGE_PROC_API int video_set_decode_mode(video *v, video_decode_mode mode);
+
+// Sets the layout of frames from video_next_frame. With width and height
+// 0, each frame keeps its own size; otherwise every frame is scaled to
+// exactly width x height. Returns 0 if fmt is not a video_pix_fmt.
+IMAGE_PROC_API int video_set_frame_format(video *v, video_pix_fmt fmt, size_t width, size_t height);
+
+// Decodes the next frame of this video into f, in display order, from
+// the start of the video on the first call. Frame buffers are recycled
+// from a pool once released, so steady-state iteration allocates
+// nothing. Returns 0 at end of stream, or if the video is unreadable.
+// Other calls which read the video move its position; call video_rewind
+// before resuming.
+IMAGE_PROC_API int video_next_frame(video *v, video_frame *f);
+
+// Returns the buffer of a frame from video_next_frame to its pool.
+IMAGE_PROC_API void video_frame_release(video_frame *f);
+
+// Restarts video_next_frame at the start of the video. On a streamed
+// input this fails with errno set to ESPIPE once the start has left
+// the retained window.
+IMAGE_PROC_API int video_rewind(video *v);
 
 // Scale this video proportionally to either a height of max_h,
 // or a width of max_w, whichever is lesser.
-video *video_scale(video *v, size_t max_w, size_t max_h);
+IMAGE_PROC_API video *video_scale(video *v, size_t max_w, size_t max_h);
+
+// As video_scale, but splits the video on keyframes into up to workers
+// segments, which are decoded, scaled and encoded concurrently and then
+// joined in order. Audio is passed through unchanged. Encoded packets
+// of every segment are held in memory until they are joined. Called
+// from a job engine's job, the segments run as jobs nested in it, within
+// its thread budget, instead of on threads of their own; so do
+// video_validate's.
+IMAGE_PROC_API video *video_scale_parallel(video *v, size_t max_w, size_t max_h, int workers);
+
+// As video_scale, with options. opts may be NULL. When the video already
+// fits within max_w x max_h it is remuxed without re-encoding, dropping
+// any streams that cannot be kept. The path taken is written to *path,
+// if not NULL.
+IMAGE_PROC_API video *video_scale_ex(video *v, size_t max_w, size_t max_h, const video_scale_options *opts, video_scale_path *path);
+
+// Decodes every frame of this video, with the decoder's error
+// concealment off, to check that it decodes cleanly end to end. The
+// video is split on keyframes into up to workers segments, decoded
+// concurrently. With stop_early, decoding stops at the first error,
+// while still finding the earliest one, and frames and duration only
+// cover what was decoded. Returns 1 if every frame decoded cleanly.
+IMAGE_PROC_API int video_validate(video *v, int workers, int stop_early, video_validation *result);
+
+// Builds a compact keyframe index of this video (keyframe positions,
+// duration, frame count and stream parameters), to be stored alongside
+// it and passed back through video_options.index. Not available for
+// streamed inputs. You must free() the returned memory, which is empty
+// if the index could not be built.
+IMAGE_PROC_API buf_t video_build_index(video *v);
 
 // Write this video to memory. You must free() the returned memory.
-buf_t video_to_buffer(video *v);
+IMAGE_PROC_API buf_t video_to_buffer(video *v);
+
+// Write this video to a file. Returns 1 on success.
+IMAGE_PROC_API int video_to_file(video *v, const char *filename);
+
+// Used by the library's other modules; not exported.
+
+// Moves the moov atom of the MP4 file in buf in front of its first mdat
+// atom, in place. Returns 1 if the file was rewritten, or 0 if not.
+int mp4_faststart(uint8_t *buf, size_t len);
 
-// Write this video to a file.
-int video_to_file(video *v, const char *filename);
+// Writes this video to fd, which is left open. Returns 1 on success.
+int video_to_fd(video *v, int fd);
 
 #endif // _VIDEO_H
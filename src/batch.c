@@ -0,0 +1,509 @@
+#include "batch.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define MAX_IN_FLIGHT (256 * 1024 * 1024)
+#define QUEUE_DEPTH   64
+#define READ_THREADS  8
+
+typedef struct batch_node {
+    batch_item item;
+    struct batch_node *next;
+} batch_node;
+
+struct batch_reader {
+    const char *const *paths;
+    size_t n;
+    size_t next;       /// Next path to start reading
+    size_t delivered;  /// Items handed out by batch_next
+    size_t dropped;    /// Items lost for want of memory to report them
+
+    size_t max_in_flight;
+    size_t in_flight;  /// Bytes reserved by reads, until released
+    int queue_depth;
+    int stopping;
+
+    batch_node *ready;  /// Read and waiting for batch_next, oldest first
+    batch_node *last;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;   /// An item is ready, or everything is
+    pthread_cond_t space;  /// Bytes were released
+
+    pthread_t *threads;
+    int nthreads;
+    int started;
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    int uring;
+#endif
+};
+
+static int reserve(batch_reader *b, size_t size, int block)
+{
+    // A file bigger than the whole limit still gets read once
+    // nothing else is, rather than never
+    pthread_mutex_lock(&b->lock);
+
+    while (block && !b->stopping && b->in_flight > 0 && b->in_flight + size > b->max_in_flight)
+        pthread_cond_wait(&b->space, &b->lock);
+
+    int ok = !b->stopping && (b->in_flight == 0 || b->in_flight + size <= b->max_in_flight);
+
+    if (ok)
+        b->in_flight += size;
+
+    pthread_mutex_unlock(&b->lock);
+
+    return ok;
+}
+
+static void unreserve(batch_reader *b, size_t size)
+{
+    if (size == 0)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    b->in_flight -= size;
+    pthread_cond_broadcast(&b->space);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static int claim_path(batch_reader *b, size_t *index)
+{
+    pthread_mutex_lock(&b->lock);
+
+    int ok = !b->stopping && b->next < b->n;
+    if (ok)
+        *index = b->next++;
+
+    pthread_mutex_unlock(&b->lock);
+
+    return ok;
+}
+
+static void finish_item(batch_reader *b, batch_node *node)
+{
+    pthread_mutex_lock(&b->lock);
+
+    if (node) {
+        if (b->last)
+            b->last->next = node;
+        else
+            b->ready = node;
+
+        b->last = node;
+    } else {
+        b->dropped++;
+    }
+
+    pthread_cond_broadcast(&b->done);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static batch_node *open_item(batch_reader *b, size_t index, int *fd, size_t *size)
+{
+    // Opens the file at index and sizes it. Failures are
+    // filled into the node, with *fd left at -1.
+    batch_node *node = (batch_node *) calloc(1, sizeof(batch_node));
+    struct stat st;
+
+    *fd = -1;
+
+    if (!node)
+        return NULL;
+
+    node->item.index = index;
+    node->item.path  = b->paths[index];
+
+    errno = 0;
+    *fd = open(node->item.path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        node->item.error = errno;
+        return node;
+    }
+
+    if (fstat(*fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        node->item.error = errno ? errno : EINVAL;
+        close(*fd);
+        *fd = -1;
+        return node;
+    }
+
+    *size = st.st_size;
+
+    return node;
+}
+
+static void *read_thread(void *opaque)
+{
+    // Fallback: each thread reads whole files with pread, one at a time
+    batch_reader *b = (batch_reader *) opaque;
+    size_t index, size = 0;
+    int fd;
+
+    while (claim_path(b, &index)) {
+        batch_node *node = open_item(b, index, &fd, &size);
+
+        if (!node || fd < 0) {
+            finish_item(b, node);
+            continue;
+        }
+
+        if (!reserve(b, size, 1)) {
+            close(fd);
+            free(node);
+            break;
+        }
+
+        batch_item *item = &node->item;
+        size_t got = 0;
+
+        item->buf.buf = malloc(MAX(size, 1));
+
+        if (!item->buf.buf)
+            item->error = ENOMEM;
+
+        while (item->buf.buf && got < size) {
+            ssize_t ret = pread(fd, (uint8_t *) item->buf.buf + got, size - got, got);
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret < 0)
+                item->error = errno;
+            if (ret <= 0)
+                break;
+
+            got += ret;
+        }
+
+        close(fd);
+
+        if (item->error) {
+            free(item->buf.buf);
+            item->buf.buf = NULL;
+            got = 0;
+        }
+
+        // Shrank while being read
+        unreserve(b, size - got);
+        item->buf.len = got;
+
+        finish_item(b, node);
+    }
+
+    // Reading is done; keep nothing pooled while the thread is joined
+    pool_trim();
+
+    return NULL;
+}
+
+#ifdef HAVE_LIBURING
+typedef struct {
+    batch_node *node;
+    int fd;
+    size_t size; /// Bytes reserved
+    size_t got;
+} uring_read;
+
+static int queue_read(batch_reader *b, uring_read *r)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&b->ring);
+    if (!sqe)
+        return 0;
+
+    // Reads of more than 2GB come back short, and are resubmitted
+    io_uring_prep_read(sqe, r->fd, (uint8_t *) r->node->item.buf.buf + r->got, MIN(r->size - r->got, 1U << 30), r->got);
+    io_uring_sqe_set_data(sqe, r);
+
+    return 1;
+}
+
+static void finish_read(batch_reader *b, uring_read *r, int error)
+{
+    batch_item *item = &r->node->item;
+
+    close(r->fd);
+
+    if (error) {
+        item->error = error;
+        free(item->buf.buf);
+        item->buf.buf = NULL;
+        r->got = 0;
+    }
+
+    unreserve(b, r->size - r->got);
+    item->buf.len = r->got;
+
+    finish_item(b, r->node);
+    free(r);
+}
+
+static void *uring_thread(void *opaque)
+{
+    // One thread keeps up to queue_depth reads in the ring. Opens are
+    // done here directly; they are cheap next to the reads.
+    batch_reader *b = (batch_reader *) opaque;
+    batch_node *pending = NULL; /// Opened, waiting for room in the limit
+    int pending_fd = -1;
+    size_t pending_size = 0;
+    int outstanding = 0;
+
+    while (1) {
+        while (outstanding < b->queue_depth) {
+            size_t index;
+
+            if (!pending) {
+                if (!claim_path(b, &index))
+                    break;
+
+                pending = open_item(b, index, &pending_fd, &pending_size);
+
+                if (!pending || pending_fd < 0) {
+                    finish_item(b, pending);
+                    pending = NULL;
+                    continue;
+                }
+            }
+
+            // Only wait for room when there is nothing to reap instead.
+            // Failing that, the reader is stopping.
+            if (!reserve(b, pending_size, outstanding == 0)) {
+                if (outstanding > 0)
+                    break;
+
+                close(pending_fd);
+                free(pending);
+                pending = NULL;
+                goto done;
+            }
+
+            uring_read *r = (uring_read *) calloc(1, sizeof(uring_read));
+            batch_node *node = pending;
+
+            pending = NULL;
+
+            if (r)
+                node->item.buf.buf = malloc(MAX(pending_size, 1));
+
+            if (!r || !node->item.buf.buf) {
+                close(pending_fd);
+                unreserve(b, pending_size);
+                node->item.error = ENOMEM;
+                finish_item(b, node);
+                free(r);
+                continue;
+            }
+
+            *r = (uring_read) { .node = node, .fd = pending_fd, .size = pending_size };
+
+            if (r->size == 0) {
+                finish_read(b, r, 0);
+                continue;
+            }
+
+            if (!queue_read(b, r)) {
+                finish_read(b, r, EAGAIN);
+                continue;
+            }
+
+            outstanding++;
+        }
+
+        if (outstanding == 0 && !pending)
+            break;
+
+        io_uring_submit(&b->ring);
+
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&b->ring, &cqe) < 0)
+            continue;
+
+        // Reap everything that has completed
+        do {
+            uring_read *r = (uring_read *) io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+
+            io_uring_cqe_seen(&b->ring, cqe);
+            outstanding--;
+
+            if (res > 0)
+                r->got += res;
+
+            if (res == -EINTR || res == -EAGAIN || (res > 0 && r->got < r->size)) {
+                if (queue_read(b, r)) {
+                    outstanding++;
+                    continue;
+                }
+
+                res = -EAGAIN;
+            }
+
+            // 0 is end of file, for a file that shrank
+            finish_read(b, r, res < 0 ? -res : 0);
+        } while (io_uring_peek_cqe(&b->ring, &cqe) == 0);
+    }
+
+done:
+    // Stopping: let the reads already in the ring land before their
+    // buffers go away
+    while (outstanding > 0) {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&b->ring, &cqe) < 0)
+            break;
+
+        finish_read(b, (uring_read *) io_uring_cqe_get_data(cqe), ECANCELED);
+        io_uring_cqe_seen(&b->ring, cqe);
+        outstanding--;
+    }
+
+    pool_trim();
+
+    return NULL;
+}
+#endif
+
+// Starts reading every file in paths, in the background.
+batch_reader *batch_open(const char *const *paths, size_t n, const batch_options *opts)
+{
+    batch_options o = opts ? *opts : (batch_options) { 0 };
+    void *(*start)(void *) = &read_thread;
+
+    batch_reader *b = (batch_reader *) calloc(1, sizeof(batch_reader));
+    if (!b)
+        return NULL;
+
+    b->paths = paths;
+    b->n     = n;
+
+    b->max_in_flight = o.max_in_flight ? o.max_in_flight : MAX_IN_FLIGHT;
+    b->queue_depth   = o.queue_depth > 0 ? o.queue_depth : QUEUE_DEPTH;
+    b->nthreads      = o.threads > 0 ? o.threads : READ_THREADS;
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->done, NULL);
+    pthread_cond_init(&b->space, NULL);
+
+#ifdef HAVE_LIBURING
+    // Kernels without io_uring, or sandboxes which block
+    // it, get the thread pool instead
+    if (io_uring_queue_init(b->queue_depth, &b->ring, 0) == 0) {
+        b->uring    = 1;
+        b->nthreads = 1;
+        start       = &uring_thread;
+    }
+#endif
+
+    b->threads = (pthread_t *) calloc(b->nthreads, sizeof(pthread_t));
+    if (!b->threads)
+        goto error;
+
+    for (; b->started < b->nthreads; ++b->started)
+        if (pthread_create(&b->threads[b->started], NULL, start, b) != 0)
+            goto error;
+
+    return b;
+
+error:
+    batch_close(b);
+    return NULL;
+}
+
+// Waits for the next file to be read.
+int batch_next(batch_reader *b, batch_item *item)
+{
+    pthread_mutex_lock(&b->lock);
+
+    while (!b->ready && b->delivered + b->dropped < b->n && !b->stopping)
+        pthread_cond_wait(&b->done, &b->lock);
+
+    batch_node *node = b->ready;
+
+    if (node) {
+        b->ready = node->next;
+        if (!b->ready)
+            b->last = NULL;
+
+        b->delivered++;
+    }
+
+    pthread_mutex_unlock(&b->lock);
+
+    if (!node)
+        return 0;
+
+    *item = node->item;
+    free(node);
+
+    return 1;
+}
+
+// Frees the contents of item, making room for more reads.
+void batch_release(batch_reader *b, batch_item *item)
+{
+    free(item->buf.buf);
+    batch_detach(b, item);
+}
+
+// Makes room for more reads, handing the contents to the caller.
+void batch_detach(batch_reader *b, batch_item *item)
+{
+    unreserve(b, item->buf.len);
+
+    item->buf.buf = NULL;
+    item->buf.len = 0;
+}
+
+// Stops reading and frees this batch_reader.
+void batch_close(batch_reader *b)
+{
+    if (!b)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    b->stopping = 1;
+    pthread_cond_broadcast(&b->done);
+    pthread_cond_broadcast(&b->space);
+    pthread_mutex_unlock(&b->lock);
+
+    for (int i = 0; i < b->started; ++i)
+        pthread_join(b->threads[i], NULL);
+
+#ifdef HAVE_LIBURING
+    if (b->uring)
+        io_uring_queue_exit(&b->ring);
+#endif
+
+    while (b->ready) {
+        batch_node *next = b->ready->next;
+
+        free(b->ready->item.buf.buf);
+        free(b->ready);
+
+        b->ready = next;
+    }
+
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->done);
+    pthread_cond_destroy(&b->space);
+
+    free(b->threads);
+    free(b);
+}
@@ -0,0 +1,827 @@
+#include "cache.h"
+#include "fingerprint.h"
+#include "raster_image.h"
+#include "video.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define MEMORY_LIMIT  (64 * 1024 * 1024)
+#define DISK_LIMIT    (1024 * 1024 * 1024)
+#define SEGMENT_SIZE  (64 * 1024 * 1024)
+#define SLOT_BYTES    (16 * 1024)
+#define MAX_SEGMENTS  4096
+
+// Index slots tried for each key before one is evicted
+#define PROBES 8
+
+#define INDEX_MAGIC   0x58444e49 // "INDX"
+#define INDEX_VERSION 1
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct mem_entry {
+    cache_key key;
+    struct mem_entry *chain; /// Next in bucket
+    struct mem_entry *prev;  /// LRU order, most recent first
+    struct mem_entry *next;
+    size_t len;
+    uint8_t data[];
+} mem_entry;
+
+// The index file, mapped shared by every process. Counters and
+// segment generations are updated atomically; everything else is
+// written only under an exclusive flock.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segment_size;
+    uint64_t nslots;
+    uint32_t nsegments;
+    uint32_t head;        /// Segment being written
+    uint64_t head_offset; /// Next free byte in it
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t insertions;
+    uint8_t reserved[48];
+} disk_header;
+
+typedef struct {
+    uint32_t generation; /// Generation of the segment entries were written in
+    uint32_t entries;    /// Live entries written in this generation
+} disk_segment;
+
+typedef struct {
+    uint64_t input;
+    uint64_t op;
+    uint32_t segment;
+    uint32_t generation; /// 0 for an empty slot
+    uint64_t offset;
+    uint64_t length;
+} disk_slot;
+
+// Precedes each result in a segment file
+typedef struct {
+    uint64_t input;
+    uint64_t op;
+    uint64_t length;
+} disk_record;
+
+struct cache {
+    pthread_mutex_t lock;
+
+    mem_entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    mem_entry *newest;
+    mem_entry *oldest;
+    size_t memory_used;
+    size_t memory_limit;
+
+    uint64_t memory_hits;
+    uint64_t memory_misses;
+    uint64_t memory_evictions;
+
+    char *directory;
+    int index_fd;
+    uint8_t *index;
+    size_t index_len;
+    disk_header *header;
+    disk_segment *segments;
+    disk_slot *slots;
+    int *segment_fds;
+    uint8_t **segment_maps;
+};
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc  = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Hashes input bytes with XXH64.
+uint64_t cache_hash(const void *buf, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+        }
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h  = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= read32(p) * PRIME64_1;
+        h  = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; ++p) {
+        h ^= *p * PRIME64_5;
+        h  = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+// Builds the key for the result of op, with params, on these input bytes.
+cache_key cache_key_for(const void *input, size_t len, const char *op, const void *params, size_t params_len)
+{
+    // The input is read once; the operation is seeded with
+    // its length so that the two halves are independent
+    cache_key key = { .input = cache_hash(input, len, 0) };
+
+    key.op = cache_hash(op, strlen(op) + 1, len);
+    key.op = cache_hash(params, params_len, key.op);
+
+    return key;
+}
+
+static int key_equal(cache_key a, cache_key b)
+{
+    return a.input == b.input && a.op == b.op;
+}
+
+static size_t bucket_of(cache *c, cache_key key)
+{
+    return (key.input ^ key.op) & (c->nbuckets - 1);
+}
+
+static void lru_unlink(cache *c, mem_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->newest = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->oldest = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(cache *c, mem_entry *e)
+{
+    e->prev = NULL;
+    e->next = c->newest;
+
+    if (c->newest)
+        c->newest->prev = e;
+    else
+        c->oldest = e;
+
+    c->newest = e;
+}
+
+static mem_entry *memory_find(cache *c, cache_key key, mem_entry ***link)
+{
+    // Also finds the pointer to the entry, for unlinking it
+    mem_entry **l = &c->buckets[bucket_of(c, key)];
+
+    for (; *l; l = &(*l)->chain) {
+        if (key_equal((*l)->key, key)) {
+            if (link)
+                *link = l;
+
+            return *l;
+        }
+    }
+
+    return NULL;
+}
+
+static void memory_remove(cache *c, cache_key key)
+{
+    mem_entry **link;
+    mem_entry *e = memory_find(c, key, &link);
+
+    if (!e)
+        return;
+
+    *link = e->chain;
+    lru_unlink(c, e);
+
+    c->memory_used -= e->len;
+    c->nentries--;
+
+    free(e);
+}
+
+static void memory_grow(cache *c)
+{
+    // Keeps chains short; a failure only makes them longer
+    size_t nbuckets = c->nbuckets * 2;
+    mem_entry **buckets = (mem_entry **) calloc(nbuckets, sizeof(mem_entry *));
+
+    if (!buckets)
+        return;
+
+    for (size_t i = 0; i < c->nbuckets; ++i) {
+        mem_entry *e = c->buckets[i];
+
+        while (e) {
+            mem_entry *next = e->chain;
+            size_t b = (e->key.input ^ e->key.op) & (nbuckets - 1);
+
+            e->chain = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+
+    free(c->buckets);
+
+    c->buckets  = buckets;
+    c->nbuckets = nbuckets;
+}
+
+static int memory_put(cache *c, cache_key key, const void *data, size_t len)
+{
+    if (len > c->memory_limit)
+        return 0;
+
+    mem_entry *e = (mem_entry *) malloc(sizeof(mem_entry) + len);
+    if (!e)
+        return 0;
+
+    e->key = key;
+    e->len = len;
+    memcpy(e->data, data, len);
+
+    memory_remove(c, key);
+
+    while (c->oldest && c->memory_used + len > c->memory_limit) {
+        memory_remove(c, c->oldest->key);
+        c->memory_evictions++;
+    }
+
+    if (c->nentries >= c->nbuckets)
+        memory_grow(c);
+
+    size_t b = bucket_of(c, key);
+
+    e->chain = c->buckets[b];
+    c->buckets[b] = e;
+
+    lru_push(c, e);
+
+    c->memory_used += len;
+    c->nentries++;
+
+    return 1;
+}
+
+static uint8_t *segment_map(cache *c, uint32_t segment, int create)
+{
+    // Segment files are created full size, so a mapping never
+    // runs past the end of one
+    if (c->segment_maps[segment])
+        return c->segment_maps[segment];
+
+    size_t size = c->header->segment_size;
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/segment.%u", c->directory, segment);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size < size && (!create || ftruncate(fd, size) < 0))) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    c->segment_fds[segment]  = fd;
+    c->segment_maps[segment] = (uint8_t *) map;
+
+    return c->segment_maps[segment];
+}
+
+static int slot_live(cache *c, const disk_slot *s)
+{
+    return s->generation != 0 && s->segment < c->header->nsegments &&
+           __atomic_load_n(&c->segments[s->segment].generation, __ATOMIC_ACQUIRE) == s->generation;
+}
+
+static int disk_get(cache *c, cache_key key, buf_t *out)
+{
+    disk_header *h = c->header;
+    int found = 0;
+
+    flock(c->index_fd, LOCK_SH);
+
+    for (size_t p = 0; p < PROBES && !found; ++p) {
+        disk_slot *s = &c->slots[(key.input + p) % h->nslots];
+
+        if (!slot_live(c, s) || s->input != key.input || s->op != key.op)
+            continue;
+
+        uint8_t *map = segment_map(c, s->segment, 0);
+        if (!map || s->offset + sizeof(disk_record) + s->length > h->segment_size)
+            continue;
+
+        // The record itself must agree, in case the slot
+        // outlived a crash halfway through a write
+        disk_record rec;
+        memcpy(&rec, &map[s->offset], sizeof(rec));
+
+        if (rec.input != key.input || rec.op != key.op || rec.length != s->length)
+            continue;
+
+        out->buf = malloc(MAX(rec.length, 1));
+        if (!out->buf)
+            break;
+
+        memcpy(out->buf, &map[s->offset + sizeof(rec)], rec.length);
+        out->len = rec.length;
+
+        found = 1;
+    }
+
+    flock(c->index_fd, LOCK_UN);
+
+    __atomic_fetch_add(found ? &h->hits : &h->misses, 1, __ATOMIC_RELAXED);
+
+    return found;
+}
+
+static void advance_segment(cache *c)
+{
+    // Start over in the oldest segment, dropping everything in it
+    disk_header *h = c->header;
+    uint32_t head = (h->head + 1) % h->nsegments;
+    disk_segment *seg = &c->segments[head];
+
+    __atomic_fetch_add(&h->evictions, seg->entries, __ATOMIC_RELAXED);
+
+    uint32_t generation = seg->generation + 1;
+    if (generation == 0)
+        generation = 1;
+
+    __atomic_store_n(&seg->generation, generation, __ATOMIC_RELEASE);
+
+    seg->entries    = 0;
+    h->head         = head;
+    h->head_offset  = 0;
+}
+
+static int disk_put(cache *c, cache_key key, const void *data, size_t len)
+{
+    disk_header *h = c->header;
+    size_t need = (sizeof(disk_record) + len + 7) & ~(size_t) 7;
+
+    if (need > h->segment_size)
+        return 0;
+
+    int ok = 0;
+
+    flock(c->index_fd, LOCK_EX);
+
+    if (h->head_offset + need > h->segment_size)
+        advance_segment(c);
+
+    if (!segment_map(c, h->head, 1))
+        goto done;
+
+    disk_record rec = { key.input, key.op, len };
+    int fd = c->segment_fds[h->head];
+
+    if (pwrite(fd, &rec, sizeof(rec), h->head_offset) != sizeof(rec) ||
+        pwrite(fd, data, len, h->head_offset + sizeof(rec)) != (ssize_t) len)
+        goto done;
+
+    // An empty, stale or matching slot, or else
+    // the first one is evicted for it
+    disk_slot *slot = NULL;
+
+    for (size_t p = 0; p < PROBES && !slot; ++p) {
+        disk_slot *s = &c->slots[(key.input + p) % h->nslots];
+
+        if (!slot_live(c, s) || (s->input == key.input && s->op == key.op))
+            slot = s;
+    }
+
+    if (!slot) {
+        slot = &c->slots[key.input % h->nslots];
+
+        c->segments[slot->segment].entries--;
+        __atomic_fetch_add(&h->evictions, 1, __ATOMIC_RELAXED);
+    } else if (slot_live(c, slot)) {
+        // Replaced by the new copy
+        c->segments[slot->segment].entries--;
+    }
+
+    *slot = (disk_slot) {
+        .input      = key.input,
+        .op         = key.op,
+        .segment    = h->head,
+        .generation = c->segments[h->head].generation,
+        .offset     = h->head_offset,
+        .length     = len
+    };
+
+    c->segments[h->head].entries++;
+    h->head_offset += need;
+
+    __atomic_fetch_add(&h->insertions, 1, __ATOMIC_RELAXED);
+
+    ok = 1;
+
+done:
+    flock(c->index_fd, LOCK_UN);
+    return ok;
+}
+
+static int disk_open(cache *c, const cache_options *o)
+{
+    char path[PATH_MAX];
+
+    if (mkdir(c->directory, 0755) < 0 && errno != EEXIST)
+        return 0;
+
+    snprintf(path, sizeof(path), "%s/index", c->directory);
+
+    c->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (c->index_fd < 0)
+        return 0;
+
+    // Only one process sets up a new index
+    flock(c->index_fd, LOCK_EX);
+
+    struct stat st;
+    if (fstat(c->index_fd, &st) < 0)
+        goto error;
+
+    disk_header h = { 0 };
+    int created = st.st_size == 0;
+
+    if (created) {
+        size_t disk_limit = o->disk_limit ? o->disk_limit : DISK_LIMIT;
+
+        h.magic        = INDEX_MAGIC;
+        h.version      = INDEX_VERSION;
+        h.segment_size = o->segment_size ? o->segment_size : SEGMENT_SIZE;
+        h.nsegments    = MIN(MAX(disk_limit / h.segment_size, 2), MAX_SEGMENTS);
+        h.nslots       = o->index_slots ? o->index_slots : MAX(disk_limit / SLOT_BYTES, PROBES);
+
+        size_t len = sizeof(disk_header) + h.nsegments * sizeof(disk_segment) + h.nslots * sizeof(disk_slot);
+
+        if (ftruncate(c->index_fd, len) < 0 || pwrite(c->index_fd, &h, sizeof(h), 0) != sizeof(h))
+            goto error;
+
+        st.st_size = len;
+    } else if (pread(c->index_fd, &h, sizeof(h), 0) != sizeof(h)) {
+        goto error;
+    }
+
+    if (h.magic != INDEX_MAGIC || h.version != INDEX_VERSION || h.nsegments == 0 || h.nsegments > MAX_SEGMENTS ||
+        h.nslots == 0 || h.segment_size < sizeof(disk_record) ||
+        (size_t) st.st_size != sizeof(disk_header) + h.nsegments * sizeof(disk_segment) + h.nslots * sizeof(disk_slot))
+        goto error;
+
+    c->index_len = st.st_size;
+    c->index = mmap(NULL, c->index_len, PROT_READ | PROT_WRITE, MAP_SHARED, c->index_fd, 0);
+
+    if (c->index == MAP_FAILED) {
+        c->index = NULL;
+        goto error;
+    }
+
+    c->header   = (disk_header *) c->index;
+    c->segments = (disk_segment *) (c->index + sizeof(disk_header));
+    c->slots    = (disk_slot *) (c->index + sizeof(disk_header) + h.nsegments * sizeof(disk_segment));
+
+    // Generation 0 marks an empty slot, so entries written before the
+    // first wrap must not be in it
+    for (uint32_t i = 0; created && i < h.nsegments; ++i)
+        c->segments[i].generation = 1;
+
+    c->segment_fds  = (int *) malloc(h.nsegments * sizeof(int));
+    c->segment_maps = (uint8_t **) calloc(h.nsegments, sizeof(uint8_t *));
+
+    if (!c->segment_fds || !c->segment_maps)
+        goto error;
+
+    for (uint32_t i = 0; i < h.nsegments; ++i)
+        c->segment_fds[i] = -1;
+
+    flock(c->index_fd, LOCK_UN);
+    return 1;
+
+error:
+    flock(c->index_fd, LOCK_UN);
+    return 0;
+}
+
+// Opens a cache, creating the disk tier if it does not exist.
+cache *cache_open(const cache_options *opts)
+{
+    cache_options o = opts ? *opts : (cache_options) { 0 };
+
+    cache *c = (cache *) calloc(1, sizeof(cache));
+    if (!c)
+        return NULL;
+
+    pthread_mutex_init(&c->lock, NULL);
+
+    c->index_fd     = -1;
+    c->memory_limit = o.memory_limit ? o.memory_limit : MEMORY_LIMIT;
+    c->nbuckets     = 1024;
+    c->buckets      = (mem_entry **) calloc(c->nbuckets, sizeof(mem_entry *));
+
+    if (!c->buckets)
+        goto error;
+
+    if (o.directory) {
+        c->directory = strdup(o.directory);
+
+        if (!c->directory || !disk_open(c, &o))
+            goto error;
+    }
+
+    return c;
+
+error:
+    cache_close(c);
+    return NULL;
+}
+
+// Closes this cache.
+void cache_close(cache *c)
+{
+    if (!c)
+        return;
+
+    while (c->oldest)
+        memory_remove(c, c->oldest->key);
+
+    for (uint32_t i = 0; c->segment_maps && i < c->header->nsegments; ++i) {
+        if (c->segment_maps[i]) {
+            munmap(c->segment_maps[i], c->header->segment_size);
+            close(c->segment_fds[i]);
+        }
+    }
+
+    if (c->index)
+        munmap(c->index, c->index_len);
+    if (c->index_fd >= 0)
+        close(c->index_fd);
+
+    pthread_mutex_destroy(&c->lock);
+
+    free(c->segment_fds);
+    free(c->segment_maps);
+    free(c->directory);
+    free(c->buckets);
+    free(c);
+}
+
+// Looks up a result, memory first and then disk.
+int cache_get(cache *c, cache_key key, buf_t *out)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    mem_entry *e = memory_find(c, key, NULL);
+
+    if (e) {
+        out->buf = malloc(MAX(e->len, 1));
+
+        if (out->buf) {
+            memcpy(out->buf, e->data, e->len);
+            out->len = e->len;
+            found = 1;
+
+            lru_unlink(c, e);
+            lru_push(c, e);
+        }
+
+        c->memory_hits++;
+    } else {
+        c->memory_misses++;
+
+        // Kept in memory for next time
+        if (c->index && disk_get(c, key, out)) {
+            memory_put(c, key, out->buf, out->len);
+            found = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return found;
+}
+
+// Stores a result in both tiers.
+int cache_put(cache *c, cache_key key, const void *data, size_t len)
+{
+    pthread_mutex_lock(&c->lock);
+
+    int ok = memory_put(c, key, data, len);
+
+    if (c->index)
+        ok |= disk_put(c, key, data, len);
+
+    pthread_mutex_unlock(&c->lock);
+
+    return ok;
+}
+
+// Gets the counters of this cache.
+cache_stats cache_get_stats(cache *c)
+{
+    cache_stats stats = { 0 };
+
+    pthread_mutex_lock(&c->lock);
+
+    stats.memory_hits      = c->memory_hits;
+    stats.memory_misses    = c->memory_misses;
+    stats.memory_evictions = c->memory_evictions;
+
+    if (c->header) {
+        stats.disk_hits       = __atomic_load_n(&c->header->hits, __ATOMIC_RELAXED);
+        stats.disk_misses     = __atomic_load_n(&c->header->misses, __ATOMIC_RELAXED);
+        stats.disk_evictions  = __atomic_load_n(&c->header->evictions, __ATOMIC_RELAXED);
+        stats.disk_insertions = __atomic_load_n(&c->header->insertions, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return stats;
+}
+
+// Scales and encodes the image in buf, from the cache when possible.
+buf_t cache_thumbnail(cache *c, const void *buf, size_t len, size_t max_w, size_t max_h)
+{
+    uint64_t params[] = { max_w, max_h };
+    cache_key key = cache_key_for(buf, len, "thumbnail", params, sizeof(params));
+    buf_t out = { 0 };
+
+    if (cache_get(c, key, &out))
+        return out;
+
+    raster_image *ri = raster_image_from_buffer(buf, len);
+    if (!ri)
+        return out;
+
+    raster_image *si = raster_image_scale(ri, max_w, max_h);
+    raster_image_free(ri);
+
+    if (!si)
+        return out;
+
+    out = raster_image_to_buffer(si);
+    raster_image_free(si);
+
+    if (out.buf)
+        cache_put(c, key, out.buf, out.len);
+
+    return out;
+}
+
+// Gets corner intensities for the image or video in buf, from the cache when possible.
+int cache_intensities(cache *c, const void *buf, size_t len, intensity_t *i)
+{
+    cache_key key = cache_key_for(buf, len, "intensities", NULL, 0);
+    buf_t out = { 0 };
+    int ok = 0;
+
+    if (cache_get(c, key, &out)) {
+        ok = out.len == sizeof(intensity_t);
+
+        if (ok)
+            memcpy(i, out.buf, sizeof(intensity_t));
+
+        free(out.buf);
+
+        if (ok)
+            return 1;
+    }
+
+    switch (fingerprint_buffer(buf, len)) {
+    case VIDEO_WEBM:
+    case VIDEO_MP4: {
+        // The video takes ownership of its buffer
+        void *copy = malloc(len);
+        if (!copy)
+            return 0;
+
+        memcpy(copy, buf, len);
+
+        video *v = video_from_buffer(copy, len);
+        if (!v)
+            return 0;
+
+        ok = video_get_intensities(v, i);
+        video_free(v);
+        break;
+    }
+
+    case IMAGE_PNG:
+    case IMAGE_JPG:
+    case IMAGE_GIF: {
+        raster_image *ri = raster_image_from_buffer(buf, len);
+        if (!ri)
+            return 0;
+
+        *i = raster_image_get_intensities(ri);
+        raster_image_free(ri);
+        ok = 1;
+        break;
+    }
+
+    default:
+        return 0;
+    }
+
+    if (ok)
+        cache_put(c, key, i, sizeof(intensity_t));
+
+    return ok;
+}
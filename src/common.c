@@ -1,8 +1,15 @@
+#include "common.h"
+#include "pool.h"
+
+#include <pthread.h>
 #include <signal.h>
-#include <libavformat/avformat.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <magick/api.h>
 
-__attribute__((constructor))
+static pthread_once_t magick_once = PTHREAD_ONCE_INIT;
+static atomic_int magick_ready;
+
 static void initialize_magick()
 {
     // HACK: Prevent GM from wrongly overriding signal handlers
@@ -11,6 +18,11 @@ static void initialize_magick()
     for (int i = 0; i < SIGSYS; ++i)
         sigaction(i, NULL, &saved_signals[i]);
 
+    // Pixel caches come and go with every image; keep them pooled
+    // instead of fragmenting the heap. Must precede any allocation.
+    if (!getenv("IMAGE_PROC_NO_POOL"))
+        MagickAllocFunctions(&pool_free, &pool_malloc, &pool_realloc);
+
     InitializeMagick(NULL);
 
     for (int i = 0; i < SIGSYS; ++i)
@@ -19,16 +31,23 @@ static void initialize_magick()
     // 300MB max, no multithreading
     SetMagickResourceLimit(MemoryResource, 300000000);
     SetMagickResourceLimit(ThreadsResource, 1);
+
+    // libav needs no registration since FFmpeg 4.0
+    //av_log_set_level(AV_LOG_QUIET);
+
+    atomic_store(&magick_ready, 1);
 }
 
-__attribute__((constructor))
-static void initialize_av()
+// Initializes the library, if it has not been already. Every call which
+// needs GraphicsMagick does this itself.
+void image_proc_init(void)
 {
-    //av_log_set_level(AV_LOG_QUIET);
+    pthread_once(&magick_once, &initialize_magick);
 }
 
 __attribute__((destructor))
 static void uninitialize_magick()
 {
-    DestroyMagick();
+    if (atomic_load(&magick_ready))
+        DestroyMagick();
 }
@@ -1,3 +1,5 @@
+#include "kernels.h"
+
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -56,25 +58,12 @@ static MagickPassFail pixel_iterator(
 {
     opt_info *p_info = (opt_info *) dat;
     aabb box = p_info->box;
+    long first, last;
 
-    for (long i = 0; i < npixels; ++i) {
-        PixelPacket prev = prev_pixels[i];
-        PixelPacket this = this_pixels[i];
-
-        int r_diff = (prev.red - this.red) * 0.2126;
-        int g_diff = (prev.green - this.green) * 0.7152;
-        int b_diff = (prev.blue - this.blue) * 0.0772;
-        int a_diff = prev.opacity - this.opacity;
-
-        uint64_t diffsq = r_diff*r_diff +
-                          g_diff*g_diff +
-                          b_diff*b_diff +
-                          a_diff*a_diff;
-
-        // Lossy: ignore changes in the input
-        // that are likely to be imperceptible
-        if (diffsq > 40000)
-            box_union(&box, p_info->row, i);
+    // The box only needs the outermost changes of each row
+    if (kernel_row_changes(prev_pixels, this_pixels, npixels, &first, &last)) {
+        box_union(&box, p_info->row, first);
+        box_union(&box, p_info->row, last);
     }
 
     p_info->row++;
@@ -0,0 +1,559 @@
+#include "job.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Default jobs waiting per worker before submitters block
+#define QUEUE_PER_WORKER 4
+
+// Seconds a worker waits for work before returning its pooled memory
+#define IDLE_TRIM_SECONDS 2
+
+struct job {
+    job_request req;
+    job_result result;
+    int budget;     /// Threads this job runs with
+    int nested;     /// Submitted by a job, and runs within its budget
+    int done;
+    atomic_int refs; /// Held by the engine and the submitter
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef struct {
+    job **jobs;    /// Ring of waiting jobs. The owner works from the
+    size_t cap;    /// back, newest first, and thieves take from the
+    size_t head;   /// front, oldest first.
+    size_t len;
+    pthread_mutex_t lock;
+} job_deque;
+
+typedef struct {
+    job_engine *engine;
+    pthread_t thread;
+    job_deque deque;
+    int index;
+} worker;
+
+struct job_engine {
+    worker *workers;
+    int nworkers;
+    int started;
+    size_t queue_limit;
+    int job_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;   /// A job was queued, or the engine is stopping
+    pthread_cond_t space;  /// A queued job was taken
+    pthread_cond_t freed;  /// A running job gave back its threads
+    size_t queued;         /// Jobs waiting in any deque
+    int tokens;            /// Threads not taken by a running job
+    int stopping;
+
+    atomic_uint next;      /// Deque for the next submission from outside
+};
+
+// The worker running on this thread, if any
+static __thread worker *current_worker;
+
+static int deque_push(job_deque *d, job *j)
+{
+    pthread_mutex_lock(&d->lock);
+
+    if (d->len == d->cap) {
+        size_t cap = MAX(d->cap * 2, 16);
+        job **jobs = (job **) malloc(cap * sizeof(job *));
+
+        if (!jobs) {
+            pthread_mutex_unlock(&d->lock);
+            return 0;
+        }
+
+        // Unwrap the ring into the new array
+        for (size_t i = 0; i < d->len; ++i)
+            jobs[i] = d->jobs[(d->head + i) % d->cap];
+
+        free(d->jobs);
+
+        d->jobs = jobs;
+        d->cap  = cap;
+        d->head = 0;
+    }
+
+    d->jobs[(d->head + d->len) % d->cap] = j;
+    d->len++;
+
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+// Takes the newest job (from the back) or the oldest (from the front).
+// With nested_only, takes the nearest nested job instead, wherever it
+// is, so that one never waits behind a job which cannot be taken yet.
+static job *deque_pop(job_deque *d, int back, int nested_only)
+{
+    job *j = NULL;
+
+    pthread_mutex_lock(&d->lock);
+
+    for (size_t n = 0; n < d->len; ++n) {
+        size_t i = back ? d->len - 1 - n : n;
+
+        if (nested_only && !d->jobs[(d->head + i) % d->cap]->nested)
+            continue;
+
+        j = d->jobs[(d->head + i) % d->cap];
+
+        // Close up the gap, which is only ever in the middle with nested_only
+        if (i == 0) {
+            d->head = (d->head + 1) % d->cap;
+        } else {
+            for (; i + 1 < d->len; ++i)
+                d->jobs[(d->head + i) % d->cap] = d->jobs[(d->head + i + 1) % d->cap];
+        }
+
+        d->len--;
+        break;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+    return j;
+}
+
+// Called without the engine lock: each deque has its own, so workers
+// looking for work only ever contend over one deque at a time. The
+// caller then accounts for the job taken under the engine lock.
+static job *take_job(worker *w, int nested_only)
+{
+    // Own work first, then steal from the others in turn
+    job_engine *e = w->engine;
+    job *j = deque_pop(&w->deque, 1, nested_only);
+
+    for (int i = 1; !j && i < e->nworkers; ++i)
+        j = deque_pop(&e->workers[(w->index + i) % e->nworkers].deque, 0, nested_only);
+
+    return j;
+}
+
+static void job_release(job *j)
+{
+    if (atomic_fetch_sub(&j->refs, 1) != 1)
+        return;
+
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->cond);
+    free(j);
+}
+
+static void run_job(job *j)
+{
+    const job_request *req = &j->req;
+    job_result *res = &j->result;
+
+    // Nested jobs run from job_wait on this thread keep their own
+    trace_stats *outer = trace_collect(&res->trace);
+
+    switch (req->kind) {
+    case JOB_FINGERPRINT:
+        res->type = fingerprint_buffer(req->buf, req->len);
+        res->ok   = res->type != UNKNOWN;
+        break;
+
+    case JOB_LOAD_IMAGE:
+        res->image = raster_image_from_buffer(req->buf, req->len);
+        res->ok    = res->image != NULL;
+        break;
+
+    case JOB_LOAD_VIDEO: {
+        // The video takes ownership of its buffer
+        void *copy = malloc(req->len);
+        if (!copy)
+            break;
+
+        memcpy(copy, req->buf, req->len);
+
+        res->video = video_from_buffer(copy, req->len);
+        res->ok    = res->video != NULL;
+        break;
+    }
+
+    case JOB_SCALE_IMAGE:
+        res->image = raster_image_scale(req->image, req->max_w, req->max_h);
+        res->ok    = res->image != NULL;
+        break;
+
+    case JOB_SCALE_VIDEO:
+        if (j->budget > 1)
+            res->video = video_scale_parallel(req->video, req->max_w, req->max_h, j->budget);
+        else
+            res->video = video_scale(req->video, req->max_w, req->max_h);
+
+        res->ok = res->video != NULL;
+        break;
+
+    case JOB_OPTIMIZE_IMAGE:
+        res->ok = raster_image_optimize(req->image);
+        break;
+
+    case JOB_INTENSITIES:
+        if (req->image) {
+            res->intensities = raster_image_get_intensities(req->image);
+            res->ok = 1;
+        } else if (req->video) {
+            res->ok = video_get_intensities(req->video, &res->intensities);
+        }
+        break;
+
+    case JOB_CUSTOM:
+        if (req->fn) {
+            res->custom = req->fn(req->arg, j->budget);
+            res->ok = 1;
+        }
+        break;
+    }
+
+    trace_collect(outer);
+}
+
+static void finish_job(job *j)
+{
+    if (j->req.done)
+        j->req.done(&j->result, j->req.user);
+
+    pthread_mutex_lock(&j->lock);
+    j->done = 1;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+
+    job_release(j);
+}
+
+// Waits for work, up to a deadline. Returns 0 if it passed.
+static int wait_work(job_engine *e, const struct timespec *deadline)
+{
+    if (!deadline) {
+        pthread_cond_wait(&e->work, &e->lock);
+        return 1;
+    }
+
+    return pthread_cond_timedwait(&e->work, &e->lock, deadline) != ETIMEDOUT;
+}
+
+static void *worker_main(void *opaque)
+{
+    worker *w = (worker *) opaque;
+    job_engine *e = w->engine;
+    int trimmed = 0;
+
+    current_worker = w;
+
+    while (1) {
+        job *j = take_job(w, 0);
+
+        pthread_mutex_lock(&e->lock);
+
+        if (!j) {
+            // Jobs are pushed, and counted, under the engine lock, so
+            // one queued since the deques were looked at shows here.
+            // Taken but not yet counted off, it soon will be.
+            if (e->queued > 0) {
+                pthread_mutex_unlock(&e->lock);
+                continue;
+            }
+
+            // Drain everything before stopping
+            if (e->stopping) {
+                pthread_mutex_unlock(&e->lock);
+                break;
+            }
+
+            // Idle for a while: hand the blocks this thread pooled
+            // back to the OS, once, rather than keep them for work
+            // which may not come
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += IDLE_TRIM_SECONDS;
+
+            int woken = wait_work(e, trimmed ? NULL : &deadline);
+            pthread_mutex_unlock(&e->lock);
+
+            if (!woken) {
+                pool_trim();
+                trimmed = 1;
+            }
+
+            continue;
+        }
+
+        e->queued--;
+        pthread_cond_signal(&e->space);
+
+        // Its whole budget at once, so that jobs waiting for threads
+        // never hold on to part of one. Nested jobs already have theirs,
+        // and must not wait on the job waiting on them.
+        int tokens = j->nested ? 0 : j->budget;
+
+        while (e->tokens < tokens)
+            pthread_cond_wait(&e->freed, &e->lock);
+
+        e->tokens -= tokens;
+
+        pthread_mutex_unlock(&e->lock);
+
+        run_job(j);
+        trimmed = 0;
+
+        pthread_mutex_lock(&e->lock);
+        e->tokens += tokens;
+        pthread_cond_broadcast(&e->freed);
+        pthread_mutex_unlock(&e->lock);
+
+        finish_job(j);
+    }
+
+    current_worker = NULL;
+
+    return NULL;
+}
+
+// Returns a new job engine with its workers started.
+job_engine *job_engine_new(const job_engine_options *opts)
+{
+    job_engine_options o = opts ? *opts : (job_engine_options) { 0 };
+
+    job_engine *e = (job_engine *) calloc(1, sizeof(job_engine));
+    if (!e)
+        return NULL;
+
+    e->nworkers = o.workers > 0 ? o.workers : MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    e->queue_limit = o.queue_limit ? o.queue_limit : QUEUE_PER_WORKER * e->nworkers;
+    e->job_threads = MIN(MAX(o.job_threads, 1), e->nworkers);
+    e->tokens = e->nworkers;
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->work, NULL);
+    pthread_cond_init(&e->space, NULL);
+    pthread_cond_init(&e->freed, NULL);
+
+    e->workers = (worker *) calloc(e->nworkers, sizeof(worker));
+    if (!e->workers)
+        goto error;
+
+    for (int i = 0; i < e->nworkers; ++i) {
+        e->workers[i].engine = e;
+        e->workers[i].index  = i;
+        pthread_mutex_init(&e->workers[i].deque.lock, NULL);
+    }
+
+    for (; e->started < e->nworkers; ++e->started)
+        if (pthread_create(&e->workers[e->started].thread, NULL, &worker_main, &e->workers[e->started]) != 0)
+            goto error;
+
+    return e;
+
+error:
+    job_engine_free(e);
+    return NULL;
+}
+
+// Runs every job already submitted, then stops and frees this engine.
+void job_engine_free(job_engine *e)
+{
+    if (!e)
+        return;
+
+    pthread_mutex_lock(&e->lock);
+    e->stopping = 1;
+    pthread_cond_broadcast(&e->work);
+    pthread_cond_broadcast(&e->space);
+    pthread_mutex_unlock(&e->lock);
+
+    for (int i = 0; i < e->started; ++i)
+        pthread_join(e->workers[i].thread, NULL);
+
+    // Without any workers, nothing could have been submitted
+    for (int i = 0; e->workers && i < e->nworkers; ++i) {
+        free(e->workers[i].deque.jobs);
+        pthread_mutex_destroy(&e->workers[i].deque.lock);
+    }
+
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->work);
+    pthread_cond_destroy(&e->space);
+    pthread_cond_destroy(&e->freed);
+
+    free(e->workers);
+    free(e);
+}
+
+static job *submit(job_engine *e, const job_request *req, int block)
+{
+    job *j = (job *) calloc(1, sizeof(job));
+    if (!j)
+        return NULL;
+
+    j->req    = *req;
+    j->budget = MIN(MAX(req->threads ? req->threads : e->job_threads, 1), e->nworkers);
+
+    // Images run on one thread regardless
+    if (req->kind != JOB_SCALE_VIDEO && req->kind != JOB_CUSTOM)
+        j->budget = 1;
+
+    atomic_init(&j->refs, 2);
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+
+    // Jobs from a job stay with its worker, and are never held back,
+    // as the job waiting on them may be what would free up the queue
+    worker *own = current_worker && current_worker->engine == e ? current_worker : NULL;
+
+    j->nested = own != NULL;
+
+    pthread_mutex_lock(&e->lock);
+
+    while (!own && !e->stopping && e->queued >= e->queue_limit) {
+        if (!block) {
+            errno = EAGAIN;
+            goto error;
+        }
+
+        pthread_cond_wait(&e->space, &e->lock);
+    }
+
+    if (e->stopping)
+        goto error;
+
+    worker *w = own ? own : &e->workers[atomic_fetch_add(&e->next, 1) % e->nworkers];
+
+    if (!deque_push(&w->deque, j))
+        goto error;
+
+    e->queued++;
+    pthread_cond_signal(&e->work);
+
+    pthread_mutex_unlock(&e->lock);
+
+    return j;
+
+error:
+    pthread_mutex_unlock(&e->lock);
+
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->cond);
+    free(j);
+
+    return NULL;
+}
+
+// Queues a job, blocking while the queue is full.
+job *job_submit(job_engine *e, const job_request *req)
+{
+    return submit(e, req, 1);
+}
+
+// As job_submit, but fails with EAGAIN instead of blocking.
+job *job_try_submit(job_engine *e, const job_request *req)
+{
+    return submit(e, req, 0);
+}
+
+// Waits for this job to complete and copies out its result.
+int job_wait(job *j, job_result *result)
+{
+    worker *w = current_worker;
+
+    // A job waiting on another runs queued work in the meantime, on its
+    // own threads, rather than holding a worker idle. This also keeps it
+    // from waiting on a job that only its own worker would get to.
+    while (w && !job_done(j)) {
+        job_engine *e = w->engine;
+
+        // Nested jobs run within their submitter's budget, but any other
+        // needs a thread of the engine's. Without one spare, only nested
+        // jobs are taken, so that waiting never depends on tokens.
+        pthread_mutex_lock(&e->lock);
+        int token = e->tokens > 0;
+        e->tokens -= token;
+        pthread_mutex_unlock(&e->lock);
+
+        job *other = take_job(w, !token);
+
+        pthread_mutex_lock(&e->lock);
+
+        if (other) {
+            e->queued--;
+            pthread_cond_signal(&e->space);
+        }
+
+        if (token && (!other || other->nested)) {
+            e->tokens++;
+            pthread_cond_broadcast(&e->freed);
+            token = 0;
+        }
+
+        pthread_mutex_unlock(&e->lock);
+
+        if (!other)
+            break;
+
+        // Its one token is all this thread can lend; a job which would
+        // have taken threads of its own runs on just this one
+        if (!other->nested)
+            other->budget = 1;
+
+        run_job(other);
+
+        if (token) {
+            pthread_mutex_lock(&e->lock);
+            e->tokens++;
+            pthread_cond_broadcast(&e->freed);
+            pthread_mutex_unlock(&e->lock);
+        }
+
+        finish_job(other);
+    }
+
+    pthread_mutex_lock(&j->lock);
+
+    while (!j->done)
+        pthread_cond_wait(&j->cond, &j->lock);
+
+    if (result)
+        *result = j->result;
+
+    pthread_mutex_unlock(&j->lock);
+
+    return j->result.ok;
+}
+
+// The engine whose worker this thread is, if any.
+job_engine *job_current_engine(void)
+{
+    return current_worker ? current_worker->engine : NULL;
+}
+
+// Whether this job has completed, without waiting.
+int job_done(job *j)
+{
+    pthread_mutex_lock(&j->lock);
+    int done = j->done;
+    pthread_mutex_unlock(&j->lock);
+
+    return done;
+}
+
+// Releases this job.
+void job_free(job *j)
+{
+    if (j)
+        job_release(j);
+}
@@ -0,0 +1,376 @@
+#include "raster_image.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Lossless JPEG orientation and cropping, as jpegtran does it: the
+// quantized DCT coefficients are read, moved between blocks and mirrored
+// within them, and entropy coded again. No pixel is decoded, and none
+// changes. Pixels only move in whole blocks, so the stored image's edges
+// which end up at the top or left must be whole iMCUs, and a crop must
+// start on an iMCU boundary.
+
+typedef enum {
+    XFORM_NONE,
+    XFORM_FLIP_H,
+    XFORM_FLIP_V,
+    XFORM_TRANSPOSE,
+    XFORM_TRANSVERSE,
+    XFORM_ROT_90,
+    XFORM_ROT_180,
+    XFORM_ROT_270
+} xform;
+
+// What each EXIF orientation asks to be done to the stored image
+static const xform orientation_xforms[9] = {
+    [0] = XFORM_NONE,
+    [1] = XFORM_NONE,
+    [2] = XFORM_FLIP_H,
+    [3] = XFORM_ROT_180,
+    [4] = XFORM_FLIP_V,
+    [5] = XFORM_TRANSPOSE,
+    [6] = XFORM_ROT_90,
+    [7] = XFORM_TRANSVERSE,
+    [8] = XFORM_ROT_270
+};
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} error_mgr;
+
+static int xform_transposes(xform x)
+{
+    return x == XFORM_TRANSPOSE || x == XFORM_TRANSVERSE || x == XFORM_ROT_90 || x == XFORM_ROT_270;
+}
+
+// Whether the stored image's right edge moves to the left or top
+static int xform_mirrors_x(xform x)
+{
+    return x == XFORM_FLIP_H || x == XFORM_ROT_180 || x == XFORM_ROT_270 || x == XFORM_TRANSVERSE;
+}
+
+// Whether the stored image's bottom edge moves to the top or left
+static int xform_mirrors_y(xform x)
+{
+    return x == XFORM_FLIP_V || x == XFORM_ROT_180 || x == XFORM_ROT_90 || x == XFORM_TRANSVERSE;
+}
+
+static void error_exit(j_common_ptr cinfo)
+{
+    longjmp(((error_mgr *) cinfo->err)->jump, 1);
+}
+
+// Warnings about corrupt data are not printed; errors still fail
+static void emit_message(j_common_ptr cinfo, int level)
+{
+}
+
+static uint32_t read_u16(const uint8_t *p, int le)
+{
+    return le ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static uint32_t read_u32(const uint8_t *p, int le)
+{
+    return le ? read_u16(p, 1) | read_u16(p + 2, 1) << 16 : read_u16(p, 0) << 16 | read_u16(p + 2, 0);
+}
+
+// Gets the orientation tag of IFD0 of a saved EXIF APP1 marker, or 1
+// if there is none.
+static int exif_orientation(struct jpeg_decompress_struct *src)
+{
+    for (jpeg_saved_marker_ptr m = src->marker_list; m; m = m->next) {
+        if (m->marker != JPEG_APP0 + 1 || m->data_length < 14 || memcmp(m->data, "Exif\0\0", 6) != 0)
+            continue;
+
+        const uint8_t *tiff = m->data + 6;
+        size_t len = m->data_length - 6;
+        int le;
+
+        if (memcmp(tiff, "II", 2) == 0)
+            le = 1;
+        else if (memcmp(tiff, "MM", 2) == 0)
+            le = 0;
+        else
+            continue;
+
+        uint32_t ifd = read_u32(tiff + 4, le);
+        if (ifd < 8 || ifd > len - 2)
+            continue;
+
+        uint32_t count = read_u16(tiff + ifd, le);
+
+        for (uint32_t i = 0; i < count && ifd + 2 + (i + 1) * 12 <= len; ++i) {
+            const uint8_t *entry = tiff + ifd + 2 + i * 12;
+
+            // SHORT, so the value is in the first two bytes of the field
+            if (read_u16(entry, le) == 0x0112) {
+                uint32_t value = read_u16(entry + 8, le);
+                return value >= 1 && value <= 8 ? value : 1;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// How the coefficients of a block move: transposing the pixels
+// transposes the frequencies, and mirroring an axis negates its odd
+// frequencies. Signs are multiplied in, so that the loops vectorize.
+typedef struct {
+    int transpose;
+    JCOEF sign[DCTSIZE2];
+} block_map;
+
+static void get_block_map(block_map *map, xform x)
+{
+    int mirror_u = x == XFORM_FLIP_H || x == XFORM_ROT_180 || x == XFORM_ROT_90  || x == XFORM_TRANSVERSE;
+    int mirror_v = x == XFORM_FLIP_V || x == XFORM_ROT_180 || x == XFORM_ROT_270 || x == XFORM_TRANSVERSE;
+
+    map->transpose = xform_transposes(x);
+
+    for (int v = 0; v < DCTSIZE; ++v)
+        for (int u = 0; u < DCTSIZE; ++u)
+            map->sign[v * DCTSIZE + u] = (((mirror_u & u) ^ (mirror_v & v)) & 1) ? -1 : 1;
+}
+
+static void transform_block(JCOEFPTR restrict out, const JCOEF *restrict in, const block_map *map)
+{
+    if (map->transpose) {
+        for (int v = 0; v < DCTSIZE; ++v)
+            for (int u = 0; u < DCTSIZE; ++u)
+                out[v * DCTSIZE + u] = in[u * DCTSIZE + v] * map->sign[v * DCTSIZE + u];
+    } else {
+        for (int i = 0; i < DCTSIZE2; ++i)
+            out[i] = in[i] * map->sign[i];
+    }
+}
+
+// Gets the block of the stored image, sw by sh blocks, which x moves to
+// block (ox, oy) of the output. Out of range if there is none.
+static void source_block(xform x, JDIMENSION ox, JDIMENSION oy, JDIMENSION sw, JDIMENSION sh, JDIMENSION *sx, JDIMENSION *sy)
+{
+    switch (x) {
+    case XFORM_NONE:       *sx = ox;          *sy = oy;          break;
+    case XFORM_FLIP_H:     *sx = sw - 1 - ox; *sy = oy;          break;
+    case XFORM_FLIP_V:     *sx = ox;          *sy = sh - 1 - oy; break;
+    case XFORM_ROT_180:    *sx = sw - 1 - ox; *sy = sh - 1 - oy; break;
+    case XFORM_TRANSPOSE:  *sx = oy;          *sy = ox;          break;
+    case XFORM_ROT_90:     *sx = oy;          *sy = sh - 1 - ox; break;
+    case XFORM_ROT_270:    *sx = sw - 1 - oy; *sy = ox;          break;
+    case XFORM_TRANSVERSE: *sx = sw - 1 - oy; *sy = sh - 1 - ox; break;
+    }
+}
+
+static JDIMENSION div_round_up(JDIMENSION a, JDIMENSION b)
+{
+    return (a + b - 1) / b;
+}
+
+// Transforms a JPEG to its EXIF orientation and crops it to crop, given
+// in oriented pixels, without decoding it. Returns 0, with *out empty,
+// if buf is not a JPEG or cannot be transformed exactly: when a partial
+// iMCU would move to the top or left edge, or the crop does not start on
+// an iMCU boundary. With align, those partial iMCUs are dropped, and the
+// crop start moved up and left to a boundary, instead.
+// Metadata is not copied, as StripImage would not keep it.
+int jpeg_transform(const void *buf, size_t len, const rect_t *crop, int align, buf_t *out)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    error_mgr err;
+    jvirt_barray_ptr dst_coefs[MAX_COMPONENTS];
+    unsigned char *out_buf = NULL;
+    unsigned long out_len = 0;
+    volatile int ok = 0;
+
+    *out = (buf_t) { 0 };
+
+    if (len < 3 || memcmp(buf, "\xFF\xD8\xFF", 3) != 0)
+        return 0;
+
+    // Destroying a struct which was never created does nothing
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+
+    src.err = dst.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = &error_exit;
+    err.pub.emit_message = &emit_message;
+
+    if (setjmp(err.jump))
+        goto done;
+
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+
+    jpeg_mem_src(&src, (const unsigned char *) buf, len);
+    jpeg_save_markers(&src, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&src, TRUE);
+
+    xform x = orientation_xforms[exif_orientation(&src)];
+    int transposes = xform_transposes(x);
+
+    JDIMENSION mcu_w = src.max_h_samp_factor * DCTSIZE;
+    JDIMENSION mcu_h = src.max_v_samp_factor * DCTSIZE;
+    JDIMENSION in_w = src.image_width;
+    JDIMENSION in_h = src.image_height;
+
+    if ((xform_mirrors_x(x) && in_w % mcu_w) || (xform_mirrors_y(x) && in_h % mcu_h)) {
+        if (!align)
+            goto done;
+
+        if (xform_mirrors_x(x))
+            in_w -= in_w % mcu_w;
+        if (xform_mirrors_y(x))
+            in_h -= in_h % mcu_h;
+
+        if (in_w == 0 || in_h == 0)
+            goto done;
+    }
+
+    // The oriented image, and its iMCU
+    JDIMENSION full_w = transposes ? in_h : in_w;
+    JDIMENSION full_h = transposes ? in_w : in_h;
+    JDIMENSION out_mcu_w = transposes ? mcu_h : mcu_w;
+    JDIMENSION out_mcu_h = transposes ? mcu_w : mcu_h;
+
+    JDIMENSION x0 = 0, y0 = 0, x1 = full_w, y1 = full_h;
+
+    if (crop) {
+        x0 = crop->start_x;
+        y0 = crop->start_y;
+        x1 = MIN(crop->end_x, full_w);
+        y1 = MIN(crop->end_y, full_h);
+
+        if (x0 >= x1 || y0 >= y1)
+            goto done;
+
+        if (x0 % out_mcu_w || y0 % out_mcu_h) {
+            if (!align)
+                goto done;
+
+            x0 -= x0 % out_mcu_w;
+            y0 -= y0 % out_mcu_h;
+        }
+    }
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.image_width  = x1 - x0;
+    dst.image_height = y1 - y0;
+
+    if (transposes) {
+        for (int c = 0; c < dst.num_components; ++c) {
+            int h = dst.comp_info[c].h_samp_factor;
+            dst.comp_info[c].h_samp_factor = dst.comp_info[c].v_samp_factor;
+            dst.comp_info[c].v_samp_factor = h;
+        }
+
+        // The copied tables are the output's own
+        for (int t = 0; t < NUM_QUANT_TBLS; ++t) {
+            JQUANT_TBL *q = dst.quant_tbl_ptrs[t];
+            if (!q)
+                continue;
+
+            for (int i = 0; i < DCTSIZE; ++i) {
+                for (int j = i + 1; j < DCTSIZE; ++j) {
+                    UINT16 v = q->quantval[i * DCTSIZE + j];
+                    q->quantval[i * DCTSIZE + j] = q->quantval[j * DCTSIZE + i];
+                    q->quantval[j * DCTSIZE + i] = v;
+                }
+            }
+        }
+    }
+
+    // Without orientation, or a crop offset, no block moves and the
+    // input's arrays are written out as they are
+    int in_place = x == XFORM_NONE && x0 == 0 && y0 == 0;
+
+    // Requested before jpeg_read_coefficients realizes every array
+    for (int c = 0; c < dst.num_components && !in_place; ++c) {
+        jpeg_component_info *comp = &dst.comp_info[c];
+
+        dst_coefs[c] = (*src.mem->request_virt_barray)((j_common_ptr) &src, JPOOL_IMAGE, FALSE,
+            div_round_up(dst.image_width, out_mcu_w) * comp->h_samp_factor,
+            div_round_up(dst.image_height, out_mcu_h) * comp->v_samp_factor,
+            comp->v_samp_factor);
+    }
+
+    jvirt_barray_ptr *src_coefs = jpeg_read_coefficients(&src);
+
+    block_map map;
+    get_block_map(&map, x);
+
+    for (int c = 0; c < dst.num_components && !in_place; ++c) {
+        jpeg_component_info *sc = &src.comp_info[c];
+        jpeg_component_info *dc = &dst.comp_info[c];
+
+        // Blocks of the stored image, as far as they are kept, and of
+        // the output, in this component's sampling
+        JDIMENSION sw = xform_mirrors_x(x) ? in_w / mcu_w * sc->h_samp_factor :
+            div_round_up(sc->width_in_blocks, sc->h_samp_factor) * sc->h_samp_factor;
+        JDIMENSION sh = xform_mirrors_y(x) ? in_h / mcu_h * sc->v_samp_factor :
+            div_round_up(sc->height_in_blocks, sc->v_samp_factor) * sc->v_samp_factor;
+        JDIMENSION dw = div_round_up(dst.image_width, out_mcu_w) * dc->h_samp_factor;
+        JDIMENSION dh = div_round_up(dst.image_height, out_mcu_h) * dc->v_samp_factor;
+        JDIMENSION ox0 = x0 / out_mcu_w * dc->h_samp_factor;
+        JDIMENSION oy0 = y0 / out_mcu_h * dc->v_samp_factor;
+
+        for (JDIMENSION dy = 0; dy < dh; ++dy) {
+            JBLOCKROW out_row = (*src.mem->access_virt_barray)((j_common_ptr) &src, dst_coefs[c], dy, 1, TRUE)[0];
+            JBLOCKROW in_row = NULL;
+            JDIMENSION in_y = 0;
+
+            for (JDIMENSION dx = 0; dx < dw; ++dx) {
+                JDIMENSION sx, sy;
+                source_block(x, dx + ox0, dy + oy0, sw, sh, &sx, &sy);
+
+                // Padding past the image's edge
+                if (sx >= sw || sy >= sh) {
+                    memset(out_row[dx], 0, sizeof(JBLOCK));
+                    continue;
+                }
+
+                // Rows are fetched once each unless transposing
+                if (!in_row || sy != in_y) {
+                    in_row = (*src.mem->access_virt_barray)((j_common_ptr) &src, src_coefs[c], sy, 1, FALSE)[0];
+                    in_y = sy;
+                }
+
+                transform_block(out_row[dx], in_row[sx], &map);
+            }
+        }
+    }
+
+    // Huffman tables fitted to the data, as no settings are lost by it
+    if (src.progressive_mode)
+        jpeg_simple_progression(&dst);
+    else
+        dst.optimize_coding = TRUE;
+
+    jpeg_mem_dest(&dst, &out_buf, &out_len);
+    jpeg_write_coefficients(&dst, in_place ? src_coefs : dst_coefs);
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+
+    ok = 1;
+
+done:
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+
+    if (ok) {
+        out->buf = out_buf;
+        out->len = out_len;
+    } else {
+        free(out_buf);
+    }
+
+    return ok;
+}
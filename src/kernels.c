@@ -0,0 +1,281 @@
+#include "kernels.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <magick/api.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Bytes of RGB24 summed per block: 16 pixels, and a whole
+// number of vectors at every width up to 512 bits
+#define RGB_BLOCK 48
+
+// Quanta of PixelPackets summed per block: 16 pixels
+#define PACKET_BLOCK 64
+
+// Pixels compared per block of a row
+#define ROW_BLOCK 64
+
+_Static_assert(sizeof(PixelPacket) == 4 * sizeof(Quantum), "PixelPacket must be 4 packed quanta");
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// Scales a quantum to 8 bits by truncation, as intensities always have
+// been in Q16 builds (ScaleQuantumToChar rounds, which would shift them)
+#define QUANTUM_TO_CHAR(q) ((q) >> (QuantumDepth - 8))
+
+// Each kernel is written once, here, and instantiated below for every
+// instruction set; the compiler vectorizes each copy for its target.
+// Sums are kept in one lane per byte or quantum of a block, so that the
+// loops are contiguous and need no deinterleaving, and lanes are folded
+// into channels at the end of each row.
+
+ALWAYS_INLINE rect_sum_t rect_sum_body(const uint8_t *restrict rgb, uint32_t width, rect_t bounds)
+{
+    // The sum of an empty region is defined to be zero.
+    uint64_t ch[3] = { 0 };
+
+    if (bounds.end_x <= bounds.start_x)
+        return (rect_sum_t) { 0 };
+
+    size_t len = (size_t) (bounds.end_x - bounds.start_x) * 3;
+
+    for (uint32_t y = bounds.start_y; y < bounds.end_y; ++y) {
+        const uint8_t *restrict row = rgb + ((size_t) y * width + bounds.start_x) * 3;
+        uint32_t lanes[RGB_BLOCK] = { 0 };
+        size_t i = 0;
+
+        for (; i + RGB_BLOCK <= len; i += RGB_BLOCK)
+            for (size_t k = 0; k < RGB_BLOCK; ++k)
+                lanes[k] += row[i + k];
+
+        for (size_t k = 0; k < RGB_BLOCK; ++k)
+            ch[k % 3] += lanes[k];
+
+        // Blocks are whole pixels, so the tail starts on red
+        for (; i < len; ++i)
+            ch[i % 3] += row[i];
+    }
+
+    return (rect_sum_t) { .r = ch[0], .g = ch[1], .b = ch[2] };
+}
+
+ALWAYS_INLINE rect_sum_t pixel_sum_body(const void *restrict pixels, long npixels)
+{
+    // Same 8-bit scale as video intensities, at any quantum depth
+    const Quantum *restrict q = (const Quantum *) pixels;
+    size_t len = (size_t) MAX(npixels, 0) * 4;
+    uint32_t lanes[PACKET_BLOCK] = { 0 };
+    uint64_t ch[4] = { 0 };
+    size_t i = 0;
+
+    for (; i + PACKET_BLOCK <= len; i += PACKET_BLOCK)
+        for (size_t k = 0; k < PACKET_BLOCK; ++k)
+            lanes[k] += QUANTUM_TO_CHAR(q[i + k]);
+
+    for (size_t k = 0; k < PACKET_BLOCK; ++k)
+        ch[k % 4] += lanes[k];
+
+    for (; i < len; ++i)
+        ch[i % 4] += QUANTUM_TO_CHAR(q[i]);
+
+    return (rect_sum_t) {
+        .r = ch[offsetof(PixelPacket, red) / sizeof(Quantum)],
+        .g = ch[offsetof(PixelPacket, green) / sizeof(Quantum)],
+        .b = ch[offsetof(PixelPacket, blue) / sizeof(Quantum)]
+    };
+}
+
+ALWAYS_INLINE int row_changes_body(const void *restrict prev_pixels, const void *restrict this_pixels, long npixels, long *first, long *last)
+{
+    const PixelPacket *restrict prev = (const PixelPacket *) prev_pixels;
+    const PixelPacket *restrict this = (const PixelPacket *) this_pixels;
+    long lo = LONG_MAX;
+    long hi = -1;
+
+    // Differences are found a block at a time, and only
+    // blocks with one are searched for where it is
+    for (long base = 0; base < npixels; base += ROW_BLOCK) {
+        long n = MIN(ROW_BLOCK, npixels - base);
+        uint8_t changed[ROW_BLOCK];
+        uint8_t any = 0;
+
+        for (long k = 0; k < n; ++k) {
+            PixelPacket p = prev[base + k];
+            PixelPacket t = this[base + k];
+
+            int r_diff = (p.red - t.red) * 0.2126;
+            int g_diff = (p.green - t.green) * 0.7152;
+            int b_diff = (p.blue - t.blue) * 0.0772;
+            int a_diff = p.opacity - t.opacity;
+
+            int64_t diffsq = (int64_t) r_diff*r_diff +
+                             (int64_t) g_diff*g_diff +
+                             (int64_t) b_diff*b_diff +
+                             (int64_t) a_diff*a_diff;
+
+            // Lossy: ignore changes in the input
+            // that are likely to be imperceptible
+            changed[k] = diffsq > 40000;
+            any |= changed[k];
+        }
+
+        if (!any)
+            continue;
+
+        for (long k = 0; k < n; ++k) {
+            if (changed[k]) {
+                lo = MIN(lo, base + k);
+                hi = base + k;
+            }
+        }
+    }
+
+    *first = lo;
+    *last  = hi;
+
+    return hi >= 0;
+}
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    rect_sum_t (*rect_sum)(const uint8_t *rgb, uint32_t width, rect_t bounds);
+    rect_sum_t (*pixel_sum)(const void *pixels, long npixels);
+    int (*row_changes)(const void *prev, const void *this, long npixels, long *first, long *last);
+} kernel_variant;
+
+#define DEFINE_VARIANT(isa, attr)                                                                           \
+    attr static rect_sum_t rect_sum_##isa(const uint8_t *rgb, uint32_t width, rect_t bounds)                 \
+    {                                                                                                       \
+        return rect_sum_body(rgb, width, bounds);                                                           \
+    }                                                                                                       \
+    attr static rect_sum_t pixel_sum_##isa(const void *pixels, long npixels)                                \
+    {                                                                                                       \
+        return pixel_sum_body(pixels, npixels);                                                             \
+    }                                                                                                       \
+    attr static int row_changes_##isa(const void *prev, const void *this, long npixels, long *first, long *last) \
+    {                                                                                                       \
+        return row_changes_body(prev, this, npixels, first, last);                                          \
+    }
+
+#define VARIANT(isa, name, supported) { name, supported, &rect_sum_##isa, &pixel_sum_##isa, &row_changes_##isa }
+
+static int always_supported(void)
+{
+    return 1;
+}
+
+DEFINE_VARIANT(baseline, )
+
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_VARIANT(sse42, __attribute__((target("sse4.2"))))
+DEFINE_VARIANT(avx2, __attribute__((target("avx2"))))
+DEFINE_VARIANT(avx512, __attribute__((target("avx512f,avx512bw"))))
+
+static int sse42_supported(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static int avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+// Best last
+static const kernel_variant variants[] = {
+    VARIANT(baseline, "baseline", &always_supported),
+#if defined(__x86_64__) || defined(__i386__)
+    VARIANT(sse42, "sse4.2", &sse42_supported),
+    VARIANT(avx2, "avx2", &avx2_supported),
+    VARIANT(avx512, "avx512", &avx512_supported),
+#endif
+};
+
+#define NVARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+static _Atomic(const kernel_variant *) active;
+
+static const kernel_variant *find_variant(const char *name)
+{
+    for (size_t i = 0; i < NVARIANTS; ++i)
+        if (strcmp(variants[i].name, name) == 0)
+            return variants[i].supported() ? &variants[i] : NULL;
+
+    return NULL;
+}
+
+static void select_default()
+{
+    const kernel_variant *best = &variants[0];
+    const char *name = getenv("IMAGE_PROC_KERNELS");
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+
+    for (size_t i = 1; i < NVARIANTS; ++i)
+        if (variants[i].supported())
+            best = &variants[i];
+
+    if (name && find_variant(name))
+        best = find_variant(name);
+
+    atomic_store(&active, best);
+}
+
+static const kernel_variant *kernels()
+{
+    pthread_once(&select_once, &select_default);
+    return atomic_load_explicit(&active, memory_order_relaxed);
+}
+
+// Gets the name of the variant in use.
+const char *kernels_active(void)
+{
+    return kernels()->name;
+}
+
+// Switches every thread to the named variant.
+int kernels_select(const char *name)
+{
+    pthread_once(&select_once, &select_default);
+
+    const kernel_variant *v = find_variant(name);
+    if (!v)
+        return 0;
+
+    atomic_store(&active, v);
+    return 1;
+}
+
+// Sums the RGB24 pixels of an image width pixels wide within bounds.
+rect_sum_t kernel_rect_sum(const uint8_t *rgb, uint32_t width, rect_t bounds)
+{
+    return kernels()->rect_sum(rgb, width, bounds);
+}
+
+// Sums npixels PixelPackets, scaled to 8 bits.
+rect_sum_t kernel_pixel_sum(const void *pixels, long npixels)
+{
+    return kernels()->pixel_sum(pixels, npixels);
+}
+
+// Finds the first and last of npixels PixelPackets which visibly differ
+// between two rows. Returns 0 if none do.
+int kernel_row_changes(const void *prev, const void *this, long npixels, long *first, long *last)
+{
+    return kernels()->row_changes(prev, this, npixels, first, last);
+}
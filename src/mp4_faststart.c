@@ -0,0 +1,174 @@
+#include "video.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ATOM(a,b,c,d) (((uint32_t) (a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+typedef struct {
+    uint32_t type;
+    size_t   offset; /// Start of the atom, header included
+    size_t   header; /// Header size, 8 or 16 bytes
+    size_t   size;   /// Total size, header included
+} atom;
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint64_t read_u64(const uint8_t *p)
+{
+    return ((uint64_t) read_u32(p) << 32) | read_u32(p + 4);
+}
+
+static void write_u32(uint8_t *p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static void write_u64(uint8_t *p, uint64_t x)
+{
+    write_u32(p, x >> 32);
+    write_u32(p + 4, x);
+}
+
+static int next_atom(const uint8_t *buf, size_t start, size_t end, atom *a)
+{
+    // Reads the atom header at start. Returns 0 at the end of the
+    // enclosing region, or if the header is truncated or nonsense.
+    if (end - start < 8)
+        return 0;
+
+    uint64_t size = read_u32(&buf[start]);
+
+    a->type   = read_u32(&buf[start + 4]);
+    a->offset = start;
+    a->header = 8;
+
+    if (size == 1) {
+        // 64-bit size follows the type
+        if (end - start < 16)
+            return 0;
+
+        size = read_u64(&buf[start + 8]);
+        a->header = 16;
+    } else if (size == 0) {
+        // Extends to the end of the enclosing region
+        size = end - start;
+    }
+
+    if (size < a->header || size > end - start)
+        return 0;
+
+    a->size = size;
+
+    return 1;
+}
+
+static int patch_offsets(uint8_t *buf, size_t start, size_t end, uint64_t from, uint64_t to, uint64_t shift, int apply)
+{
+    // Adds shift to every chunk offset in [from, to), in every sample
+    // table below this region. Without apply, only checks that it can.
+    atom a;
+
+    for (size_t pos = start; pos < end && next_atom(buf, pos, end, &a); pos += a.size) {
+        uint8_t *body  = &buf[a.offset + a.header];
+        size_t   blen  = a.size - a.header;
+
+        switch (a.type) {
+        case ATOM('t','r','a','k'):
+        case ATOM('m','d','i','a'):
+        case ATOM('m','i','n','f'):
+        case ATOM('s','t','b','l'):
+            if (!patch_offsets(buf, a.offset + a.header, a.offset + a.size, from, to, shift, apply))
+                return 0;
+            break;
+
+        case ATOM('s','t','c','o'):
+        case ATOM('c','o','6','4'): {
+            // Version and flags, entry count, then the entries
+            size_t width = a.type == ATOM('s','t','c','o') ? 4 : 8;
+
+            if (blen < 8)
+                return 0;
+
+            uint32_t count = read_u32(&body[4]);
+            if (count > (blen - 8) / width)
+                return 0;
+
+            for (uint32_t i = 0; i < count; ++i) {
+                uint8_t *entry = &body[8 + i * width];
+                uint64_t offset = width == 4 ? read_u32(entry) : read_u64(entry);
+
+                if (offset < from || offset >= to)
+                    continue;
+
+                // 32-bit tables cannot always take the shift
+                if (width == 4 && offset + shift > UINT32_MAX)
+                    return 0;
+
+                if (apply) {
+                    if (width == 4)
+                        write_u32(entry, offset + shift);
+                    else
+                        write_u64(entry, offset + shift);
+                }
+            }
+
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    return 1;
+}
+
+// Moves the moov atom of the MP4 file in buf in front of its first mdat
+// atom, in place, so that it can be played while it downloads. Chunk
+// offsets are rewritten to match. Returns 1 if the file was rewritten,
+// or 0 if it was left as it was (already progressive, or not understood).
+int mp4_faststart(uint8_t *buf, size_t len)
+{
+    atom a, moov = { 0 }, mdat = { 0 };
+
+    for (size_t pos = 0; pos < len && next_atom(buf, pos, len, &a); pos += a.size) {
+        if (a.type == ATOM('m','d','a','t') && !mdat.size)
+            mdat = a;
+        if (a.type == ATOM('m','o','o','v') && !moov.size)
+            moov = a;
+    }
+
+    // Nothing to do, or nothing we can do
+    if (!moov.size || !mdat.size || moov.offset < mdat.offset)
+        return 0;
+
+    // Everything from the mdat up to the moov moves
+    // forward by the size of the moov.
+    size_t insert = mdat.offset;
+    size_t moved  = moov.offset - insert;
+
+    if (!patch_offsets(buf, moov.offset + moov.header, moov.offset + moov.size, insert, moov.offset, moov.size, 0))
+        return 0;
+
+    uint8_t *copy = malloc(moov.size);
+    if (!copy)
+        return 0;
+
+    patch_offsets(buf, moov.offset + moov.header, moov.offset + moov.size, insert, moov.offset, moov.size, 1);
+
+    memcpy(copy, &buf[moov.offset], moov.size);
+    memmove(&buf[insert + moov.size], &buf[insert], moved);
+    memcpy(&buf[insert], copy, moov.size);
+
+    free(copy);
+
+    return 1;
+}
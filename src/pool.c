@@ -0,0 +1,442 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+// Allocations from POOL_MIN to POOL_MAX bytes, less a header, are pooled. Smaller ones
+// are left to malloc, and larger ones are mapped and unmapped each time.
+#define POOL_MIN_SHIFT 16
+#define POOL_MAX_SHIFT 28
+#define POOL_MIN       ((size_t) 1 << POOL_MIN_SHIFT)
+#define POOL_MAX       ((size_t) 1 << POOL_MAX_SHIFT)
+
+// Size classes per doubling of size
+#define CLASS_STEPS 4
+#define NCLASSES    ((POOL_MAX_SHIFT - POOL_MIN_SHIFT) * CLASS_STEPS + 1)
+
+#define CLASS_SYSTEM (NCLASSES)
+#define CLASS_DIRECT (NCLASSES + 1)
+
+// Mappings at least this big are aligned for transparent huge pages
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+// Free bytes one thread keeps before handing blocks straight back
+#define THREAD_RETAIN (64 * 1024 * 1024)
+
+// Free bytes kept across all threads. Idle trimming only runs on a
+// thread which allocates or frees, so this bounds what threads which
+// have gone quiet can hold on to.
+#define PROCESS_RETAIN (256 * 1024 * 1024)
+
+// Free lists untouched for this long are returned to the OS
+#define IDLE_NSEC (5 * 1000000000LL)
+#define TRIM_INTERVAL_NSEC (1000000000LL)
+
+#define BLOCK_MAGIC 0x4c4f4f50 // "POOL"
+
+// Precedes every allocation, keeping malloc's 16-byte alignment
+typedef struct {
+    uint32_t magic;
+    uint32_t cls;
+    uint64_t size; /// Usable bytes
+} block_header;
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block;
+
+typedef struct {
+    free_block *free[NCLASSES];
+    int64_t used_at[NCLASSES]; /// Last push or pop, for idle trimming
+    size_t retained;
+    int64_t trimmed_at;
+} thread_pool;
+
+static _Atomic uint64_t stat_hits;
+static _Atomic uint64_t stat_misses;
+static _Atomic uint64_t stat_huge;
+static _Atomic uint64_t stat_system;
+static _Atomic uint64_t stat_trimmed;
+static _Atomic size_t stat_retained;
+static _Atomic size_t stat_in_use;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static __thread thread_pool *current_pool;
+static __thread int pool_released; /// Thread exit has freed current_pool
+
+// Bytes allocated less bytes freed by this thread, and its high-water
+// mark since pool_thread_mark. Blocks freed by another thread than the
+// one which allocated them skew both, so they are only a guide.
+static __thread int64_t thread_allocated;
+static __thread int64_t thread_peak;
+
+static void count_allocated(int64_t bytes)
+{
+    thread_allocated += bytes;
+    thread_peak = MAX(thread_peak, thread_allocated);
+}
+
+static int64_t now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Usable bytes of a class. Its mappings are the class's size exactly,
+// header included, so that classes from 2MB up fill whole huge pages.
+static size_t class_size(uint32_t cls)
+{
+    size_t base = (size_t) 1 << (POOL_MIN_SHIFT + cls / CLASS_STEPS);
+    return base + (base / CLASS_STEPS) * (cls % CLASS_STEPS) - sizeof(block_header);
+}
+
+static uint32_t class_of(size_t size)
+{
+    // Smallest class which holds size
+    int shift = 63 - __builtin_clzll(size + sizeof(block_header));
+    uint32_t cls = (shift - POOL_MIN_SHIFT) * CLASS_STEPS;
+
+    while (class_size(cls) < size)
+        cls++;
+
+    return cls;
+}
+
+static size_t mapping_size(size_t usable)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len  = usable + sizeof(block_header);
+
+    if (len >= HUGE_PAGE)
+        return (len + HUGE_PAGE - 1) & ~(size_t) (HUGE_PAGE - 1);
+
+    return (len + page - 1) & ~(page - 1);
+}
+
+static block_header *map_block(size_t usable, uint32_t cls)
+{
+    size_t len = mapping_size(usable);
+    uint8_t *p;
+
+    if (len >= HUGE_PAGE) {
+        // Over-map, then trim to a huge page boundary
+        // so the whole block can be backed by them
+        uint8_t *raw = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+
+        p = (uint8_t *) (((uintptr_t) raw + HUGE_PAGE - 1) & ~(uintptr_t) (HUGE_PAGE - 1));
+
+        if (p > raw)
+            munmap(raw, p - raw);
+
+        munmap(p + len, (raw + len + HUGE_PAGE) - (p + len));
+
+#ifdef MADV_HUGEPAGE
+        if (madvise(p, len, MADV_HUGEPAGE) == 0)
+            atomic_fetch_add(&stat_huge, 1);
+#endif
+    } else {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+    }
+
+    block_header *h = (block_header *) p;
+
+    h->magic = BLOCK_MAGIC;
+    h->cls   = cls;
+    h->size  = usable;
+
+    return h;
+}
+
+static void unmap_block(block_header *h)
+{
+    munmap(h, mapping_size(h->size));
+}
+
+static void release_class(thread_pool *tp, uint32_t cls)
+{
+    size_t size = class_size(cls);
+
+    while (tp->free[cls]) {
+        block_header *h = (block_header *) tp->free[cls] - 1;
+
+        tp->free[cls] = tp->free[cls]->next;
+        tp->retained -= size;
+
+        atomic_fetch_sub(&stat_retained, size);
+        atomic_fetch_add(&stat_trimmed, size);
+
+        unmap_block(h);
+    }
+}
+
+static void release_pool(void *opaque)
+{
+    // Thread exit
+    thread_pool *tp = (thread_pool *) opaque;
+
+    for (uint32_t cls = 0; cls < NCLASSES; ++cls)
+        release_class(tp, cls);
+
+    free(tp);
+
+    // Destructors of other keys may still allocate; they go
+    // straight to mmap from here on
+    current_pool = NULL;
+    pool_released = 1;
+}
+
+static void create_key()
+{
+    pthread_key_create(&pool_key, &release_pool);
+}
+
+static thread_pool *get_pool()
+{
+    if (current_pool || pool_released)
+        return current_pool;
+
+    pthread_once(&key_once, &create_key);
+
+    current_pool = (thread_pool *) calloc(1, sizeof(thread_pool));
+    if (current_pool)
+        pthread_setspecific(pool_key, current_pool);
+
+    return current_pool;
+}
+
+static block_header *header_of(void *ptr)
+{
+    // Anything else passed in, or a block freed twice, would otherwise
+    // be unmapped or freed from whatever its "header" says
+    block_header *h = (block_header *) ptr - 1;
+
+    if (h->magic != BLOCK_MAGIC)
+        abort();
+
+    return h;
+}
+
+static void trim_idle(thread_pool *tp, int64_t now)
+{
+    if (now - tp->trimmed_at < TRIM_INTERVAL_NSEC)
+        return;
+
+    tp->trimmed_at = now;
+
+    for (uint32_t cls = 0; cls < NCLASSES; ++cls)
+        if (tp->free[cls] && now - tp->used_at[cls] > IDLE_NSEC)
+            release_class(tp, cls);
+}
+
+// Allocates like malloc, from the calling thread's pools when
+// the size is worth pooling.
+void *pool_malloc(size_t size)
+{
+    block_header *h;
+
+    if (size < POOL_MIN) {
+        h = (block_header *) malloc(sizeof(block_header) + size);
+        if (!h)
+            return NULL;
+
+        h->magic = BLOCK_MAGIC;
+        h->cls   = CLASS_SYSTEM;
+        h->size  = size;
+
+        atomic_fetch_add(&stat_system, 1);
+        count_allocated(size);
+
+        return h + 1;
+    }
+
+    if (size > class_size(NCLASSES - 1)) {
+        h = map_block(size, CLASS_DIRECT);
+        if (!h)
+            return NULL;
+
+        atomic_fetch_add(&stat_misses, 1);
+        atomic_fetch_add(&stat_in_use, size);
+        count_allocated(size);
+
+        return h + 1;
+    }
+
+    uint32_t cls = class_of(size);
+    size_t usable = class_size(cls);
+    thread_pool *tp = get_pool();
+    int64_t now = now_nsec();
+
+    if (tp && tp->free[cls]) {
+        h = (block_header *) tp->free[cls] - 1;
+
+        tp->free[cls] = tp->free[cls]->next;
+        tp->retained -= usable;
+        tp->used_at[cls] = now;
+
+        h->magic = BLOCK_MAGIC;
+
+        atomic_fetch_add(&stat_hits, 1);
+        atomic_fetch_sub(&stat_retained, usable);
+    } else {
+        h = map_block(usable, cls);
+        if (!h)
+            return NULL;
+
+        atomic_fetch_add(&stat_misses, 1);
+    }
+
+    atomic_fetch_add(&stat_in_use, usable);
+    count_allocated(usable);
+
+    if (tp)
+        trim_idle(tp, now);
+
+    return h + 1;
+}
+
+// Frees memory from pool_malloc or pool_realloc. Pooled blocks
+// go on the calling thread's free list.
+void pool_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    block_header *h = header_of(ptr);
+
+    count_allocated(-(int64_t) h->size);
+    h->magic = 0;
+
+    if (h->cls == CLASS_SYSTEM) {
+        free(h);
+        return;
+    }
+
+    atomic_fetch_sub(&stat_in_use, h->size);
+
+    if (h->cls == CLASS_DIRECT) {
+        unmap_block(h);
+        return;
+    }
+
+    // Blocks are independent mappings, so whichever
+    // thread frees one keeps it
+    thread_pool *tp = get_pool();
+    uint32_t cls = h->cls;
+
+    if (!tp || tp->retained + h->size > THREAD_RETAIN) {
+        unmap_block(h);
+        return;
+    }
+
+    if (atomic_fetch_add(&stat_retained, h->size) + h->size > PROCESS_RETAIN) {
+        atomic_fetch_sub(&stat_retained, h->size);
+        unmap_block(h);
+        return;
+    }
+
+    free_block *b = (free_block *) ptr;
+
+    b->next = tp->free[cls];
+    tp->free[cls] = b;
+    tp->retained += h->size;
+    tp->used_at[cls] = now_nsec();
+
+    trim_idle(tp, tp->used_at[cls]);
+}
+
+// Resizes memory from pool_malloc, moving it only when it
+// outgrows its block or shrinks well below it.
+void *pool_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return pool_malloc(size);
+
+    block_header *h = header_of(ptr);
+
+    if (h->cls == CLASS_SYSTEM && size < POOL_MIN) {
+        int64_t old_size = h->size;
+
+        h = (block_header *) realloc(h, sizeof(block_header) + size);
+        if (!h)
+            return NULL;
+
+        h->size = size;
+        count_allocated((int64_t) size - old_size);
+        return h + 1;
+    }
+
+    // Still fits in its block, and isn't so much smaller
+    // that it would be worth moving
+    if (h->cls < NCLASSES && size <= h->size && size >= h->size / 2)
+        return ptr;
+
+    void *grown = pool_malloc(size);
+    if (!grown)
+        return NULL;
+
+    memcpy(grown, ptr, MIN(size, h->size));
+    pool_free(ptr);
+
+    return grown;
+}
+
+// Resets the calling thread's high-water mark to what it has allocated
+// now, and returns that.
+int64_t pool_thread_mark(void)
+{
+    thread_peak = thread_allocated;
+    return thread_allocated;
+}
+
+// Most the calling thread has had allocated since pool_thread_mark.
+int64_t pool_thread_peak(void)
+{
+    return thread_peak;
+}
+
+// Raises the calling thread's high-water mark back to peak, as it
+// was before a nested pool_thread_mark.
+void pool_thread_restore(int64_t peak)
+{
+    thread_peak = MAX(thread_peak, peak);
+}
+
+// Gets allocation counters for every thread.
+pool_stats pool_get_stats(void)
+{
+    return (pool_stats) {
+        .hits     = atomic_load(&stat_hits),
+        .misses   = atomic_load(&stat_misses),
+        .huge     = atomic_load(&stat_huge),
+        .system   = atomic_load(&stat_system),
+        .trimmed  = atomic_load(&stat_trimmed),
+        .retained = atomic_load(&stat_retained),
+        .in_use   = atomic_load(&stat_in_use)
+    };
+}
+
+// Returns every free block held by the calling thread to the OS.
+void pool_trim(void)
+{
+    thread_pool *tp = current_pool;
+
+    if (!tp)
+        return;
+
+    for (uint32_t cls = 0; cls < NCLASSES; ++cls)
+        release_class(tp, cls);
+}
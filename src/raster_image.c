@@ -1,9 +1,16 @@
 #include "raster_image.h"
+#include "kernels.h"
+#include "trace.h"
 
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <magick/api.h>
 
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
 
 Image *gif_optimize(Image *coalesced); // src/gif_optimize.c
 
@@ -11,39 +18,69 @@ struct raster_image {
     Image *image;
     ImageInfo *info;
     size_t frames;
-    dim_t dimensions;
+    dim_t dimensions;             /// As oriented
+    OrientationType orientation;  /// Not yet applied to image
 };
 
-raster_image *setup_raster_image(raster_image *ri)
+// Whether this EXIF orientation turns the image on its side
+static int orientation_transposes(OrientationType orientation)
 {
+    return orientation == LeftTopOrientation ||
+           orientation == RightTopOrientation ||
+           orientation == RightBottomOrientation ||
+           orientation == LeftBottomOrientation;
+}
+
+// Rotates the pixels as the pending orientation says. Done only when
+// they are about to be read out, so that an image scaled first is
+// rotated at its scaled size.
+static int apply_orientation(raster_image *ri)
+{
+    if (ri->orientation <= TopLeftOrientation)
+        return 1;
+
     ExceptionInfo ex;
     GetExceptionInfo(&ex);
 
+    trace_span span = trace_begin();
+    Image *oriented = AutoOrientImage(ri->image, ri->orientation, &ex);
+    trace_end(TRACE_ORIENT, &span, 0, 0, 1);
+
+    DestroyExceptionInfo(&ex);
+
+    if (!oriented)
+        return 0;
+
+    DestroyImageList(ri->image);
+    ri->image = oriented;
+    ri->orientation = TopLeftOrientation;
+
+    return 1;
+}
+
+raster_image *setup_raster_image(raster_image *ri)
+{
     ri->frames = GetImageListLength(ri->image);
     if (ri->frames == 1) {
-        // Automatically orient the image
-        Image *rotated = ri->image;
-        ri->image = AutoOrientImage(rotated, rotated->orientation, &ex);
-        DestroyImageList(rotated);
-        if (!ri->image)
-            goto error;
+        // Orient the image, but only once its pixels are needed
+        ri->orientation = ri->image->orientation;
+        ri->image->orientation = TopLeftOrientation;
 
         StripImage(ri->image);
 
-        ri->dimensions.width  = ri->image->columns;
-        ri->dimensions.height = ri->image->rows;
+        if (orientation_transposes(ri->orientation)) {
+            ri->dimensions.width  = ri->image->rows;
+            ri->dimensions.height = ri->image->columns;
+        } else {
+            ri->dimensions.width  = ri->image->columns;
+            ri->dimensions.height = ri->image->rows;
+        }
     } else {
         ri->dimensions.width  = ri->image->page.width;
         ri->dimensions.height = ri->image->page.height;
     }
 
-    DestroyExceptionInfo(&ex);
     return ri;
-
-error:
-    raster_image_free(ri);
-    DestroyExceptionInfo(&ex);
-    return NULL;
 }
 
 // Returns a new raster_image pointer if this buffer was
@@ -52,6 +89,8 @@ raster_image *raster_image_from_buffer(const void *buf, size_t len)
 {
     ExceptionInfo ex;
 
+    image_proc_init();
+
     // Set up exception handling
     GetExceptionInfo(&ex);
 
@@ -63,7 +102,10 @@ raster_image *raster_image_from_buffer(const void *buf, size_t len)
     if (!ri->info)
         goto error;
 
+    trace_span span = trace_begin();
     ri->image = BlobToImage(ri->info, buf, len, &ex);
+    trace_end(TRACE_LOAD, &span, len, 0, ri->image ? GetImageListLength(ri->image) : 0);
+
     if (!ri->image)
         goto error;
 
@@ -83,6 +125,8 @@ raster_image *raster_image_from_file(const char *filename)
 {
     ExceptionInfo ex;
 
+    image_proc_init();
+
     // Set up exception handling
     GetExceptionInfo(&ex);
 
@@ -98,7 +142,10 @@ raster_image *raster_image_from_file(const char *filename)
     if (!ri->info->file)
         goto error;
 
+    trace_span span = trace_begin();
     ri->image = ReadImage(ri->info, &ex);
+    trace_end(TRACE_LOAD, &span, 0, 0, ri->image ? GetImageListLength(ri->image) : 0);
+
     if (!ri->image)
         goto error;
 
@@ -112,6 +159,100 @@ error:
     return NULL;
 }
 
+// Creates a single-frame raster_image with a blank pixel cache, to be
+// written as packed PixelPackets (BGRA, depth bits per channel) through
+// *pixels and then committed with raster_image_sync_pixels. The frame is
+// encoded as magick by raster_image_to_buffer.
+raster_image *raster_image_new_pixels(uint32_t width, uint32_t height, const char *magick, void **pixels, size_t *stride, int *depth)
+{
+    image_proc_init();
+
+    raster_image *ri = (raster_image *) calloc(1, sizeof(raster_image));
+    if (!ri)
+        goto error;
+
+    ri->info = CloneImageInfo(NULL);
+    if (!ri->info)
+        goto error;
+
+    ri->image = AllocateImage(ri->info);
+    if (!ri->image)
+        goto error;
+
+    ri->image->columns = width;
+    ri->image->rows    = height;
+    ri->image->matte   = MagickFalse;
+    strncpy(ri->image->magick, magick, MaxTextExtent - 1);
+
+    // For an in-memory cache this is the cache itself, so whatever
+    // is written here does not have to be copied again.
+    PixelPacket *cache = SetImagePixels(ri->image, 0, 0, width, height);
+    if (!cache)
+        goto error;
+
+    *pixels = cache;
+    *stride = width * sizeof(PixelPacket);
+    *depth  = QuantumDepth;
+
+    ri->frames = 1;
+    ri->dimensions.width  = width;
+    ri->dimensions.height = height;
+
+    return ri;
+
+error:
+    raster_image_free(ri);
+    return NULL;
+}
+
+// Appends a blank frame the size of the first to a raster_image from
+// raster_image_new_pixels, exposing its pixel cache in the same way.
+int raster_image_add_frame(raster_image *ri, void **pixels, size_t *stride)
+{
+    ExceptionInfo ex;
+    GetExceptionInfo(&ex);
+
+    Image *frame = CloneImage(ri->image, ri->image->columns, ri->image->rows, MagickTrue, &ex);
+    DestroyExceptionInfo(&ex);
+
+    if (!frame)
+        return 0;
+
+    PixelPacket *cache = SetImagePixels(frame, 0, 0, frame->columns, frame->rows);
+    if (!cache) {
+        DestroyImage(frame);
+        return 0;
+    }
+
+    AppendImageToList(&ri->image, frame);
+
+    *pixels = cache;
+    *stride = frame->columns * sizeof(PixelPacket);
+
+    ri->frames++;
+
+    return 1;
+}
+
+// Sets the delay, in centiseconds, of the last frame of a raster_image.
+void raster_image_set_delay(raster_image *ri, size_t delay)
+{
+    GetLastImageInList(ri->image)->delay = delay;
+}
+
+// Commits pixels written to the last frame through
+// raster_image_new_pixels or raster_image_add_frame.
+int raster_image_sync_pixels(raster_image *ri)
+{
+    Image *frame = GetLastImageInList(ri->image);
+
+    // Writers fill the opacity channel with whatever their format
+    // has there, so it is never meaningful.
+    frame->matte = MagickFalse;
+
+    return SyncImagePixels(frame) == MagickPass;
+}
+
 // Frees this raster_image.
 void raster_image_free(raster_image *ri)
 {
@@ -151,17 +292,11 @@ static MagickPassFail pixel_iterator(
 )
 {
     rect_sum_t *mem = (rect_sum_t *) dat;
-    rect_sum_t curr = *mem;
-
-    for (long i = 0; i < npixels; ++i) {
-        PixelPacket p = pixels[i];
+    rect_sum_t row = kernel_pixel_sum(pixels, npixels);
 
-        curr.r += p.red / (sizeof(Quantum) * 128);
-        curr.g += p.green / (sizeof(Quantum) * 128);
-        curr.b += p.blue / (sizeof(Quantum) * 128);
-    }
-
-    *mem = curr;
+    mem->r += row.r;
+    mem->g += row.g;
+    mem->b += row.b;
 
     return MagickPass;
 }
@@ -200,24 +335,203 @@ static float sum_intensity(rect_sum_t sum, uint32_t npixels)
             (sum.b / npixels) * 0.0772) / 3;
 }
 
+static intensity_t frame_intensities(Image *frame, uint32_t w, uint32_t h)
+{
+    rect_sum_t ins[] = {
+        internal_intensities_get(frame, (rect_t) { 0, 0, w/2, h/2 }), // nw
+        internal_intensities_get(frame, (rect_t) { w/2, 0, w, h/2 }), // ne
+        internal_intensities_get(frame, (rect_t) { 0, h/2, w/2, h }), // sw
+        internal_intensities_get(frame, (rect_t) { w/2, h/2, w, h }), // se
+        internal_intensities_get(frame, (rect_t) { 0, 0, w, h })      // avg
+    };
+
+    return (intensity_t) {
+        .nw  = sum_intensity(ins[0], w*h/4),
+        .ne  = sum_intensity(ins[1], w*h/4),
+        .sw  = sum_intensity(ins[2], w*h/4),
+        .se  = sum_intensity(ins[3], w*h/4),
+        .avg = sum_intensity(ins[4], w*h)
+    };
+}
+
+// Intensities of the oriented image, from those of its stored pixels
+static intensity_t orient_intensities(intensity_t i, OrientationType orientation)
+{
+    switch (orientation) {
+    case TopRightOrientation:    return (intensity_t) { i.ne, i.nw, i.se, i.sw, i.avg };
+    case BottomRightOrientation: return (intensity_t) { i.se, i.sw, i.ne, i.nw, i.avg };
+    case BottomLeftOrientation:  return (intensity_t) { i.sw, i.se, i.nw, i.ne, i.avg };
+    case LeftTopOrientation:     return (intensity_t) { i.nw, i.sw, i.ne, i.se, i.avg };
+    case RightTopOrientation:    return (intensity_t) { i.sw, i.nw, i.se, i.ne, i.avg };
+    case RightBottomOrientation: return (intensity_t) { i.se, i.ne, i.sw, i.nw, i.avg };
+    case LeftBottomOrientation:  return (intensity_t) { i.ne, i.se, i.nw, i.sw, i.avg };
+    default:                     return i;
+    }
+}
+
 static Image *get_coalesced(Image *in)
 {
     ExceptionInfo ex;
     GetExceptionInfo(&ex);
+    trace_span span = trace_begin();
     Image *out = CoalesceImages(in, &ex);
+    trace_end(TRACE_COALESCE, &span, 0, 0, out ? GetImageListLength(out) : 0);
     DestroyExceptionInfo(&ex);
 
     return out;
 }
 
+struct raster_frame_iter {
+    Image *next;         /// Next frame to compose
+    Image *canvas;       /// Frame composed so far
+    Image *saved;        /// Canvas to restore for PreviousDispose
+    RectangleInfo area;  /// Region of the last frame
+    DisposeType dispose; /// What to do with the last frame
+};
+
+static void clear_region(Image *canvas, RectangleInfo area)
+{
+    // Clip to the canvas, then fill with its background
+    long x0 = MAX(area.x, 0);
+    long y0 = MAX(area.y, 0);
+    long x1 = MIN(area.x + (long) area.width, (long) canvas->columns);
+    long y1 = MIN(area.y + (long) area.height, (long) canvas->rows);
+
+    if (x1 <= x0 || y1 <= y0)
+        return;
+
+    PixelPacket *pixels = SetImagePixels(canvas, x0, y0, x1 - x0, y1 - y0);
+    if (!pixels)
+        return;
+
+    for (long i = 0; i < (x1 - x0) * (y1 - y0); ++i)
+        pixels[i] = canvas->background_color;
+
+    SyncImagePixels(canvas);
+}
+
+// Starts composing the frames of this raster_image one at a time, on
+// a single canvas, in place of coalescing them all at once.
+raster_frame_iter *raster_frame_iter_new(raster_image *ri)
+{
+    ExceptionInfo ex;
+    GetExceptionInfo(&ex);
+
+    raster_frame_iter *it = (raster_frame_iter *) calloc(1, sizeof(raster_frame_iter));
+    if (!it || !apply_orientation(ri))
+        goto error;
+
+    it->next = ri->image;
+
+    // Start from an opaque black canvas the size of the animation
+    it->canvas = CloneImage(ri->image, ri->dimensions.width, ri->dimensions.height, MagickTrue, &ex);
+    if (!it->canvas)
+        goto error;
+
+    it->canvas->page  = (RectangleInfo) { 0 };
+    it->canvas->matte = MagickFalse;
+    it->canvas->background_color = (PixelPacket) { .opacity = OpaqueOpacity };
+
+    SetImage(it->canvas, OpaqueOpacity);
+
+    DestroyExceptionInfo(&ex);
+    return it;
+
+error:
+    if (it && it->canvas)
+        DestroyImage(it->canvas);
+
+    free(it);
+    DestroyExceptionInfo(&ex);
+    return NULL;
+}
+
+// Composes the next frame, returning the canvas as packed PixelPackets
+// (BGRA, depth bits per channel) along with the frame's delay in
+// centiseconds, or NULL after the last frame. The pixels are only
+// valid until the next call.
+const void *raster_frame_iter_next(raster_frame_iter *it, size_t *stride, int *depth, int *delay)
+{
+    if (!it->next)
+        return NULL;
+
+    ExceptionInfo ex;
+    GetExceptionInfo(&ex);
+
+    // Undo the last frame, as it asked
+    if (it->dispose == BackgroundDispose) {
+        clear_region(it->canvas, it->area);
+    } else if (it->dispose == PreviousDispose && it->saved) {
+        DestroyImage(it->canvas);
+        it->canvas = it->saved;
+        it->saved  = NULL;
+    }
+
+    Image *frame = it->next;
+
+    if (frame->dispose == PreviousDispose) {
+        it->saved = CloneImage(it->canvas, 0, 0, MagickTrue, &ex);
+        if (!it->saved)
+            goto error;
+    }
+
+    if (CompositeImage(it->canvas, OverCompositeOp, frame, frame->page.x, frame->page.y) != MagickPass)
+        goto error;
+
+    it->dispose = frame->dispose;
+    it->area    = (RectangleInfo) {
+        .width  = frame->columns,
+        .height = frame->rows,
+        .x      = frame->page.x,
+        .y      = frame->page.y
+    };
+    it->next = frame->next;
+
+    const PixelPacket *pixels = AcquireImagePixels(it->canvas, 0, 0, it->canvas->columns, it->canvas->rows, &ex);
+    if (!pixels)
+        goto error;
+
+    *stride = it->canvas->columns * sizeof(PixelPacket);
+    *depth  = QuantumDepth;
+    *delay  = frame->delay;
+
+    DestroyExceptionInfo(&ex);
+    return pixels;
+
+error:
+    it->next = NULL;
+    DestroyExceptionInfo(&ex);
+    return NULL;
+}
+
+// Frees this frame iterator.
+void raster_frame_iter_free(raster_frame_iter *it)
+{
+    if (!it)
+        return;
+
+    if (it->canvas)
+        DestroyImage(it->canvas);
+    if (it->saved)
+        DestroyImage(it->saved);
+
+    free(it);
+}
+
 // Gets corner intensities for this raster_image.
 // This takes the median frame for APNG/GIF.
 intensity_t raster_image_get_intensities(raster_image *ri)
 {
     Image *frame = ri->image;
+    uint32_t w = ri->dimensions.width;
+    uint32_t h = ri->dimensions.height;
     int dispose = 0;
 
-    if (ri->frames > 1) {
+    if (ri->frames == 1) {
+        // Quadrants of the pixels as stored, rather than rotated
+        w = frame->columns;
+        h = frame->rows;
+    } else {
         frame = get_coalesced(frame);
 
         if (!frame)
@@ -230,27 +544,73 @@ intensity_t raster_image_get_intensities(raster_image *ri)
             frame = frame->next;
     }
 
-    uint32_t w = ri->dimensions.width;
-    uint32_t h = ri->dimensions.height;
-
-    rect_sum_t ins[] = {
-        internal_intensities_get(frame, (rect_t) { 0, 0, w/2, h/2 }), // nw
-        internal_intensities_get(frame, (rect_t) { w/2, 0, w, h/2 }), // ne
-        internal_intensities_get(frame, (rect_t) { 0, h/2, w/2, h }), // sw
-        internal_intensities_get(frame, (rect_t) { w/2, h/2, w, h }), // se
-        internal_intensities_get(frame, (rect_t) { 0, 0, w, h })      // avg
-    };
+    intensity_t ret = frame_intensities(frame, w, h);
 
     if (dispose)
         DestroyImageList(frame);
 
-    return (intensity_t) {
-        .nw  = sum_intensity(ins[0], w*h/4),
-        .ne  = sum_intensity(ins[1], w*h/4),
-        .sw  = sum_intensity(ins[2], w*h/4),
-        .se  = sum_intensity(ins[3], w*h/4),
-        .avg = sum_intensity(ins[4], w*h)
-    };
+    return orient_intensities(ret, ri->orientation);
+}
+
+// How much two sets of intensities differ, as a scene change score.
+// Shared with video_get_signature, so that the two stay comparable.
+float intensity_distance(intensity_t a, intensity_t b)
+{
+    return (fabsf(a.nw - b.nw) + fabsf(a.ne - b.ne) +
+            fabsf(a.sw - b.sw) + fabsf(a.se - b.se) +
+            fabsf(a.avg - b.avg)) / 5;
+}
+
+// Gets corner intensities at n uniformly spaced times through this
+// raster_image's animation, along with scene change scores.
+int raster_image_get_signature(raster_image *ri, size_t n, intensity_t *points, float *scene)
+{
+    if (n == 0)
+        return 0;
+
+    // A still image waiting to be oriented is the same at every time,
+    // and its quadrants can be remapped instead of rotating it
+    if (ri->orientation > TopLeftOrientation) {
+        intensity_t still = raster_image_get_intensities(ri);
+
+        for (size_t i = 0; i < n; ++i) {
+            points[i] = still;
+            scene[i]  = 0;
+        }
+
+        return 1;
+    }
+
+    // Total play time, with delays as browsers play them
+    size_t duration = 0;
+
+    for (Image *frame = ri->image; frame; frame = frame->next)
+        duration += frame->delay < 2 ? 10 : frame->delay;
+
+    raster_frame_iter *it = raster_frame_iter_new(ri);
+    if (!it)
+        return 0;
+
+    const void *pixels;
+    size_t stride;
+    int depth, delay;
+    size_t next = 0;
+    double end = 0;
+
+    // Each sample is the frame on screen at its time
+    while (next < n && (pixels = raster_frame_iter_next(it, &stride, &depth, &delay))) {
+        end += delay < 2 ? 10 : delay;
+
+        while (next < n && (duration * (next + 0.5) / n < end || !it->next)) {
+            points[next] = frame_intensities(it->canvas, it->canvas->columns, it->canvas->rows);
+            scene[next]  = next > 0 ? intensity_distance(points[next], points[next - 1]) : 0;
+            next++;
+        }
+    }
+
+    raster_frame_iter_free(it);
+
+    return next == n;
 }
 
 // Scale this raster_image proportionally to either a height of max_h,
@@ -279,6 +639,8 @@ raster_image *raster_image_scale(raster_image *ri, size_t max_w, size_t max_h)
 
     double ratio = MIN((double) max_w / ri->dimensions.width, (double) max_h / ri->dimensions.height);
 
+    trace_span span = trace_begin();
+
     // Everything must be scaled evenly
     while (frame) {
         uint32_t new_w = frame->columns * ratio;
@@ -293,9 +655,12 @@ raster_image *raster_image_scale(raster_image *ri, size_t max_w, size_t max_h)
         frame = frame->next;
     }
 
+    trace_end(TRACE_RESIZE, &span, 0, 0, GetImageListLength(si->image));
+
     si->frames = GetImageListLength(ri->image);//ri->frames;
     si->dimensions.width  = ri->dimensions.width * ratio;
     si->dimensions.height = ri->dimensions.height * ratio;
+    si->orientation = ri->orientation;
 
     DestroyImageList(iframe);
     DestroyExceptionInfo(&ex);
@@ -308,20 +673,57 @@ error:
     return NULL;
 }
 
+// Encodes every frame in the image's own format to fp, which is left open.
+static int write_image(raster_image *ri, FILE *fp)
+{
+    char filename[MaxTextExtent];
+
+    ri->info->interlace = NoInterlace;
+    ri->info->dither = MagickFalse;
+    ri->info->file = fp;
+
+    // The format is the image's, whatever its name says
+    memcpy(filename, ri->image->filename, sizeof(filename));
+    snprintf(ri->image->filename, MaxTextExtent, "%s:", ri->image->magick);
+
+    int ok = WriteImage(ri->info, ri->image) == MagickPass;
+
+    memcpy(ri->image->filename, filename, sizeof(filename));
+    ri->info->file = NULL;
+
+    return ok;
+}
 
 buf_t raster_image_to_buffer(raster_image *ri)
 {
     buf_t ret = { 0 };
+    char *buf = NULL;
+    size_t len = 0;
 
-    ExceptionInfo ex;
-    GetExceptionInfo(&ex);
+    if (!apply_orientation(ri))
+        return ret;
 
-    ri->info->interlace = NoInterlace;
-    ri->info->dither = MagickFalse;
+    // Written straight into memory from the system allocator, for callers
+    // to free(). GM's own blobs may come from the pools, and would have to
+    // be copied out.
+    FILE *fp = open_memstream(&buf, &len);
+    if (!fp)
+        return ret;
 
-    ret.buf = ImageToBlob(ri->info, ri->image, &ret.len, &ex);
+    trace_span span = trace_begin();
+    int ok = write_image(ri, fp);
 
-    DestroyExceptionInfo(&ex);
+    if (fclose(fp) != 0)
+        ok = 0;
+
+    trace_end(TRACE_ENCODE, &span, 0, ok ? len : 0, ri->frames);
+
+    if (ok && len > 0) {
+        ret.buf = buf;
+        ret.len = len;
+    } else {
+        free(buf);
+    }
 
     return ret;
 }
@@ -331,6 +733,9 @@ int raster_image_to_file(raster_image *ri, const char *filename)
 {
     ExceptionInfo ex;
 
+    if (!apply_orientation(ri))
+        return MagickFalse;
+
     // Set up exception handling
     GetExceptionInfo(&ex);
 
@@ -340,7 +745,9 @@ int raster_image_to_file(raster_image *ri, const char *filename)
     if (!ri->info->file)
         goto error;
 
+    trace_span span = trace_begin();
     int ret = WriteImage(ri->info, ri->image);
+    trace_end(TRACE_ENCODE, &span, 0, 0, ri->frames);
 
     DestroyExceptionInfo(&ex);
 
@@ -351,13 +758,44 @@ error:
     return MagickFalse;
 }
 
+// Writes this raster_image to fd, from its current offset, through a
+// stdio stream of its own. fd is left open. Returns 1 on success.
+int raster_image_to_fd(raster_image *ri, int fd)
+{
+    if (!apply_orientation(ri))
+        return 0;
+
+    int copy = dup(fd);
+    FILE *fp = copy >= 0 ? fdopen(copy, "wb") : NULL;
+
+    if (!fp) {
+        if (copy >= 0)
+            close(copy);
+
+        return 0;
+    }
+
+    trace_span span = trace_begin();
+    int ok = write_image(ri, fp);
+    off_t len = ftello(fp);
+
+    if (fclose(fp) != 0)
+        ok = 0;
+
+    trace_end(TRACE_ENCODE, &span, 0, ok ? len : 0, ri->frames);
+
+    return ok;
+}
+
 // Try to optimize this file. Returns 1 if an optimization was performed.
 int raster_image_optimize(raster_image *ri)
 {
     if (ri->frames == 1)
         return 0;
 
+    trace_span span = trace_begin();
     Image *opt = gif_optimize(ri->image);
+    trace_end(TRACE_OPTIMIZE, &span, 0, 0, ri->frames);
     if (opt) {
         DestroyImageList(ri->image);
         ri->image = opt;
@@ -370,3 +808,86 @@ int raster_image_optimize(raster_image *ri)
         return 0;
     }
 }
+
+// Crops a still image to region, in oriented pixels.
+static int crop_raster_image(raster_image *ri, rect_t region)
+{
+    if (ri->frames != 1 || !apply_orientation(ri))
+        return 0;
+
+    uint32_t end_x = MIN(region.end_x, ri->dimensions.width);
+    uint32_t end_y = MIN(region.end_y, ri->dimensions.height);
+
+    if (region.start_x >= end_x || region.start_y >= end_y)
+        return 0;
+
+    RectangleInfo geometry = {
+        .width  = end_x - region.start_x,
+        .height = end_y - region.start_y,
+        .x      = region.start_x,
+        .y      = region.start_y
+    };
+
+    ExceptionInfo ex;
+    GetExceptionInfo(&ex);
+
+    Image *cropped = CropImage(ri->image, &geometry, &ex);
+
+    DestroyExceptionInfo(&ex);
+
+    if (!cropped)
+        return 0;
+
+    DestroyImageList(ri->image);
+    ri->image = cropped;
+    ri->image->page = (RectangleInfo) { 0 };
+    ri->dimensions.width  = cropped->columns;
+    ri->dimensions.height = cropped->rows;
+
+    return 1;
+}
+
+// Writes this buffer upright and cropped, losslessly when it is a JPEG
+// that allows it, and otherwise through a decode and re-encode.
+buf_t raster_image_transform(const void *buf, size_t len, const raster_transform_options *opts, raster_transform_path *path)
+{
+    raster_transform_options defaults = { 0 };
+    buf_t ret = { 0 };
+
+    if (!opts)
+        opts = &defaults;
+
+    if (path)
+        *path = RASTER_TRANSFORM_FAILED;
+
+    const rect_t *crop = opts->crop ? &opts->region : NULL;
+
+    if (!opts->force_reencode) {
+        trace_span span = trace_begin();
+
+        if (jpeg_transform(buf, len, crop, opts->allow_block_alignment, &ret)) {
+            trace_end(TRACE_TRANSFORM, &span, len, ret.len, 1);
+
+            if (path)
+                *path = RASTER_TRANSFORM_LOSSLESS;
+
+            return ret;
+        }
+    }
+
+    raster_image *ri = raster_image_from_buffer(buf, len);
+    if (!ri)
+        return ret;
+
+    if (crop && !crop_raster_image(ri, *crop))
+        goto done;
+
+    ret = raster_image_to_buffer(ri);
+
+    if (ret.buf && path)
+        *path = RASTER_TRANSFORM_REENCODED;
+
+done:
+    raster_image_free(ri);
+    return ret;
+}
@@ -0,0 +1,842 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "raster_image.h"
+#include "video.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define WIRE_MAGIC 0x44525049 // "IPRD"
+
+#define DEFAULT_MAX_REQUESTS 1000
+#define DEFAULT_TIMEOUT      30.0
+
+// How often the supervisor reaps workers and checks their deadlines
+#define SUPERVISE_MS 50
+
+// Descriptors accepted with one message; any past the first are closed
+#define MAX_FDS 4
+
+// Sent with the input memfd
+typedef struct {
+    uint32_t magic;
+    uint32_t op;
+    uint64_t max_w;
+    uint64_t max_h;
+    double seconds;
+} wire_request;
+
+// Sent with the output memfd, when there is output
+typedef struct {
+    uint32_t magic;
+    int32_t ok;
+    int32_t type;
+    int32_t pid;
+    uint32_t width;
+    uint32_t height;
+    uint64_t frames;
+    double duration;
+    intensity_t intensities;
+    double error_time;
+    uint64_t len;
+} wire_result;
+
+// One per worker, in memory shared with it. Only the worker
+// writes busy_since and served; only the supervisor the rest.
+typedef struct {
+    _Atomic int64_t busy_since; // When its request started, or 0 if idle
+    _Atomic uint64_t served;
+    pid_t pid;                  // 0 if none is running
+    int killed;
+} worker_slot;
+
+struct server {
+    int listen_fd;
+    int bound;
+    struct sockaddr_un addr;
+    server_options opts;
+    pid_t supervisor;
+    worker_slot *slots;
+    volatile sig_atomic_t stopping;
+    server_stats stats;
+};
+
+struct server_conn {
+    int fd;
+    struct sockaddr_un addr;
+};
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int set_path(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+// Sends one message, with fd attached if it is not negative.
+static int send_with_fd(int sock, const void *data, size_t len, int fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct iovec iov = { (void *) data, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret == (ssize_t) len;
+}
+
+// Receives one message of exactly len bytes, and the descriptor
+// attached to it into *fd, or -1 if none was. Returns 1 if it did,
+// 0 if the peer hung up, or -1 on an error or malformed message.
+static int recv_with_fd(int sock, void *data, size_t len, int *fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(MAX_FDS * sizeof(int))];
+    } control;
+
+    struct iovec iov = { data, len };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+
+    *fd = -1;
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0)
+        return ret;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (size_t i = 0; i < n; ++i) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            if (*fd < 0)
+                *fd = received;
+            else
+                close(received);
+        }
+    }
+
+    if ((size_t) ret != len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (*fd >= 0)
+            close(*fd);
+
+        *fd = -1;
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 1;
+}
+
+static int new_memfd(void)
+{
+    return memfd_create("image_proc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+// The reader maps it, so it must never change under them
+static int seal_memfd(int fd)
+{
+    return fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+}
+
+// Returns a sealed memfd holding a copy of buf, which may be passed as
+// the input of any number of requests, or -1 if it could not be created.
+int server_memfd(const void *buf, size_t len)
+{
+    int fd = new_memfd();
+    if (fd < 0)
+        return -1;
+
+    size_t written = 0;
+
+    while (written < len) {
+        ssize_t ret = write(fd, (const uint8_t *) buf + written, len - written);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+            goto error;
+
+        written += ret;
+    }
+
+    if (!seal_memfd(fd))
+        goto error;
+
+    return fd;
+
+error:
+    close(fd);
+    return -1;
+}
+
+//
+// Workers
+//
+
+static int is_video(file_type type)
+{
+    return type == VIDEO_WEBM || type == VIDEO_MP4;
+}
+
+// Outputs are encoded straight into the memfd passed back,
+// rather than into memory and then copied there
+static int image_output(raster_image *ri, int *out_fd)
+{
+    *out_fd = new_memfd();
+
+    return *out_fd >= 0 && raster_image_to_fd(ri, *out_fd);
+}
+
+static int video_output(video *v, int *out_fd)
+{
+    *out_fd = new_memfd();
+
+    return *out_fd >= 0 && video_to_fd(v, *out_fd);
+}
+
+static void run_image(const wire_request *req, const void *input, size_t len, wire_result *res, int *out_fd)
+{
+    raster_image *ri = raster_image_from_buffer(input, len);
+    raster_image *si = NULL;
+
+    if (!ri)
+        return;
+
+    dim_t dim = raster_image_dimensions(ri);
+
+    res->width  = dim.width;
+    res->height = dim.height;
+    res->frames = raster_image_frame_count(ri);
+
+    switch (req->op) {
+    case SERVER_PROBE:
+        res->ok = 1;
+        break;
+
+    case SERVER_SCALE:
+        si = raster_image_scale(ri, req->max_w, req->max_h);
+        if (!si)
+            break;
+
+        dim = raster_image_dimensions(si);
+        res->width  = dim.width;
+        res->height = dim.height;
+
+        res->ok = image_output(si, out_fd);
+        break;
+
+    case SERVER_OPTIMIZE:
+        if (!raster_image_optimize(ri))
+            break;
+
+        res->ok = image_output(ri, out_fd);
+        break;
+
+    case SERVER_INTENSITIES:
+        res->intensities = raster_image_get_intensities(ri);
+        res->ok = 1;
+        break;
+
+    default:
+        // Video only
+        break;
+    }
+
+    raster_image_free(si);
+    raster_image_free(ri);
+}
+
+static void run_video(const wire_request *req, int fd, wire_result *res, int *out_fd)
+{
+    // Reopened through /proc, so that the demuxer
+    // maps the memfd itself and can seek within it
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    video_options opts = { .fast_open = 1 };
+    video *v = video_from_file_ex(path, &opts);
+    video *sv = NULL;
+    raster_image *frame = NULL;
+    video_validation val;
+    dim_t dim;
+
+    if (!v)
+        return;
+
+    dim = video_dimensions(v);
+
+    res->width    = dim.width;
+    res->height   = dim.height;
+    res->duration = video_duration(v);
+
+    switch (req->op) {
+    case SERVER_PROBE:
+        res->ok = 1;
+        break;
+
+    case SERVER_SCALE:
+        sv = video_scale(v, req->max_w, req->max_h);
+        if (!sv)
+            break;
+
+        dim = video_dimensions(sv);
+        res->width  = dim.width;
+        res->height = dim.height;
+
+        res->ok = video_output(sv, out_fd);
+        break;
+
+    case SERVER_INTENSITIES:
+        res->ok = video_get_intensities(v, &res->intensities);
+        break;
+
+    case SERVER_FRAME_AT:
+        frame = video_frame_at(v, req->seconds, req->max_w, req->max_h);
+        if (!frame)
+            break;
+
+        dim = raster_image_dimensions(frame);
+        res->width  = dim.width;
+        res->height = dim.height;
+
+        res->ok = image_output(frame, out_fd);
+        break;
+
+    case SERVER_VALIDATE:
+        // Finding corruption is a successful validation
+        res->ok = video_validate(v, 1, 1, &val) || val.error_time >= 0;
+        res->error_time = val.error_time;
+        res->frames     = val.frames;
+        res->duration   = val.duration;
+        break;
+
+    default:
+        // Image only
+        break;
+    }
+
+    raster_image_free(frame);
+
+    if (sv)
+        video_free(sv);
+
+    video_free(v);
+}
+
+static void handle_request(const wire_request *req, int in_fd, wire_result *res, int *out_fd)
+{
+    struct stat st;
+
+    res->error_time = -1;
+
+    if (fstat(in_fd, &st) < 0 || st.st_size <= 0)
+        return;
+
+    size_t len = st.st_size;
+    void *input = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if (input == MAP_FAILED)
+        return;
+
+    res->type = fingerprint_buffer(input, len);
+
+    if (req->op == SERVER_FINGERPRINT)
+        res->ok = res->type != UNKNOWN;
+    else if (is_video(res->type))
+        run_video(req, in_fd, res, out_fd);
+    else if (res->type != UNKNOWN)
+        run_image(req, input, len, res, out_fd);
+
+    munmap(input, len);
+
+    if (*out_fd < 0)
+        return;
+
+    if (res->ok && fstat(*out_fd, &st) == 0 && st.st_size > 0 && seal_memfd(*out_fd)) {
+        res->len = st.st_size;
+    } else {
+        res->ok = 0;
+        close(*out_fd);
+        *out_fd = -1;
+    }
+}
+
+static void worker_main(server *s, worker_slot *slot)
+{
+    // Dies with the supervisor, rather than serving on without one
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != s->supervisor)
+        _exit(0);
+
+    // Handlers of the daemon are not the worker's
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+
+    if (s->opts.memory_limit) {
+        struct rlimit limit = { s->opts.memory_limit, s->opts.memory_limit };
+        setrlimit(RLIMIT_AS, &limit);
+    }
+
+    pid_t pid = getpid();
+    uint64_t served = 0;
+
+    // A client which connects and sends nothing holds this worker no
+    // longer than a request may run, or a second
+    double timeout = MAX(s->opts.timeout, 1.0);
+    struct timeval idle = { (time_t) timeout, (suseconds_t) ((timeout - (time_t) timeout) * 1e6) };
+
+    // One request per connection, so that a client keeping its
+    // server_conn between requests holds no worker while it is idle
+    while (served < s->opts.max_requests) {
+        int conn = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            _exit(1);
+        }
+
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+        wire_request req;
+        int in_fd;
+
+        // Nothing was sent, as by server_connect checking for a server
+        if (recv_with_fd(conn, &req, sizeof(req), &in_fd) <= 0) {
+            close(conn);
+            continue;
+        }
+
+        wire_result res = { .magic = WIRE_MAGIC, .pid = pid };
+        int out_fd = -1;
+
+        atomic_store(&slot->busy_since, now_ns());
+
+        if (req.magic == WIRE_MAGIC && in_fd >= 0)
+            handle_request(&req, in_fd, &res, &out_fd);
+
+        if (in_fd >= 0)
+            close(in_fd);
+
+        send_with_fd(conn, &res, sizeof(res), out_fd);
+
+        if (out_fd >= 0)
+            close(out_fd);
+
+        atomic_store(&slot->busy_since, 0);
+        atomic_store(&slot->served, ++served);
+
+        close(conn);
+    }
+
+    _exit(0);
+}
+
+//
+// Supervisor
+//
+
+static void spawn_worker(server *s, worker_slot *slot)
+{
+    atomic_store(&slot->busy_since, 0);
+    atomic_store(&slot->served, 0);
+    slot->killed = 0;
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+        worker_main(s, slot);
+
+    // Retried on the next pass if it failed
+    slot->pid = MAX(pid, 0);
+
+    if (pid > 0)
+        s->stats.started++;
+}
+
+static void reap_worker(server *s, worker_slot *slot, int status)
+{
+    s->stats.requests += atomic_load(&slot->served);
+
+    if (slot->killed)
+        s->stats.killed++;
+    else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        s->stats.recycled++;
+    else
+        s->stats.crashed++;
+
+    slot->pid = 0;
+}
+
+// Binds a socket at path, replacing any stale one, initializes the
+// library and forks the workers. Returns NULL if the socket could not
+// be bound.
+server *server_new(const char *path, const server_options *opts)
+{
+    server *s = (server *) calloc(1, sizeof(server));
+    if (!s)
+        return NULL;
+
+    s->listen_fd = -1;
+
+    if (opts)
+        s->opts = *opts;
+
+    if (s->opts.workers <= 0)
+        s->opts.workers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    if (!s->opts.max_requests)
+        s->opts.max_requests = DEFAULT_MAX_REQUESTS;
+
+    if (s->opts.timeout <= 0)
+        s->opts.timeout = DEFAULT_TIMEOUT;
+
+    if (!set_path(&s->addr, path))
+        goto error;
+
+    s->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s->listen_fd < 0)
+        goto error;
+
+    // A socket left by a server which died is replaced; a live one is not
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        server_conn *live = server_connect(path);
+
+        if (live) {
+            server_disconnect(live);
+            errno = EADDRINUSE;
+            goto error;
+        }
+
+        unlink(path);
+    }
+
+    if (bind(s->listen_fd, (struct sockaddr *) &s->addr, sizeof(s->addr)) < 0)
+        goto error;
+
+    s->bound = 1;
+
+    if (listen(s->listen_fd, SOMAXCONN) < 0)
+        goto error;
+
+    s->slots = (worker_slot *) mmap(NULL, s->opts.workers * sizeof(worker_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s->slots == MAP_FAILED) {
+        s->slots = NULL;
+        goto error;
+    }
+
+    // Workers start initialized, sharing its pages
+    image_proc_init();
+
+    s->supervisor = getpid();
+
+    for (int i = 0; i < s->opts.workers; ++i)
+        spawn_worker(s, &s->slots[i]);
+
+    return s;
+
+error:
+    server_free(s);
+    return NULL;
+}
+
+// Replaces workers as they exit, crash or time out, until server_stop.
+void server_run(server *s)
+{
+    int64_t timeout = s->opts.timeout * 1e9;
+
+    while (!s->stopping) {
+        int64_t now = now_ns();
+
+        for (int i = 0; i < s->opts.workers; ++i) {
+            worker_slot *slot = &s->slots[i];
+            int status;
+
+            if (slot->pid > 0 && waitpid(slot->pid, &status, WNOHANG) == slot->pid)
+                reap_worker(s, slot, status);
+
+            if (slot->pid == 0) {
+                spawn_worker(s, slot);
+                continue;
+            }
+
+            int64_t busy_since = atomic_load(&slot->busy_since);
+
+            if (!slot->killed && busy_since && now - busy_since > timeout) {
+                kill(slot->pid, SIGKILL);
+                slot->killed = 1;
+            }
+        }
+
+        poll(NULL, 0, SUPERVISE_MS);
+    }
+}
+
+// Makes server_run return.
+void server_stop(server *s)
+{
+    s->stopping = 1;
+}
+
+// Gets the supervisor's counts so far.
+server_stats server_get_stats(server *s)
+{
+    return s->stats;
+}
+
+// Kills every worker, removes the socket, and frees this server.
+void server_free(server *s)
+{
+    if (!s)
+        return;
+
+    if (s->slots) {
+        for (int i = 0; i < s->opts.workers; ++i) {
+            worker_slot *slot = &s->slots[i];
+            int status;
+
+            if (slot->pid <= 0)
+                continue;
+
+            kill(slot->pid, SIGKILL);
+
+            if (waitpid(slot->pid, &status, 0) == slot->pid)
+                reap_worker(s, slot, status);
+        }
+
+        munmap(s->slots, s->opts.workers * sizeof(worker_slot));
+    }
+
+    if (s->listen_fd >= 0)
+        close(s->listen_fd);
+
+    if (s->bound)
+        unlink(s->addr.sun_path);
+
+    free(s);
+}
+
+//
+// Clients
+//
+
+static int conn_open(server_conn *c)
+{
+    c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        return 0;
+
+    if (connect(c->fd, (struct sockaddr *) &c->addr, sizeof(c->addr)) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void conn_close(server_conn *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+
+    c->fd = -1;
+}
+
+// Returns a connection to the server at path, or NULL if there is none.
+server_conn *server_connect(const char *path)
+{
+    server_conn *c = (server_conn *) calloc(1, sizeof(server_conn));
+    if (!c)
+        return NULL;
+
+    c->fd = -1;
+
+    if (!set_path(&c->addr, path) || !conn_open(c)) {
+        free(c);
+        return NULL;
+    }
+
+    // Only checks that a server is listening; each call connects anew
+    conn_close(c);
+
+    return c;
+}
+
+static int map_output(int fd, size_t len, buf_t *output)
+{
+    struct stat st;
+
+    // Sealed, so that it can't be truncated under the mapping
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 || (size_t) st.st_size < len)
+        return 0;
+
+    void *buf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED)
+        return 0;
+
+    output->buf = buf;
+    output->len = len;
+
+    return 1;
+}
+
+// Runs a request on a worker. Returns result->ok.
+int server_call(server_conn *c, const server_request *req, server_result *result)
+{
+    wire_request wreq = {
+        .magic   = WIRE_MAGIC,
+        .op      = req->op,
+        .max_w   = req->max_w,
+        .max_h   = req->max_h,
+        .seconds = req->seconds
+    };
+
+    wire_result wres;
+    int in_fd = req->fd;
+    int out_fd = -1;
+
+    memset(result, 0, sizeof(*result));
+    result->error_time = -1;
+
+    if (in_fd < 0) {
+        in_fd = server_memfd(req->buf, req->len);
+        if (in_fd < 0)
+            return 0;
+    }
+
+    // One request per connection, so that no worker waits on this
+    // client between its calls
+    if (!conn_open(c)) {
+        if (in_fd != req->fd)
+            close(in_fd);
+
+        return 0;
+    }
+
+    int sent = send_with_fd(c->fd, &wreq, sizeof(wreq), in_fd);
+
+    if (in_fd != req->fd)
+        close(in_fd);
+
+    if (!sent || recv_with_fd(c->fd, &wres, sizeof(wres), &out_fd) <= 0 || wres.magic != WIRE_MAGIC) {
+        // The worker died with the request, or was killed for it
+        if (out_fd >= 0)
+            close(out_fd);
+
+        conn_close(c);
+        errno = ECONNRESET;
+        return 0;
+    }
+
+    result->ok          = wres.ok;
+    result->type        = (file_type) wres.type;
+    result->dimensions  = (dim_t) { wres.width, wres.height };
+    result->frames      = wres.frames;
+    result->duration    = wres.duration;
+    result->intensities = wres.intensities;
+    result->error_time  = wres.error_time;
+    result->worker_pid  = wres.pid;
+
+    if (wres.len > 0 && (out_fd < 0 || !map_output(out_fd, wres.len, &result->output)))
+        result->ok = 0;
+
+    if (out_fd >= 0)
+        close(out_fd);
+
+    conn_close(c);
+
+    return result->ok;
+}
+
+// Unmaps the output of a result.
+void server_result_free(server_result *result)
+{
+    if (result->output.buf)
+        munmap(result->output.buf, result->output.len);
+
+    result->output = (buf_t) { 0 };
+}
+
+// Closes this connection.
+void server_disconnect(server_conn *c)
+{
+    if (!c)
+        return;
+
+    conn_close(c);
+    free(c);
+}
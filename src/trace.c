@@ -0,0 +1,199 @@
+#include "trace.h"
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+static const char *stage_names[TRACE_STAGES] = {
+    [TRACE_LOAD]      = "load",
+    [TRACE_ORIENT]    = "orient",
+    [TRACE_COALESCE]  = "coalesce",
+    [TRACE_RESIZE]    = "resize",
+    [TRACE_OPTIMIZE]  = "optimize",
+    [TRACE_ENCODE]    = "encode",
+    [TRACE_PROBE]     = "probe",
+    [TRACE_DECODE]    = "decode",
+    [TRACE_TRANSFORM] = "transform"
+};
+
+static atomic_int enabled;
+
+static void (*callback)(const trace_event *ev, void *user);
+static void *callback_user;
+
+static __thread trace_stats *collected;
+
+static pthread_mutex_t chrome_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *chrome;
+static atomic_int chrome_active;
+static int64_t chrome_epoch;
+static int chrome_events;
+
+static int64_t clock_nsec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Turns measurement on or off for every thread.
+void trace_enable(int on)
+{
+    atomic_store(&enabled, on);
+}
+
+// Calls cb with every stage run, on the thread which ran it.
+void trace_set_callback(void (*cb)(const trace_event *ev, void *user), void *user)
+{
+    callback = cb;
+    callback_user = user;
+}
+
+// Adds stages run on the calling thread into stats, until replaced.
+trace_stats *trace_collect(trace_stats *stats)
+{
+    trace_stats *prev = collected;
+    collected = stats;
+    return prev;
+}
+
+// Writes every stage run to filename as Chrome trace-event JSON.
+int trace_chrome_open(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        return 0;
+
+    fputs("[\n", fp);
+
+    pthread_mutex_lock(&chrome_lock);
+
+    if (chrome) {
+        fputs("\n]\n", chrome);
+        fclose(chrome);
+    }
+
+    chrome = fp;
+    atomic_store(&chrome_active, 1);
+    chrome_epoch = clock_nsec(CLOCK_MONOTONIC);
+    chrome_events = 0;
+
+    pthread_mutex_unlock(&chrome_lock);
+
+    return 1;
+}
+
+// Finishes and closes the Chrome trace, if one is open.
+void trace_chrome_close(void)
+{
+    pthread_mutex_lock(&chrome_lock);
+
+    if (chrome) {
+        fputs("\n]\n", chrome);
+        fclose(chrome);
+        chrome = NULL;
+    }
+
+    atomic_store(&chrome_active, 0);
+
+    pthread_mutex_unlock(&chrome_lock);
+}
+
+// Gets a short name for this stage.
+const char *trace_stage_name(trace_stage stage)
+{
+    if (stage < 0 || stage >= TRACE_STAGES)
+        return "unknown";
+
+    return stage_names[stage];
+}
+
+static void write_chrome_event(const trace_event *ev)
+{
+    pthread_mutex_lock(&chrome_lock);
+
+    if (chrome) {
+        // Complete events, in microseconds
+        fprintf(chrome,
+            "%s{\"name\":\"%s\",\"cat\":\"image_proc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%ld,\"args\":{\"cpu_us\":%.3f,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+            "\"frames\":%llu,\"peak_bytes\":%zu}}",
+            chrome_events++ ? ",\n" : "",
+            stage_names[ev->stage],
+            (ev->start - chrome_epoch) / 1000.0,
+            ev->wall / 1000.0,
+            (int) getpid(),
+            (long) syscall(SYS_gettid),
+            ev->cpu / 1000.0,
+            (unsigned long long) ev->bytes_in,
+            (unsigned long long) ev->bytes_out,
+            (unsigned long long) ev->frames,
+            ev->peak_bytes);
+    }
+
+    pthread_mutex_unlock(&chrome_lock);
+}
+
+// Starts measuring a stage on the calling thread.
+trace_span trace_begin(void)
+{
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed))
+        return (trace_span) { 0 };
+
+    // Marking resets the thread's high-water mark, which any span this
+    // one is nested in still needs; trace_end puts it back
+    int64_t outer_peak = pool_thread_peak();
+
+    return (trace_span) {
+        .start      = clock_nsec(CLOCK_MONOTONIC),
+        .cpu        = clock_nsec(CLOCK_THREAD_CPUTIME_ID),
+        .allocated  = pool_thread_mark(),
+        .outer_peak = outer_peak
+    };
+}
+
+// Finishes measuring a stage, and reports it.
+void trace_end(trace_stage stage, trace_span *span, uint64_t bytes_in, uint64_t bytes_out, uint64_t frames)
+{
+    // Begun while disabled
+    if (!span->start)
+        return;
+
+    trace_event ev = {
+        .stage      = stage,
+        .start      = span->start,
+        .wall       = clock_nsec(CLOCK_MONOTONIC) - span->start,
+        .cpu        = clock_nsec(CLOCK_THREAD_CPUTIME_ID) - span->cpu,
+        .bytes_in   = bytes_in,
+        .bytes_out  = bytes_out,
+        .frames     = frames,
+        .peak_bytes = MAX(pool_thread_peak() - span->allocated, 0)
+    };
+
+    pool_thread_restore(span->outer_peak);
+
+    if (collected) {
+        trace_stage_stats *s = &collected->stages[stage];
+
+        s->calls++;
+        s->wall      += ev.wall;
+        s->cpu       += ev.cpu;
+        s->bytes_in  += ev.bytes_in;
+        s->bytes_out += ev.bytes_out;
+        s->frames    += ev.frames;
+        s->peak_bytes = MAX(s->peak_bytes, ev.peak_bytes);
+    }
+
+    if (callback)
+        callback(&ev, callback_user);
+
+    if (atomic_load_explicit(&chrome_active, memory_order_relaxed))
+        write_chrome_event(&ev);
+}
@@ -1,17 +1,114 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <libavcodec/version.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/intfloat.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/opt.h>
 #include <libswscale/swscale.h>
 
+#include "job.h"
+#include "kernels.h"
+#include "trace.h"
 #include "video.h"
 
+// Fields which newer libav moved, and FFmpeg 7 removed the old ones of
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 24, 100)
+#define PAR_CHANNELS(par) ((par)->ch_layout.nb_channels)
+#else
+#define PAR_CHANNELS(par) ((par)->channels)
+#endif
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 30, 100)
+#define FRAME_DURATION(f) ((f)->duration)
+#else
+#define FRAME_DURATION(f) ((f)->pkt_duration)
+#endif
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(58, 7, 100)
+#define FRAME_IS_KEY(f) (((f)->flags & AV_FRAME_FLAG_KEY) != 0)
+#else
+#define FRAME_IS_KEY(f) ((f)->key_frame)
+#endif
+
+// Probing limits applied in fast-open mode
+#define FAST_PROBE_SIZE       (64 * 1024)
+#define FAST_ANALYZE_DURATION (AV_TIME_BASE / 2)
+
+// Default retained window for streamed inputs
+#define STREAM_WINDOW (4 * 1024 * 1024)
+
+// Default AVIO buffer size. Demuxers read headers through this buffer
+// in small pieces, so it bounds the number of read callbacks.
+#define IO_BUFFER_SIZE (256 * 1024)
+
+// Keyframe index blob layout: a fixed header, then
+// (pts, byte offset) pairs of 64-bit little-endian values
+#define INDEX_MAGIC       MKTAG('I', 'P', 'V', 'I')
+#define INDEX_VERSION     1
+#define INDEX_HEADER_SIZE 128
+#define INDEX_FORMAT_SIZE 32
+#define INDEX_ENTRY_SIZE  16
+
+// Bytes hashed at each end of the input to match it to an index
+#define INDEX_HASH_SPAN (64 * 1024)
+
+// Analysis mode: smallest side lowres decoding may reduce frames to,
+// and the largest side frames are scaled to for intensities
+#define ANALYSIS_MIN_SIDE 128
+#define ANALYSIS_SIZE     64
+
+typedef struct {
+    AVPacket **pkts;
+    size_t n;
+    size_t cap;
+} packet_list;
+
+static int packet_list_push(packet_list *l, AVPacket *pkt)
+{
+    // Takes over the reference held by pkt
+    if (l->n == l->cap) {
+        size_t cap = FFMAX(l->cap * 2, 64);
+        AVPacket **pkts = (AVPacket **) realloc(l->pkts, cap * sizeof(AVPacket *));
+        if (!pkts)
+            return 0;
+
+        l->pkts = pkts;
+        l->cap  = cap;
+    }
+
+    AVPacket *copy = av_packet_alloc();
+    if (!copy)
+        return 0;
+
+    av_packet_move_ref(copy, pkt);
+    l->pkts[l->n++] = copy;
+
+    return 1;
+}
+
+static void packet_list_free(packet_list *l)
+{
+    for (size_t i = 0; i < l->n; ++i)
+        av_packet_free(&l->pkts[i]);
+
+    free(l->pkts);
+    *l = (packet_list) { 0 };
+}
+
 struct video {
     AVCodecContext *vctx;
     AVCodecContext *actx;
@@ -19,28 +116,52 @@ struct video {
     AVIOContext *avio;
     AVFrame *frame;
     AVPacket *pkt;
+    struct SwsContext *sws; /// Cached conversion context
     AVCodec *vcodec;
     AVCodec *acodec;
     int vstream_idx;
     int astream_idx;
 
-    uint8_t *avio_buf; /// 4096-byte temporary buffer
+    uint8_t *avio_buf; /// AVIO read buffer
 
     uint8_t *buf;  /// Orginal pointer to data
     size_t  len;   /// Original length of data
     int64_t pos;   /// Position in stream
     int fd;        /// Open file descriptor, or -1 if N/A
+    int borrowed;  /// buf belongs to another video
+
+    uint8_t *ring;     /// Retained window of a streamed input, or NULL
+    size_t ring_size;  /// Capacity of ring
+    int64_t ring_end;  /// Stream offset one past the newest byte in ring
+
+    intensity_t *key_intensities; /// Keyframe intensities from a stream scan
+    int64_t *key_pts;             /// Matching keyframe pts
+    size_t nkeys;
+    int scanned;
+
+    video_options opts;
 
     dim_t dimensions;
     double duration;
     int64_t last_pts;
-};
+    int64_t end_pts; /// Furthest video packet end seen while demuxing
 
-typedef struct {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-} rgb_pix;
+    packet_list *audio_sink; /// Keeps audio packets demuxed while decoding
+
+    AVBufferPool *frame_pool;  /// Buffers for video_next_frame
+    int frame_pool_size;       /// Size of each buffer in frame_pool
+    enum AVPixelFormat out_fmt;
+    size_t out_w;              /// Fixed output size, or 0 for each frame's own
+    size_t out_h;
+    int iterating;             /// video_next_frame has positioned the stream
+
+    video_decode_mode decode_mode; /// Set for intensities, signatures and video_next_frame
+    video_decode_mode vctx_mode;   /// Mode vctx was opened in
+
+    int explode;       /// Decoder errors are reported instead of concealed
+    int64_t sent_pts;  /// Last video packet pts sent to the decoder
+    int64_t error_pts; /// First pts the decoder failed on, or AV_NOPTS_VALUE
+};
 
 static int read_packet(void *opaque, uint8_t *buf, int buf_size)
 {
@@ -48,18 +169,22 @@ static int read_packet(void *opaque, uint8_t *buf, int buf_size)
 
     // Don't copy more than is remaining, or
     // less than zero bytes
-    buf_size = FFMIN(buf_size, v->len - v->pos);
-    buf_size = FFMAX(buf_size, 0);
+    int64_t remaining = (int64_t) v->len - v->pos;
+
+    buf_size = FFMIN(buf_size, FFMAX(remaining, 0));
+
+    // In direct mode, buf is the caller's own destination (usually a
+    // packet's payload). Libav packets own their data, so this copy out
+    // of the buffer or mapping stays; it is the only one the data gets.
     memcpy(buf, &v->buf[v->pos], buf_size);
 
     v->pos += buf_size;
 
     // Return how many bytes were read
     if (buf_size == 0)
-        return AVERROR(EINVAL);
+        return AVERROR_EOF;
     else
         return buf_size;
-    
 }
 
 static int64_t seek(void *opaque, int64_t offset, int whence)
@@ -90,11 +215,76 @@ static int64_t seek(void *opaque, int64_t offset, int whence)
 
         v->pos = v->len + offset;
         return v->pos;
+
+    case AVSEEK_SIZE:
+        return v->len;
+
     default:
         return AVERROR(EINVAL);
     }
 }
 
+static int read_fd_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    video *v = (video *) opaque;
+
+    // Anything before the retained window is gone for good
+    if (v->pos < FFMAX(v->ring_end - (int64_t) v->ring_size, 0))
+        return AVERROR(ESPIPE);
+
+    // Pull more from the descriptor once the window is exhausted,
+    // discarding whatever a forward seek skipped over
+    while (v->pos >= v->ring_end) {
+        size_t off = v->ring_end % v->ring_size;
+        ssize_t got = read(v->fd, &v->ring[off], v->ring_size - off);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return AVERROR(errno);
+        if (got == 0)
+            return AVERROR_EOF;
+
+        v->ring_end += got;
+    }
+
+    // Copy out at most up to the wrap point of the ring
+    size_t off = v->pos % v->ring_size;
+
+    buf_size = FFMIN(buf_size, v->ring_end - v->pos);
+    buf_size = FFMIN(buf_size, v->ring_size - off);
+    memcpy(buf, &v->ring[off], buf_size);
+
+    v->pos += buf_size;
+
+    return buf_size;
+}
+
+static int64_t seek_fd(void *opaque, int64_t offset, int whence)
+{
+    video *v = (video *) opaque;
+
+    // The end of a stream is unknown until it has been read,
+    // so only positions relative to the start are possible.
+    switch (whence) {
+    case SEEK_SET:
+        break;
+
+    case SEEK_CUR:
+        offset += v->pos;
+        break;
+
+    default:
+        return AVERROR(ESPIPE);
+    }
+
+    if (offset < FFMAX(v->ring_end - (int64_t) v->ring_size, 0))
+        return AVERROR(ESPIPE);
+
+    v->pos = offset;
+    return v->pos;
+}
+
 static int valid_video_codec(enum AVCodecID id)
 {
     // Support WebM/MP4 video codecs, and typical animation codecs
@@ -125,515 +315,2742 @@ static int valid_audio_codec(enum AVCodecID id)
     }
 }
 
-static video *video_initialize(video *v, void *buf, size_t len)
+static int codec_parameters_complete(AVFormatContext *format)
 {
-    v->buf = (uint8_t *) buf;
-    v->len = len;
-    if (!v->buf)
-        goto error;
-
-    v->format     = avformat_alloc_context();
-    v->avio_buf   = av_malloc(4096);
-    v->avio       = avio_alloc_context(v->avio_buf, 4096, 0, v, &read_packet, NULL, &seek);
-    v->format->pb = v->avio;
-
-    if (avformat_open_input(&v->format, "", NULL, NULL) < 0)
-        goto error;
-
-    if (avformat_find_stream_info(v->format, NULL) < 0)
-        goto error;
-
-    // Bad video stream is an error
-    v->vstream_idx = av_find_best_stream(v->format, AVMEDIA_TYPE_VIDEO, -1, -1, &v->vcodec, 0);
-    if (v->vstream_idx < 0 || !valid_video_codec(v->vcodec->id))
-        goto error;
-
-    // Bad audio stream is not an error
-    v->astream_idx = av_find_best_stream(v->format, AVMEDIA_TYPE_AUDIO, -1, -1, &v->acodec, 0);
-    if (v->astream_idx < 0 || !valid_audio_codec(v->acodec->id))
-        v->acodec = NULL;
-
-    // Initialize decoding contexts
-    v->vctx = avcodec_alloc_context3(v->vcodec);
-
-    if (v->acodec)
-        v->actx = avcodec_alloc_context3(v->acodec);
+    // Whether the container header alone describes every stream
+    // well enough that stream analysis can be skipped.
+    for (unsigned int i = 0; i < format->nb_streams; ++i) {
+        AVCodecParameters *par = format->streams[i]->codecpar;
+
+        if (par->codec_id == AV_CODEC_ID_NONE)
+            return 0;
+
+        switch (par->codec_type) {
+        case AVMEDIA_TYPE_VIDEO:
+            if (par->width <= 0 || par->height <= 0 || par->format < 0)
+                return 0;
+            break;
 
-    if (!v->vctx)
-        goto error;
+        case AVMEDIA_TYPE_AUDIO:
+            if (par->sample_rate <= 0 || PAR_CHANNELS(par) <= 0)
+                return 0;
+            break;
 
-    // Setup codecs with coding parameters from container
-    avcodec_parameters_to_context(v->vctx, v->format->streams[v->vstream_idx]->codecpar);
+        default:
+            break;
+        }
+    }
 
-    if (v->actx)
-        avcodec_parameters_to_context(v->actx, v->format->streams[v->astream_idx]->codecpar);
+    return 1;
+}
 
-    // Initialize decoders
-    if (avcodec_open2(v->vctx, v->vcodec, NULL) < 0 || avcodec_open2(v->vctx, v->acodec, NULL) < 0)
-        goto error;
+static int open_decoder(AVCodecContext **ctx, AVCodec *codec, AVStream *stream, AVDictionary **opts)
+{
+    // Decoders are opened lazily, on the first operation which
+    // actually needs decoded frames.
+    if (*ctx)
+        return 1;
 
-    v->frame = av_frame_alloc();
-    v->pkt = av_packet_alloc();
+    *ctx = avcodec_alloc_context3(codec);
+    if (!*ctx)
+        return 0;
 
-    if (!v->frame || !v->pkt)
+    // Setup codec with coding parameters from container
+    if (avcodec_parameters_to_context(*ctx, stream->codecpar) < 0)
         goto error;
 
-    v->dimensions.width  = v->vctx->width;
-    v->dimensions.height = v->vctx->height;
-    v->duration = -1;
+    (*ctx)->pkt_timebase = stream->time_base;
 
-    // Video must have dimensions
-    if (v->dimensions.width == 0 || v->dimensions.height == 0)
+    if (avcodec_open2(*ctx, codec, opts) < 0)
         goto error;
 
-    // All good
-    return v;
+    return 1;
 
 error:
-    video_free(v);
-    return NULL;
+    avcodec_free_context(ctx);
+    return 0;
 }
 
-// Returns a new video pointer if this buffer was
-// successfully loaded, or NULL if it failed to load.
-video *video_from_buffer(void *buf, size_t len)
+static enum AVDiscard default_skip_frame(video *v)
 {
-    video *v = (video *) calloc(1, sizeof(video));
-    if (!v)
-        return NULL;
-
-    v->fd = -1;
-
-    return video_initialize(v, buf, len);
+    // Frames nothing else is predicted from can't change what analysis
+    // sees much, and are the cheapest to leave out
+    return v->vctx_mode == VIDEO_DECODE_ANALYSIS ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
 }
 
-// Returns a new video pointer if this file was
-// successfully loaded, or NULL if it failed to load.
-video *video_from_file(const char *filename)
+static int open_video_decoder_as(video *v, video_decode_mode mode)
 {
-    video *v = (video *) calloc(1, sizeof(video));
-    if (!v)
-        return NULL;
+    AVStream *stream = v->format->streams[v->vstream_idx];
+    AVDictionary *opts = NULL;
 
-    v->fd = open(filename, O_RDONLY);
-    if (v->fd < 0)
-        return NULL;
+    // Decoder options only apply when it is opened, so a decoder
+    // in the other mode is replaced, and decodes from the next seek
+    if (v->vctx && v->vctx_mode != mode) {
+        avcodec_free_context(&v->vctx);
+        v->iterating = 0;
+    }
 
-    struct stat len;
-    if (fstat(v->fd, &len) < 0)
-        goto error;
+    if (v->vctx)
+        return 1;
 
-    void *buf = mmap(NULL, len.st_size, PROT_READ, MAP_PRIVATE, v->fd, 0);
-    if (buf == MAP_FAILED)
-        goto error;
+    v->vctx_mode = mode;
 
-    return video_initialize(v, buf, len.st_size);
+    if (mode == VIDEO_DECODE_ANALYSIS) {
+        // Decode at the smallest power-of-two fraction of the size that
+        // the codec supports and that still leaves enough to analyze
+        int side = FFMIN(stream->codecpar->width, stream->codecpar->height);
+        int lowres = 0;
 
-error:
-    if (v->fd >= 0)
-        close(v->fd);
+        while (lowres < v->vcodec->max_lowres && (side >> (lowres + 1)) >= ANALYSIS_MIN_SIDE)
+            lowres++;
 
-    return NULL;
-}
+        av_dict_set_int(&opts, "lowres", lowres, 0);
+        av_dict_set(&opts, "skip_loop_filter", "all", 0);
+        av_dict_set(&opts, "flags2", "+fast", 0);
+    }
 
-// Invalidates and frees this video.
-void video_free(video *v)
-{
-    if (!v)
-        return;
+    if (v->explode)
+        av_dict_set(&opts, "err_detect", "+explode+crccheck", 0);
 
-    if (v->vctx)
-        avcodec_free_context(&v->vctx);
-    if (v->actx)
-        avcodec_free_context(&v->actx);
-    if (v->format)
-        avformat_close_input(&v->format);
-    if (v->avio->buffer)
-        av_freep(&v->avio->buffer);
-    if (v->avio)
-        av_freep(&v->avio);
-    if (v->frame)
-        av_frame_free(&v->frame);
-    if (v->pkt)
-        av_packet_free(&v->pkt);
+    int ret = open_decoder(&v->vctx, v->vcodec, stream, &opts);
 
-    if (v->fd > 0) {
-        munmap(v->buf, v->len);
-        close(v->fd);
+    av_dict_free(&opts);
 
-        v->buf = NULL;
-    }   
+    if (ret)
+        v->vctx->skip_frame = default_skip_frame(v);
 
-    if (v->buf)
-        free(v->buf);
+    return ret;
+}
 
-    free(v);
+static int open_video_decoder(video *v)
+{
+    // Anything but intensities, signatures and video_next_frame needs
+    // every frame exactly, whatever decode mode is set
+    return open_video_decoder_as(v, VIDEO_DECODE_FULL);
 }
 
-// Gets the dimensions of this video.
-dim_t video_dimensions(video *v)
+static int open_analysis_decoder(video *v)
 {
-    return v->dimensions;
+    return open_video_decoder_as(v, v->decode_mode);
 }
 
-// Gets the duration, in seconds, of this video.
-double video_duration(video *v)
+static void note_decode_error(video *v, int64_t pts)
 {
-    AVStream *vstream = v->format->streams[v->vstream_idx];
+    if (v->error_pts == AV_NOPTS_VALUE || (pts != AV_NOPTS_VALUE && pts < v->error_pts))
+        v->error_pts = pts != AV_NOPTS_VALUE ? pts : v->end_pts;
+}
 
-    if (v->duration > -1)
-        return v->duration;
+static int receive_video_frame(video *v, uint64_t *bytes_in)
+{
+    // Receives the next decoded frame into v->frame, feeding the decoder
+    // as many packets as it needs, and draining it once the demuxer runs
+    // dry. Returns 0 at end of stream.
+    while (1) {
+        int ret = avcodec_receive_frame(v->vctx, v->frame);
+        if (ret == 0) {
+            if (v->frame->decode_error_flags || (v->frame->flags & AV_FRAME_FLAG_CORRUPT))
+                note_decode_error(v, v->frame->best_effort_timestamp);
 
-    if (v->format->duration != AV_NOPTS_VALUE) {
-        // Format duration is in units of s/AV_TIME_BASE
-        v->duration = v->format->duration / (double) AV_TIME_BASE;
-        v->last_pts = v->duration * vstream->time_base.den / vstream->time_base.num;
-        return v->duration;
-    }
+            return 1;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            if (ret != AVERROR_EOF)
+                note_decode_error(v, v->sent_pts);
 
-    // No idea what the duration is, so we will have to decode the entire
-    // video in order to find it
-    av_seek_frame(v->format, -1, 0, AVSEEK_FLAG_BACKWARD);
-    v->last_pts = 0;
+            return 0;
+        }
 
-    while (1) {
-        // done reading
-        if (av_read_frame(v->format, v->pkt) < 0)
-            break;
+        if (av_read_frame(v->format, v->pkt) < 0) {
+            // Flush out the frames the decoder is still holding
+            avcodec_send_packet(v->vctx, NULL);
+            continue;
+        }
 
-        // Not good enough to just look at the packet pts, unfortunately,
-        // as libav does not seem to set it correctly in every case; we
-        // need to also pass the frame to the decoder to get the right pts.
+        // A packet the decoder rejects is just skipped
         if (v->pkt->stream_index == v->vstream_idx) {
-            if (avcodec_send_packet(v->vctx, v->pkt) != 0)
-                continue;
+            if (v->pkt->pts != AV_NOPTS_VALUE)
+                v->end_pts = FFMAX(v->end_pts, v->pkt->pts + v->pkt->duration);
 
-            if (avcodec_receive_frame(v->vctx, v->frame) == 0) {
-                v->last_pts = FFMAX(v->last_pts, v->frame->pts + v->pkt->duration);
-                av_frame_unref(v->frame);
-            }
+            v->sent_pts = v->pkt->pts;
+            *bytes_in += v->pkt->size;
+
+            if (avcodec_send_packet(v->vctx, v->pkt) < 0)
+                note_decode_error(v, v->pkt->pts);
+        } else if (v->audio_sink && v->pkt->stream_index == v->astream_idx) {
+            packet_list_push(v->audio_sink, v->pkt);
         }
 
         av_packet_unref(v->pkt);
     }
+}
 
-    // pts duration is in units of s/ts
-    v->duration = v->last_pts * vstream->time_base.num / (double) vstream->time_base.den;
+static int decode_video_frame(video *v)
+{
+    uint64_t bytes_in = 0;
 
-    // Reset the stream
-    av_seek_frame(v->format, -1, 0, AVSEEK_FLAG_BACKWARD);
+    trace_span span = trace_begin();
+    int ret = receive_video_frame(v, &bytes_in);
+    trace_end(TRACE_DECODE, &span, bytes_in, 0, ret);
 
-    if (v->duration > 0)
-        return v->duration;
-    else
-        return 0;
+    return ret;
 }
 
-static float sum_intensity(rect_sum_t sum, uint32_t npixels)
+static int seek_video_stream(video *v, int64_t pts)
 {
-    return ((sum.r / npixels) * 0.2126 +
-            (sum.g / npixels) * 0.7152 +
-            (sum.b / npixels) * 0.0772) / 3;
+    // Seek to the keyframe at or before pts, in stream time base
+    if (av_seek_frame(v->format, v->vstream_idx, pts, AVSEEK_FLAG_BACKWARD) < 0) {
+        if (v->ring)
+            errno = ESPIPE;
+
+        return 0;
+    }
+
+    if (v->vctx)
+        avcodec_flush_buffers(v->vctx);
+
+    return 1;
 }
 
-static rect_sum_t rect_sum(uint8_t *restrict opaque, uint32_t width, rect_t bounds)
+static int64_t stream_start(video *v)
 {
-    rgb_pix *restrict image = (rgb_pix *) opaque;
+    int64_t start = v->format->streams[v->vstream_idx]->start_time;
+    return start != AV_NOPTS_VALUE ? start : 0;
+}
 
-    // The sum of an empty region is defined to be zero.
-    rect_sum_t ret = { 0 };
+static void advise_access(video *v, int advice)
+{
+    // Only a mapped file has pages for the kernel to read ahead. Passes
+    // which demux every packet in order ask for aggressive readahead, and
+    // put it back to normal for the seeks of whatever comes next.
+    if (v->fd >= 0 && !v->ring)
+        madvise(v->buf, v->len, advice);
+}
 
-    for (uint32_t i = bounds.start_y; i < bounds.end_y; ++i) {
-      for (uint32_t j = bounds.start_x; j < bounds.end_x; ++j) {
-          rgb_pix p = image[i * width + j];
+static struct SwsContext *cached_sws(video *v, const AVFrame *f, int w, int h, enum AVPixelFormat fmt, int flags)
+{
+    // Reused across calls; only rebuilt when the conversion changes
+    if (v->vctx_mode == VIDEO_DECODE_ANALYSIS)
+        flags = SWS_FAST_BILINEAR;
 
-          ret.r += p.r;
-          ret.g += p.g;
-          ret.b += p.b;
-        }
-    }
+    v->sws = sws_getCachedContext(v->sws, f->width, f->height, f->format, w, h, fmt, flags, NULL, NULL, NULL);
+    return v->sws;
+}
 
-    return ret;
+typedef struct {
+    uint64_t hash;
+    double duration;
+    int64_t last_pts;
+    uint64_t frames;
+    int stream;
+    enum AVCodecID codec_id;
+    int width;
+    int height;
+    int pix_fmt;
+    AVRational time_base;
+    char format[INDEX_FORMAT_SIZE];
+    const uint8_t *entries;
+    size_t nkeys;
+} video_index;
+
+static uint64_t input_hash(const uint8_t *buf, size_t len)
+{
+    // FNV-1a over the length and both ends of the input. Enough to tell
+    // one stored file from another, without reading all of it.
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    size_t head = FFMIN(len, INDEX_HASH_SPAN);
+    size_t tail = FFMIN(len - head, INDEX_HASH_SPAN);
+
+    for (size_t i = 0; i < head; ++i)
+        h = (h ^ buf[i]) * 0x100000001b3ULL;
+    for (size_t i = len - tail; i < len; ++i)
+        h = (h ^ buf[i]) * 0x100000001b3ULL;
+
+    return h;
 }
 
-static void calculate_frame_intensities(video *v, intensity_t *i)
+static int parse_index(video *v, const uint8_t *blob, size_t len, video_index *idx)
 {
-    // Do colorspace conversion with swscale.
-    //
-    // This frame is unlikely to be in RGB24, so we take the hit and
-    // convert it unconditionally. This is just memcpy if the format is
-    // already RGB24.
-    //
-    struct SwsContext *ctx = NULL;
-    uint8_t *rgb = NULL;
-    AVFrame *f = v->frame;
-    uint32_t w = f->width;
-    uint32_t h = f->height;
+    // Only in-memory inputs can be hashed up front
+    if (!blob || v->ring || len < INDEX_HEADER_SIZE)
+        return 0;
 
-    ctx = sws_getContext(w, h, v->vctx->pix_fmt, w, h, AV_PIX_FMT_RGB24, SWS_BILINEAR, NULL, NULL, NULL);
+    if (AV_RL32(&blob[0]) != INDEX_MAGIC || AV_RL32(&blob[4]) != INDEX_VERSION)
+        return 0;
 
-    int32_t rgbstride = f->width * 3;
-    rgb = av_malloc(rgbstride * f->height);
+    if (AV_RL64(&blob[8]) != v->len || AV_RL64(&blob[16]) != input_hash(v->buf, v->len))
+        return 0;
 
-    if (!ctx || !rgb)
-        goto error;
+    idx->duration       = av_int2double(AV_RL64(&blob[24]));
+    idx->last_pts       = AV_RL64(&blob[32]);
+    idx->frames         = AV_RL64(&blob[40]);
+    idx->stream         = AV_RL32(&blob[48]);
+    idx->codec_id       = AV_RL32(&blob[52]);
+    idx->width          = AV_RL32(&blob[56]);
+    idx->height         = AV_RL32(&blob[60]);
+    idx->pix_fmt        = (int32_t) AV_RL32(&blob[64]);
+    idx->time_base.num  = AV_RL32(&blob[68]);
+    idx->time_base.den  = AV_RL32(&blob[72]);
+    idx->nkeys          = AV_RL64(&blob[120]);
+    idx->entries        = &blob[INDEX_HEADER_SIZE];
+
+    memcpy(idx->format, &blob[88], INDEX_FORMAT_SIZE);
+    idx->format[INDEX_FORMAT_SIZE - 1] = '\0';
+
+    // The blob came from outside, so nothing in it is trusted which
+    // would go on to reach the decoder unchecked
+    if (idx->time_base.num <= 0 || idx->time_base.den <= 0)
+        return 0;
 
-    sws_scale(ctx, (const uint8_t **) f->data, f->linesize, 0, h, &rgb, &rgbstride);
+    if (av_image_check_size(idx->width, idx->height, 0, NULL) < 0 || !av_pix_fmt_desc_get(idx->pix_fmt))
+        return 0;
 
-    rect_sum_t ins[] = {
-        rect_sum(rgb, w, (rect_t) { 0, 0, w/2, h/2 }), // nw
-        rect_sum(rgb, w, (rect_t) { w/2, 0, w, h/2 }), // ne
-        rect_sum(rgb, w, (rect_t) { 0, h/2, w/2, h }), // sw
-        rect_sum(rgb, w, (rect_t) { w/2, h/2, w, h }), // se
-        rect_sum(rgb, w, (rect_t) { 0, 0, w, h })      // avg
-    };
+    const AVCodecDescriptor *codec = avcodec_descriptor_get(idx->codec_id);
+    if (!codec || codec->type != AVMEDIA_TYPE_VIDEO)
+        return 0;
 
-    *i = (intensity_t) {
-        .nw  = sum_intensity(ins[0], w*h/4),
-        .ne  = sum_intensity(ins[1], w*h/4),
-        .sw  = sum_intensity(ins[2], w*h/4),
-        .se  = sum_intensity(ins[3], w*h/4),
-        .avg = sum_intensity(ins[4], w*h)
-    };
+    if (idx->stream < 0 || idx->frames > INT64_MAX || !isfinite(idx->duration) || idx->duration < 0)
+        return 0;
 
-error:
-    if (ctx)
-        sws_freeContext(ctx);
+    if (idx->nkeys > (len - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE)
+        return 0;
 
-    if (rgb)
-        av_free(rgb);
+    for (size_t i = 0; i < idx->nkeys; ++i) {
+        const uint8_t *e = &idx->entries[i * INDEX_ENTRY_SIZE];
+
+        if ((int64_t) AV_RL64(&e[0]) == AV_NOPTS_VALUE || AV_RL64(&e[8]) >= v->len)
+            return 0;
+    }
+
+    return 1;
 }
 
-// Gets corner intensities for the median time of this video.
-int video_get_intensities(video *v, intensity_t *i)
+static int apply_index_parameters(video *v, const video_index *idx)
 {
-    video_duration(v);
+    // Fills in what stream analysis would have found, as long as
+    // the container agrees with the index about the stream.
+    if (idx->stream < 0 || (unsigned int) idx->stream >= v->format->nb_streams)
+        return 0;
+
+    AVStream *stream = v->format->streams[idx->stream];
+    AVCodecParameters *par = stream->codecpar;
+
+    if (par->codec_type != AVMEDIA_TYPE_VIDEO || av_cmp_q(stream->time_base, idx->time_base) != 0)
+        return 0;
+
+    if (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != idx->codec_id)
+        return 0;
+
+    par->codec_id = idx->codec_id;
+
+    if (par->width <= 0 || par->height <= 0) {
+        par->width  = idx->width;
+        par->height = idx->height;
+    }
+
+    if (par->format < 0)
+        par->format = idx->pix_fmt;
+
+    if (stream->nb_frames <= 0)
+        stream->nb_frames = idx->frames;
+
+    return 1;
+}
+
+static void apply_index_keyframes(video *v, const video_index *idx)
+{
+    AVStream *stream = v->format->streams[v->vstream_idx];
+
+    for (size_t i = 0; i < idx->nkeys; ++i) {
+        const uint8_t *e = &idx->entries[i * INDEX_ENTRY_SIZE];
+        av_add_index_entry(stream, AV_RL64(&e[8]), AV_RL64(&e[0]), 0, 0, AVINDEX_KEYFRAME);
+    }
+
+    // video_duration never needs to go looking
+    v->duration = idx->duration;
+    v->last_pts = idx->last_pts;
+}
+
+static int open_input(video *v, AVInputFormat *iformat)
+{
+    // A user-supplied context is freed by a failed avformat_open_input
+    v->format = avformat_alloc_context();
+    if (!v->format)
+        return 0;
+
+    v->format->pb = v->avio;
+
+    if (v->opts.fast_open) {
+        v->format->probesize = FAST_PROBE_SIZE;
+        v->format->max_analyze_duration = FAST_ANALYZE_DURATION;
+    }
+
+    return avformat_open_input(&v->format, "", iformat, NULL) >= 0;
+}
+
+static video *video_initialize(video *v)
+{
+    int buf_size = v->opts.io_buffer_size ? FFMIN(v->opts.io_buffer_size, INT_MAX) : IO_BUFFER_SIZE;
+
+    video_index idx;
+    AVInputFormat *iformat = NULL;
+
+    // An index for this exact input names its demuxer and stream
+    // parameters, so neither needs to be probed for
+    int indexed = parse_index(v, v->opts.index, v->opts.index_len, &idx);
+    if (indexed && !(iformat = av_find_input_format(idx.format)))
+        indexed = 0;
+
+    // Only read while opening, and never handed on to borrowers
+    v->opts.index = NULL;
+    v->opts.index_len = 0;
+
+    v->avio_buf = av_malloc(buf_size);
+    if (!v->avio_buf)
+        goto error;
+
+    if (v->ring)
+        v->avio = avio_alloc_context(v->avio_buf, buf_size, 0, v, &read_fd_packet, NULL, &seek_fd);
+    else
+        v->avio = avio_alloc_context(v->avio_buf, buf_size, 0, v, &read_packet, NULL, &seek);
+
+    if (!v->avio)
+        goto error;
+
+    if (v->ring) {
+        // Demuxers must not go looking for indexes at the end of a stream
+        v->avio->seekable = 0;
+    } else {
+        // Data is already in memory, so reads (packet payloads) are
+        // copied straight to their destination instead of bouncing
+        // through avio_buf, and seeks never need to be buffered. That
+        // still copies: packets cannot point into the mapping.
+        v->avio->direct = 1;
+    }
+
+    if (!open_input(v, iformat)) {
+        if (!indexed)
+            goto error;
+
+        // The index matched, but its demuxer did not; probe as usual
+        indexed = 0;
+
+        if (avio_seek(v->avio, 0, SEEK_SET) < 0 || !open_input(v, NULL))
+            goto error;
+    }
+
+    if (indexed && !apply_index_parameters(v, &idx))
+        indexed = 0;
+
+    // Stream analysis decodes frames; only do it when the container
+    // header (and index) leave something out, or when we were not
+    // asked to be fast.
+    if ((!indexed && !v->opts.fast_open) || !codec_parameters_complete(v->format)) {
+        trace_span span = trace_begin();
+        int ret = avformat_find_stream_info(v->format, NULL);
+        trace_end(TRACE_PROBE, &span, avio_tell(v->format->pb), 0, 0);
+
+        if (ret < 0)
+            goto error;
+    }
+
+    // Bad video stream is an error
+    v->vstream_idx = av_find_best_stream(v->format, AVMEDIA_TYPE_VIDEO, -1, -1, &v->vcodec, 0);
+    if (v->vstream_idx < 0 || !valid_video_codec(v->vcodec->id))
+        goto error;
+
+    // Bad audio stream is not an error
+    v->astream_idx = av_find_best_stream(v->format, AVMEDIA_TYPE_AUDIO, -1, -1, &v->acodec, 0);
+    if (v->astream_idx < 0 || !valid_audio_codec(v->acodec->id)) {
+        v->astream_idx = -1;
+        v->acodec = NULL;
+    }
+
+    v->frame = av_frame_alloc();
+    v->pkt = av_packet_alloc();
+
+    if (!v->frame || !v->pkt)
+        goto error;
+
+    AVCodecParameters *par = v->format->streams[v->vstream_idx]->codecpar;
+
+    v->dimensions.width  = par->width;
+    v->dimensions.height = par->height;
+    v->duration = -1;
+    v->out_fmt = AV_PIX_FMT_RGB24;
+    v->sent_pts = AV_NOPTS_VALUE;
+    v->error_pts = AV_NOPTS_VALUE;
+
+    // Video must have dimensions
+    if (v->dimensions.width == 0 || v->dimensions.height == 0)
+        goto error;
+
+    if (indexed && v->vstream_idx == idx.stream)
+        apply_index_keyframes(v, &idx);
+
+    // All good
+    return v;
+
+error:
+    video_free(v);
+    return NULL;
+}
+
+// Returns a new video pointer if this buffer was
+// successfully loaded, or NULL if it failed to load.
+video *video_from_buffer(void *buf, size_t len)
+{
+    return video_from_buffer_ex(buf, len, NULL);
+}
+
+// Returns a new video pointer if this file was
+// successfully loaded, or NULL if it failed to load.
+video *video_from_file(const char *filename)
+{
+    return video_from_file_ex(filename, NULL);
+}
+
+// As video_from_buffer, with options. opts may be NULL.
+video *video_from_buffer_ex(void *buf, size_t len, const video_options *opts)
+{
+    if (!buf)
+        return NULL;
+
+    video *v = (video *) calloc(1, sizeof(video));
+    if (!v) {
+        free(buf);
+        return NULL;
+    }
+
+    v->fd  = -1;
+    v->buf = (uint8_t *) buf;
+    v->len = len;
+
+    if (opts)
+        v->opts = *opts;
+
+    return video_initialize(v);
+}
+
+// As video_from_file, with options. opts may be NULL.
+video *video_from_file_ex(const char *filename, const video_options *opts)
+{
+    video *v = (video *) calloc(1, sizeof(video));
+    if (!v)
+        return NULL;
+
+    v->fd = open(filename, O_RDONLY);
+    if (v->fd < 0)
+        goto error;
+
+    struct stat len;
+    if (fstat(v->fd, &len) < 0)
+        goto error;
+
+    void *buf = mmap(NULL, len.st_size, PROT_READ, MAP_PRIVATE, v->fd, 0);
+    if (buf == MAP_FAILED)
+        goto error;
+
+    v->buf = (uint8_t *) buf;
+    v->len = len.st_size;
+
+    if (opts)
+        v->opts = *opts;
+
+    return video_initialize(v);
+
+error:
+    if (v->fd >= 0)
+        close(v->fd);
+
+    free(v);
+    return NULL;
+}
+
+// Returns a new video pointer reading from this descriptor, which may
+// be a pipe or socket, or NULL if it failed to load.
+video *video_from_fd(int fd, const video_options *opts)
+{
+    video *v = (video *) calloc(1, sizeof(video));
+    if (!v)
+        return NULL;
+
+    if (opts)
+        v->opts = *opts;
+
+    v->fd        = fd;
+    v->ring_size = v->opts.stream_window ? v->opts.stream_window : STREAM_WINDOW;
+    v->ring      = (uint8_t *) malloc(v->ring_size);
+    if (!v->ring) {
+        free(v);
+        return NULL;
+    }
+
+    return video_initialize(v);
+}
+
+// Invalidates and frees this video.
+void video_free(video *v)
+{
+    if (!v)
+        return;
+
+    if (v->vctx)
+        avcodec_free_context(&v->vctx);
+    if (v->actx)
+        avcodec_free_context(&v->actx);
+    if (v->format)
+        avformat_close_input(&v->format);
+    if (v->avio) {
+        av_freep(&v->avio->buffer);
+        av_freep(&v->avio);
+    } else if (v->avio_buf) {
+        av_freep(&v->avio_buf);
+    }
+    if (v->frame)
+        av_frame_free(&v->frame);
+    if (v->pkt)
+        av_packet_free(&v->pkt);
+    if (v->sws)
+        sws_freeContext(v->sws);
+
+    // Frames still held by the caller keep the pool alive
+    av_buffer_pool_uninit(&v->frame_pool);
+
+    if (v->ring) {
+        // The descriptor belongs to the caller
+        free(v->ring);
+        free(v->key_intensities);
+        free(v->key_pts);
+    } else if (v->fd >= 0) {
+        munmap(v->buf, v->len);
+        close(v->fd);
+
+        v->buf = NULL;
+    }   
+
+    if (v->buf && !v->borrowed)
+        free(v->buf);
+
+    free(v);
+}
+
+// Gets the dimensions of this video.
+dim_t video_dimensions(video *v)
+{
+    return v->dimensions;
+}
+
+static void calculate_frame_intensities(video *v, AVFrame *f, intensity_t *i);
+
+static int scan_stream(video *v)
+{
+    // Single forward pass over a streamed input, decoding only keyframes.
+    // Records the intensities of each one along with the stream duration,
+    // so that a median keyframe can be picked without seeking back.
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+
+    if (v->scanned)
+        return v->nkeys > 0;
+
+    if (!open_analysis_decoder(v))
+        return 0;
+
+    int64_t start = stream_start(v);
+
+    // With the duration already known from the header, nothing
+    // past the median is needed
+    int64_t stop_pts = INT64_MAX;
+    if (v->duration > 0)
+        stop_pts = start + v->duration / av_q2d(vstream->time_base) / 2;
+
+    v->vctx->skip_frame = AVDISCARD_NONKEY;
+
+    size_t cap = 0;
+
+    while (decode_video_frame(v)) {
+        int64_t pts = v->frame->best_effort_timestamp;
+
+        if (pts == AV_NOPTS_VALUE) {
+            av_frame_unref(v->frame);
+            continue;
+        }
+
+        if (v->nkeys == cap) {
+            cap = FFMAX(cap * 2, 16);
+
+            intensity_t *ki = realloc(v->key_intensities, cap * sizeof(intensity_t));
+            if (ki)
+                v->key_intensities = ki;
+
+            int64_t *kp = realloc(v->key_pts, cap * sizeof(int64_t));
+            if (kp)
+                v->key_pts = kp;
+
+            if (!ki || !kp) {
+                av_frame_unref(v->frame);
+                break;
+            }
+        }
+
+        v->key_pts[v->nkeys] = pts;
+        calculate_frame_intensities(v, v->frame, &v->key_intensities[v->nkeys]);
+        v->nkeys++;
+
+        av_frame_unref(v->frame);
+
+        if (pts >= stop_pts)
+            break;
+    }
+
+    v->vctx->skip_frame = default_skip_frame(v);
+
+    v->scanned = 1;
+
+    if (v->duration < 0) {
+        v->last_pts = FFMAX(v->end_pts - start, 0);
+        v->duration = v->last_pts * av_q2d(vstream->time_base);
+    }
+
+    return v->nkeys > 0;
+}
+
+static int stream_intensities(video *v, intensity_t *i)
+{
+    // Duration from the header, or else from a full scan
+    video_duration(v);
+
+    if (!scan_stream(v) || v->duration <= 0)
+        return 0;
+
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    int64_t start = stream_start(v);
+    int64_t mid_pts = start + v->duration / av_q2d(vstream->time_base) / 2;
+
+    // Keyframe closest to the median time
+    size_t best = 0;
+
+    for (size_t k = 1; k < v->nkeys; ++k)
+        if (llabs(v->key_pts[k] - mid_pts) < llabs(v->key_pts[best] - mid_pts))
+            best = k;
+
+    *i = v->key_intensities[best];
+
+    return 1;
+}
+
+// Gets the duration, in seconds, of this video.
+double video_duration(video *v)
+{
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+
+    if (v->duration > -1)
+        return v->duration;
+
+    if (v->format->duration != AV_NOPTS_VALUE) {
+        // Format duration is in units of s/AV_TIME_BASE
+        v->duration = v->format->duration / (double) AV_TIME_BASE;
+        v->last_pts = v->duration * vstream->time_base.den / vstream->time_base.num;
+        return v->duration;
+    }
+
+    // No idea what the duration is, so we will have to decode the entire
+    // video in order to find it. A stream can only be read through once,
+    // so that pass has to collect everything else we need from it too.
+    if (v->ring)
+        return scan_stream(v) ? v->duration : 0;
+
+    if (!open_video_decoder(v))
+        return 0;
+
+    if (!seek_video_stream(v, stream_start(v)))
+        return 0;
+
+    v->last_pts = 0;
+
+    // Not good enough to just look at the packet pts, unfortunately,
+    // as libav does not seem to set it correctly in every case; we
+    // need to also pass the frame to the decoder to get the right pts.
+    while (decode_video_frame(v)) {
+        AVFrame *f = v->frame;
+
+        if (f->best_effort_timestamp != AV_NOPTS_VALUE)
+            v->last_pts = FFMAX(v->last_pts, f->best_effort_timestamp + FRAME_DURATION(f));
+
+        av_frame_unref(f);
+    }
+
+    // pts duration is in units of s/ts
+    v->duration = v->last_pts * vstream->time_base.num / (double) vstream->time_base.den;
+
+    // Reset the stream
+    seek_video_stream(v, stream_start(v));
+
+    if (v->duration > 0)
+        return v->duration;
+    else
+        return 0;
+}
+
+static float sum_intensity(rect_sum_t sum, uint32_t npixels)
+{
+    return ((sum.r / npixels) * 0.2126 +
+            (sum.g / npixels) * 0.7152 +
+            (sum.b / npixels) * 0.0772) / 3;
+}
+
+static void calculate_frame_intensities(video *v, AVFrame *f, intensity_t *i)
+{
+    // Do colorspace conversion with swscale.
+    //
+    // This frame is unlikely to be in RGB24, so we take the hit and
+    // convert it unconditionally. This is just memcpy if the format is
+    // already RGB24.
+    //
+    struct SwsContext *ctx = NULL;
+    uint8_t *rgb = NULL;
+    uint32_t w = f->width;
+    uint32_t h = f->height;
+
+    // Averages survive downscaling, so analysis only needs a few pixels
+    if (v->vctx_mode == VIDEO_DECODE_ANALYSIS && FFMAX(w, h) > ANALYSIS_SIZE) {
+        double ratio = ANALYSIS_SIZE / (double) FFMAX(w, h);
+
+        w = FFMAX(w * ratio, 2);
+        h = FFMAX(h * ratio, 2);
+    }
+
+    ctx = cached_sws(v, f, w, h, AV_PIX_FMT_RGB24, SWS_BILINEAR);
+
+    int32_t rgbstride = w * 3;
+    rgb = av_malloc(rgbstride * h);
+
+    if (!ctx || !rgb)
+        goto error;
+
+    sws_scale(ctx, (const uint8_t **) f->data, f->linesize, 0, f->height, &rgb, &rgbstride);
+
+    rect_sum_t ins[] = {
+        kernel_rect_sum(rgb, w, (rect_t) { 0, 0, w/2, h/2 }), // nw
+        kernel_rect_sum(rgb, w, (rect_t) { w/2, 0, w, h/2 }), // ne
+        kernel_rect_sum(rgb, w, (rect_t) { 0, h/2, w/2, h }), // sw
+        kernel_rect_sum(rgb, w, (rect_t) { w/2, h/2, w, h }), // se
+        kernel_rect_sum(rgb, w, (rect_t) { 0, 0, w, h })      // avg
+    };
+
+    *i = (intensity_t) {
+        .nw  = sum_intensity(ins[0], w*h/4),
+        .ne  = sum_intensity(ins[1], w*h/4),
+        .sw  = sum_intensity(ins[2], w*h/4),
+        .se  = sum_intensity(ins[3], w*h/4),
+        .avg = sum_intensity(ins[4], w*h)
+    };
+
+error:
+    if (rgb)
+        av_free(rgb);
+}
+
+// Gets corner intensities for the median time of this video.
+int video_get_intensities(video *v, intensity_t *i)
+{
+    if (v->ring)
+        return stream_intensities(v, i);
+
+    video_duration(v);
+
+    // no length?
+    if (v->duration <= 0)
+        return 0;
+
+    if (!open_analysis_decoder(v))
+        return 0;
+
+    int64_t mid_time = v->duration * AV_TIME_BASE / 2;
+    int64_t mid_pts  = v->last_pts / 2;
+
+    // the animation may have at minimum one keyframe, so go there
+    av_seek_frame(v->format, -1, mid_time, AVSEEK_FLAG_BACKWARD);
+    avcodec_flush_buffers(v->vctx);
+
+    int found = 0;
+
+    // now iterate until we find the frame we're looking for
+    while (!found && decode_video_frame(v)) {
+        AVFrame *f = v->frame;
+
+        if (f->best_effort_timestamp + FRAME_DURATION(f) >= mid_pts) {
+            calculate_frame_intensities(v, f, i);
+            found = 1;
+        }
+
+        av_frame_unref(f);
+    }
+
+    return found;
+}
+
+static enum AVPixelFormat quantum_pixel_format(int depth)
+{
+    // GraphicsMagick's PixelPacket, at each quantum depth
+    switch (depth) {
+    case 8:
+        return AV_PIX_FMT_BGRA;
+    case 16:
+        return AV_PIX_FMT_BGRA64;
+    default:
+        return AV_PIX_FMT_NONE;
+    }
+}
+
+static raster_image *frame_to_raster_image(video *v, const AVFrame *f, size_t max_w, size_t max_h)
+{
+    double ratio = FFMIN(max_w / (double) f->width, max_h / (double) f->height);
+
+    uint32_t new_w = FFMAX(f->width * ratio, 1);
+    uint32_t new_h = FFMAX(f->height * ratio, 1);
+
+    void *pixels;
+    size_t stride;
+    int depth;
+
+    raster_image *ri = raster_image_new_pixels(new_w, new_h, "JPEG", &pixels, &stride, &depth);
+    if (!ri)
+        return NULL;
+
+    enum AVPixelFormat fmt = quantum_pixel_format(depth);
+    if (fmt == AV_PIX_FMT_NONE)
+        goto error;
+
+    if (!cached_sws(v, f, new_w, new_h, fmt, SWS_BICUBIC))
+        goto error;
+
+    // Scale straight into the image's pixel cache
+    uint8_t *dst[] = { pixels };
+    int dst_stride[] = { stride };
+
+    sws_scale(v->sws, (const uint8_t **) f->data, f->linesize, 0, f->height, dst, dst_stride);
+
+    if (!raster_image_sync_pixels(ri))
+        goto error;
+
+    return ri;
+
+error:
+    raster_image_free(ri);
+    return NULL;
+}
+
+// Decodes the frame displayed at the given time, seeking to the
+// preceding keyframe, and scales it proportionally to fit within
+// max_w x max_h. Returns NULL if no frame could be decoded.
+raster_image *video_frame_at(video *v, double seconds, size_t max_w, size_t max_h)
+{
+    if (!open_video_decoder(v))
+        return NULL;
+
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+
+    int64_t target = stream_start(v) + seconds / av_q2d(vstream->time_base);
+
+    if (!seek_video_stream(v, target))
+        return NULL;
+
+    // The frame on screen at the target time is the last
+    // one whose pts is not past it.
+    AVFrame *shown = av_frame_alloc();
+    if (!shown)
+        return NULL;
+
+    while (decode_video_frame(v)) {
+        int64_t pts = v->frame->best_effort_timestamp;
+
+        if (pts != AV_NOPTS_VALUE && pts > target && shown->data[0]) {
+            av_frame_unref(v->frame);
+            break;
+        }
+
+        av_frame_unref(shown);
+        av_frame_move_ref(shown, v->frame);
+
+        if (pts == AV_NOPTS_VALUE || pts >= target)
+            break;
+    }
+
+    raster_image *ri = NULL;
+
+    if (shown->data[0])
+        ri = frame_to_raster_image(v, shown, max_w, max_h);
+
+    av_frame_free(&shown);
+
+    return ri;
+}
+
+// Gets corner intensities at n uniformly spaced times through this video,
+// along with scene change scores, in one forward pass.
+int video_get_signature(video *v, size_t n, int keyframes_only, intensity_t *points, float *scene)
+{
+    if (n == 0)
+        return 0;
+
+    double duration = video_duration(v);
+    if (duration <= 0)
+        return 0;
+
+    if (!open_analysis_decoder(v))
+        return 0;
+
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    int64_t start = stream_start(v);
+    size_t next = 0;
+
+    // The frame on screen until the one just decoded replaces it
+    AVFrame *shown = av_frame_alloc();
+    if (!shown)
+        return 0;
+
+    if (keyframes_only)
+        v->vctx->skip_frame = AVDISCARD_NONKEY;
+
+    if (!seek_video_stream(v, start))
+        goto done;
+
+    while (next < n && decode_video_frame(v)) {
+        AVFrame *f = v->frame;
+        int64_t pts = f->best_effort_timestamp;
+        double t = pts == AV_NOPTS_VALUE ? 0 : (pts - start) * av_q2d(vstream->time_base);
+
+        // Sample times before this frame see the one it replaces, or
+        // this one if nothing came before it
+        while (next < n && duration * (next + 0.5) / n < t) {
+            calculate_frame_intensities(v, shown->buf[0] ? shown : f, &points[next]);
+            next++;
+        }
+
+        av_frame_unref(shown);
+        av_frame_move_ref(shown, f);
+    }
+
+    // The last frame stays up through the end
+    while (next < n && shown->buf[0]) {
+        calculate_frame_intensities(v, shown, &points[next]);
+        next++;
+    }
+
+    for (size_t k = 0; k < next; ++k)
+        scene[k] = k > 0 ? intensity_distance(points[k], points[k - 1]) : 0;
+
+done:
+    v->vctx->skip_frame = default_skip_frame(v);
+    av_frame_free(&shown);
+
+    return next == n;
+}
+
+// Sets how this video decodes frames for the operations which follow.
+int video_set_decode_mode(video *v, video_decode_mode mode)
+{
+    if (mode != VIDEO_DECODE_FULL && mode != VIDEO_DECODE_ANALYSIS)
+        return 0;
+
+    if (mode == v->decode_mode)
+        return 1;
+
+    v->decode_mode = mode;
+
+    // The decoder is reopened in this mode by the next
+    // operation which uses it
+    v->iterating = 0;
+
+    return 1;
+}
+
+int video_set_frame_format(video *v, video_pix_fmt fmt, size_t width, size_t height)
+{
+    switch (fmt) {
+    case VIDEO_PIX_RGB24: v->out_fmt = AV_PIX_FMT_RGB24; break;
+    case VIDEO_PIX_RGBA:  v->out_fmt = AV_PIX_FMT_RGBA;  break;
+    case VIDEO_PIX_GRAY8: v->out_fmt = AV_PIX_FMT_GRAY8; break;
+    default:
+        return 0;
+    }
+
+    v->out_w = width && height ? width : 0;
+    v->out_h = width && height ? height : 0;
+
+    return 1;
+}
+
+static uint8_t *frame_pool_get(video *v, int size, AVBufferRef **ref)
+{
+    // All buffers in a pool have one size, so a new
+    // output size starts a new pool
+    if (!v->frame_pool || v->frame_pool_size != size) {
+        av_buffer_pool_uninit(&v->frame_pool);
+
+        v->frame_pool = av_buffer_pool_init(size, NULL);
+        v->frame_pool_size = size;
+
+        if (!v->frame_pool)
+            return NULL;
+    }
+
+    *ref = av_buffer_pool_get(v->frame_pool);
+
+    return *ref ? (*ref)->data : NULL;
+}
+
+// Decodes the next frame of this video into f, in display order.
+int video_next_frame(video *v, video_frame *f)
+{
+    if (!open_analysis_decoder(v))
+        return 0;
+
+    if (!v->iterating && !video_rewind(v))
+        return 0;
+
+    if (!decode_video_frame(v))
+        return 0;
+
+    AVFrame *src = v->frame;
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    AVBufferRef *ref = NULL;
+
+    int w = v->out_w ? v->out_w : src->width;
+    int h = v->out_h ? v->out_h : src->height;
+
+    int stride = FFALIGN(av_image_get_linesize(v->out_fmt, w, 0), 32);
+    if (stride <= 0 || h > INT_MAX / stride)
+        goto error;
+
+    uint8_t *data = frame_pool_get(v, stride * h, &ref);
+    if (!data)
+        goto error;
+
+    if (!cached_sws(v, src, w, h, v->out_fmt, SWS_BICUBIC))
+        goto error;
+
+    sws_scale(v->sws, (const uint8_t **) src->data, src->linesize, 0, src->height, &data, &stride);
+
+    int64_t pts = src->best_effort_timestamp;
+
+    *f = (video_frame) {
+        .data       = data,
+        .stride     = stride,
+        .dimensions = { w, h },
+        .time       = pts == AV_NOPTS_VALUE ? 0 : (pts - stream_start(v)) * av_q2d(vstream->time_base),
+        .keyframe   = FRAME_IS_KEY(src),
+        .ref        = ref
+    };
+
+    av_frame_unref(src);
+
+    return 1;
+
+error:
+    av_buffer_unref(&ref);
+    av_frame_unref(src);
+    return 0;
+}
+
+// Returns the buffer of a frame from video_next_frame to its pool.
+void video_frame_release(video_frame *f)
+{
+    AVBufferRef *ref = (AVBufferRef *) f->ref;
+
+    av_buffer_unref(&ref);
+
+    f->data = NULL;
+    f->ref  = NULL;
+}
+
+// Restarts video_next_frame at the start of the video.
+int video_rewind(video *v)
+{
+    v->iterating = 0;
+
+    if (!open_analysis_decoder(v))
+        return 0;
+
+    if (!seek_video_stream(v, stream_start(v)))
+        return 0;
+
+    v->iterating = 1;
+
+    return 1;
+}
+
+// Captures n frames at evenly spaced times in one pass over the stream,
+// scaling each to fit within cell_w x cell_h and tiling them cols per
+// row into a single image.
+raster_image *video_storyboard(video *v, size_t n, size_t cols, size_t cell_w, size_t cell_h, int keyframes_only, double *timestamps)
+{
+    if (n == 0 || cols == 0)
+        return NULL;
+
+    double duration = video_duration(v);
+    if (duration <= 0)
+        return NULL;
+
+    if (!open_video_decoder(v))
+        return NULL;
+
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    int64_t start = stream_start(v);
+
+    double ratio = FFMIN(cell_w / (double) v->dimensions.width, cell_h / (double) v->dimensions.height);
+
+    uint32_t cw   = FFMAX(v->dimensions.width * ratio, 1);
+    uint32_t ch   = FFMAX(v->dimensions.height * ratio, 1);
+    uint32_t rows = (n + cols - 1) / cols;
+
+    cols = FFMIN(cols, n);
+
+    void *pixels;
+    size_t stride;
+    int depth;
+
+    // The atlas and the frame being decoded are the only
+    // full images held at any point.
+    raster_image *ri = raster_image_new_pixels(cols * cw, rows * ch, "JPEG", &pixels, &stride, &depth);
+    if (!ri)
+        return NULL;
+
+    enum AVPixelFormat fmt = quantum_pixel_format(depth);
+    if (fmt == AV_PIX_FMT_NONE)
+        goto error;
+
+    // Empty cells stay black
+    memset(pixels, 0, stride * rows * ch);
+
+    size_t pixel_size = stride / (cols * cw);
+    size_t next = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        if (timestamps)
+            timestamps[i] = -1;
+
+    if (keyframes_only)
+        v->vctx->skip_frame = AVDISCARD_NONKEY;
+
+    if (!seek_video_stream(v, start))
+        goto error;
+
+    while (next < n && decode_video_frame(v)) {
+        AVFrame *f = v->frame;
+        int64_t pts = f->best_effort_timestamp;
+        double t = pts == AV_NOPTS_VALUE ? 0 : (pts - start) * av_q2d(vstream->time_base);
+
+        // One frame may be the first past several cell times
+        while (next < n && t >= duration * (next + 0.5) / n) {
+            if (!cached_sws(v, f, cw, ch, fmt, SWS_BICUBIC)) {
+                av_frame_unref(f);
+                goto error;
+            }
+
+            uint8_t *dst[] = { (uint8_t *) pixels + (next / cols) * ch * stride + (next % cols) * cw * pixel_size };
+            int dst_stride[] = { stride };
+
+            sws_scale(v->sws, (const uint8_t **) f->data, f->linesize, 0, f->height, dst, dst_stride);
+
+            if (timestamps)
+                timestamps[next] = t;
+
+            next++;
+        }
+
+        av_frame_unref(f);
+    }
+
+    v->vctx->skip_frame = default_skip_frame(v);
+
+    if (next == 0 || !raster_image_sync_pixels(ri))
+        goto error;
+
+    return ri;
+
+error:
+    v->vctx->skip_frame = default_skip_frame(v);
+    raster_image_free(ri);
+    return NULL;
+}
+
+static int name_in_list(const char *list, const char *name)
+{
+    // Whether name is one of the comma-separated names in list
+    size_t len = strlen(name);
+
+    for (const char *p = list; p; p = strchr(p, ',')) {
+        if (*p == ',')
+            p++;
+
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+    }
+
+    return 0;
+}
+
+static AVOutputFormat *container_format(const AVInputFormat *f)
+{
+    // Libav doesn't provide direct access to output container formats
+    // the way it does with e.g. codecs, so we have to look it up ourselves.
+    // Demuxers are named as a list of the formats they handle (like
+    // "matroska,webm"), so prefer the ones we produce.
+    //
+    // Note that the casting is due to API const breakage.
+
+    static const char *preferred[] = { "webm", "mp4", "gif", "apng" };
+
+    for (size_t i = 0; i < FF_ARRAY_ELEMS(preferred); ++i)
+        if (name_in_list(f->name, preferred[i]))
+            return (AVOutputFormat *) av_guess_format(preferred[i], NULL, NULL);
+
+    void *state = NULL;
+    AVOutputFormat *ret = (AVOutputFormat *) av_muxer_iterate(&state);
+
+    while (ret != NULL) {
+        if (name_in_list(f->name, ret->name))
+            return ret;
+
+        ret = (AVOutputFormat *) av_muxer_iterate(&state);
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    AVFormatContext *format;
+    AVIOContext *avio;
+
+    uint8_t *avio_buf;
+    uint8_t *buf;
+    size_t cap;    /// Allocated size of buf
+    size_t len;    /// Bytes written so far
+    int64_t pos;
+} video_output;
+
+static int write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    video_output *vo = (video_output *) opaque;
+
+    // Inc by minimum size needed to accomodate packet,
+    // then double the size
+    if (vo->pos + buf_size > vo->cap) {
+        size_t cap = (vo->pos + buf_size) * 2;
+        uint8_t *grown = (uint8_t *) realloc(vo->buf, cap);
+        if (!grown)
+            return AVERROR(ENOMEM);
+
+        vo->buf = grown;
+        vo->cap = cap;
+    }
+
+    memcpy(&vo->buf[vo->pos], buf, buf_size);
+
+    vo->pos += buf_size;
+    vo->len  = FFMAX(vo->len, vo->pos);
+
+    // Return how many bytes were written
+    return buf_size;
+}
+
+static int64_t seek_output(void *opaque, int64_t offset, int whence)
+{
+    video_output *vo = (video_output *) opaque;
+
+    // Muxers seek back to patch headers once sizes are known
+    switch (whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += vo->pos;
+        break;
+    case SEEK_END:
+        offset += vo->len;
+        break;
+    case AVSEEK_SIZE:
+        return vo->len;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    vo->pos = offset;
+    return vo->pos;
+}
+
+static void video_output_free(video_output *vo)
+{
+    if (!vo)
+        return;
+
+    if (vo->format)
+        avformat_free_context(vo->format);
+    if (vo->avio) {
+        av_freep(&vo->avio->buffer);
+        av_freep(&vo->avio);
+    } else if (vo->avio_buf) {
+        av_freep(&vo->avio_buf);
+    }
+    if (vo->buf)
+        free(vo->buf);
+
+    free(vo);
+}
+
+static video_output *video_output_new(AVOutputFormat *ctr)
+{
+    video_output *vo = (video_output *) calloc(1, sizeof(video_output));
+    if (!vo)
+        return NULL;
+
+    if (!ctr || avformat_alloc_output_context2(&vo->format, ctr, NULL, NULL) < 0)
+        goto error;
+
+    vo->avio_buf = av_malloc(IO_BUFFER_SIZE);
+    vo->avio     = avio_alloc_context(vo->avio_buf, IO_BUFFER_SIZE, 1, vo, NULL, &write_packet, &seek_output);
+    if (!vo->avio_buf || !vo->avio)
+        goto error;
+
+    vo->format->pb = vo->avio;
+
+    return vo;
+
+error:
+    video_output_free(vo);
+    return NULL;
+}
+
+static buf_t video_output_take(video_output *vo, int faststart)
+{
+    // Hands the written bytes over to the caller
+    avio_flush(vo->avio);
+
+    if (faststart && strcmp(vo->format->oformat->name, "mp4") == 0)
+        mp4_faststart(vo->buf, vo->len);
+
+    buf_t ret = { .buf = vo->buf, .len = vo->len };
+
+    vo->buf = NULL;
+    video_output_free(vo);
+
+    return ret;
+}
+
+static video *video_output_finish(video_output *vo, int faststart)
+{
+    // Hands the written bytes over to a new video
+    buf_t out = video_output_take(vo, faststart);
+
+    return video_from_buffer(out.buf, out.len);
+}
+
+static video *video_borrow(video *v)
+{
+    // A second, independent demuxer over the same bytes
+    video *b = (video *) calloc(1, sizeof(video));
+    if (!b)
+        return NULL;
+
+    b->fd       = -1;
+    b->buf      = v->buf;
+    b->len      = v->len;
+    b->borrowed = 1;
+    b->opts     = v->opts;
+
+    return video_initialize(b);
+}
+
+static AVCodecContext *open_encoder(video *v, AVFormatContext *out, uint32_t w, uint32_t h, int parallel)
+{
+    // Same codec as the input, in the input's pixel format
+    // when the encoder accepts it
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    AVCodecParameters *par = vstream->codecpar;
+
+    AVCodec *codec = avcodec_find_encoder(par->codec_id);
+    if (!codec)
+        return NULL;
+
+    AVCodecContext *enc = avcodec_alloc_context3(codec);
+    if (!enc)
+        return NULL;
+
+    enum AVPixelFormat fmt = v->vctx->pix_fmt;
+    if (codec->pix_fmts)
+        fmt = avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, fmt, 0, NULL);
+
+    enc->width               = w;
+    enc->height              = h;
+    enc->pix_fmt             = fmt;
+    enc->sample_aspect_ratio = par->sample_aspect_ratio;
+    enc->time_base           = vstream->time_base;
+    enc->framerate           = av_guess_frame_rate(v->format, vstream, NULL);
+
+    // Keep roughly the same bits per pixel
+    if (par->bit_rate > 0)
+        enc->bit_rate = par->bit_rate * ((double) w * h / (par->width * par->height));
+
+    if (parallel) {
+        // Segments are concatenated, so decode order must equal
+        // presentation order for timestamps to join up; threads
+        // come from running segments side by side instead.
+        enc->max_b_frames = 0;
+        enc->thread_count = 1;
+    }
+
+    if (out->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(enc, codec, NULL) < 0)
+        avcodec_free_context(&enc);
+
+    return enc;
+}
+
+typedef struct {
+    video *src;
+    AVCodecContext *enc;
+    int64_t start;   /// First pts belonging to this segment
+    int64_t end;     /// First pts belonging to the next segment
+    packet_list out; /// Encoded video packets, held until every segment is done
+    int ok;
+} segment;
+
+static int drain_encoder(segment *seg, AVFrame *f)
+{
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return 0;
+
+    int ret = avcodec_send_frame(seg->enc, f);
+
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(seg->enc, pkt);
+        if (ret < 0)
+            break;
+
+        if (!packet_list_push(&seg->out, pkt))
+            ret = AVERROR(ENOMEM);
+    }
+
+    av_packet_free(&pkt);
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+}
+
+static void *run_segment(void *opaque)
+{
+    // Decode, scale and encode every frame of one segment
+    segment *seg = (segment *) opaque;
+    video *v = seg->src;
+
+    AVFrame *out = av_frame_alloc();
+    if (!out)
+        return NULL;
+
+    out->format = seg->enc->pix_fmt;
+    out->width  = seg->enc->width;
+    out->height = seg->enc->height;
+
+    // Frames without a timestamp follow on from the one before,
+    // one frame interval later
+    int64_t step = FFMAX(av_rescale_q(1, av_inv_q(seg->enc->framerate), seg->enc->time_base), 1);
+    int64_t next = FFMAX(seg->start, stream_start(v));
+
+    if (av_frame_get_buffer(out, 0) < 0 || !seek_video_stream(v, next))
+        goto error;
+
+    while (decode_video_frame(v)) {
+        AVFrame *f = v->frame;
+        int64_t pts = f->best_effort_timestamp;
+
+        // Frames before the start belong to the previous segment
+        if (pts != AV_NOPTS_VALUE && pts < seg->start) {
+            av_frame_unref(f);
+            continue;
+        }
+
+        if (pts != AV_NOPTS_VALUE && pts >= seg->end) {
+            av_frame_unref(f);
+            break;
+        }
+
+        // The encoder may still hold on to the previous frame
+        if (av_frame_make_writable(out) < 0 || !cached_sws(v, f, out->width, out->height, out->format, SWS_LANCZOS)) {
+            av_frame_unref(f);
+            goto error;
+        }
+
+        sws_scale(v->sws, (const uint8_t **) f->data, f->linesize, 0, f->height, out->data, out->linesize);
+        out->pts = pts != AV_NOPTS_VALUE ? pts : next;
+        next = out->pts + step;
+
+        av_frame_unref(f);
+
+        if (!drain_encoder(seg, out))
+            goto error;
+    }
+
+    // Flush out delayed packets
+    seg->ok = drain_encoder(seg, NULL);
+
+error:
+    av_frame_free(&out);
+    return NULL;
+}
+
+static int find_keyframes(video *v, int64_t **keys, size_t *nkeys)
+{
+    // Demux-only pass for the pts of every video keyframe
+    size_t cap = 0;
+
+    *keys  = NULL;
+    *nkeys = 0;
+
+    if (!seek_video_stream(v, stream_start(v)))
+        return 0;
+
+    while (av_read_frame(v->format, v->pkt) >= 0) {
+        if (v->pkt->stream_index == v->vstream_idx && (v->pkt->flags & AV_PKT_FLAG_KEY) && v->pkt->pts != AV_NOPTS_VALUE) {
+            if (*nkeys == cap) {
+                cap = FFMAX(cap * 2, 64);
+
+                int64_t *grown = (int64_t *) realloc(*keys, cap * sizeof(int64_t));
+                if (!grown) {
+                    av_packet_unref(v->pkt);
+                    break;
+                }
+
+                *keys = grown;
+            }
+
+            (*keys)[(*nkeys)++] = v->pkt->pts;
+        }
+
+        av_packet_unref(v->pkt);
+    }
+
+    return *nkeys > 0;
+}
+
+// Segments run concurrently. On an engine worker, they are submitted
+// as jobs nested in the one running there, and so stay within its
+// thread budget; anywhere else, each gets a thread of its own.
+typedef struct {
+    void *(*fn)(void *);
+    void *arg;
+} fan_out_task;
+
+typedef struct {
+    job_engine *engine;
+    fan_out_task *tasks;
+    job **jobs;
+    pthread_t *threads;
+    size_t started;
+} fan_out;
+
+static void *run_task(void *opaque, int threads)
+{
+    fan_out_task *t = (fan_out_task *) opaque;
+
+    (void) threads;
+
+    return t->fn(t->arg);
+}
+
+// Starts fn on each of the n items of size bytes at items. Returns 0
+// if any could not be started; those which were must still be joined.
+static int fan_out_start(fan_out *f, void *(*fn)(void *), void *items, size_t size, size_t n)
+{
+    *f = (fan_out) { .engine = job_current_engine() };
+
+    if (f->engine) {
+        f->tasks = (fan_out_task *) calloc(n, sizeof(fan_out_task));
+        f->jobs  = (job **) calloc(n, sizeof(job *));
+
+        if (!f->tasks || !f->jobs)
+            return 0;
+    } else {
+        f->threads = (pthread_t *) calloc(n, sizeof(pthread_t));
+
+        if (!f->threads)
+            return 0;
+    }
+
+    for (; f->started < n; ++f->started) {
+        void *item = (uint8_t *) items + f->started * size;
+
+        if (!f->engine) {
+            if (pthread_create(&f->threads[f->started], NULL, fn, item) != 0)
+                return 0;
+
+            continue;
+        }
+
+        f->tasks[f->started] = (fan_out_task) { .fn = fn, .arg = item };
+
+        job_request req = { .kind = JOB_CUSTOM, .fn = &run_task, .arg = &f->tasks[f->started], .threads = 1 };
+
+        f->jobs[f->started] = job_submit(f->engine, &req);
+        if (!f->jobs[f->started])
+            return 0;
+    }
+
+    return 1;
+}
+
+// Waits for everything fan_out_start started.
+static void fan_out_join(fan_out *f)
+{
+    for (size_t i = 0; i < f->started; ++i) {
+        if (f->engine) {
+            job_wait(f->jobs[i], NULL);
+            job_free(f->jobs[i]);
+        } else {
+            pthread_join(f->threads[i], NULL);
+        }
+    }
+
+    free(f->tasks);
+    free(f->jobs);
+    free(f->threads);
+}
+
+typedef struct {
+    video *src;
+    size_t index;        /// Position of this segment in the video
+    int64_t start;       /// First pts belonging to this segment
+    int64_t end;         /// First pts belonging to the next segment
+    int stop_early;
+    atomic_size_t *bad;  /// Lowest index of a segment with an error
+    size_t frames;
+    int64_t end_pts;     /// End of the last frame decoded, or INT64_MIN
+    int64_t error_pts;
+} check_segment;
+
+static void *run_check_segment(void *opaque)
+{
+    // Decode every frame of one segment, without concealing errors
+    check_segment *seg = (check_segment *) opaque;
+    video *v = seg->src;
+
+    seg->end_pts   = INT64_MIN;
+    seg->error_pts = AV_NOPTS_VALUE;
+
+    v->error_pts = AV_NOPTS_VALUE;
+
+    if (!seek_video_stream(v, FFMAX(seg->start, stream_start(v)))) {
+        v->error_pts = FFMAX(seg->start, stream_start(v));
+        goto done;
+    }
+
+    // Once an earlier segment has failed, nothing here can be first
+    while (!(seg->stop_early && atomic_load(seg->bad) < seg->index) && decode_video_frame(v)) {
+        AVFrame *f = v->frame;
+        int64_t pts = f->best_effort_timestamp;
+
+        if (pts != AV_NOPTS_VALUE && pts < seg->start) {
+            av_frame_unref(f);
+            continue;
+        }
+
+        if (pts != AV_NOPTS_VALUE && pts >= seg->end) {
+            av_frame_unref(f);
+            break;
+        }
+
+        seg->frames++;
+
+        if (pts != AV_NOPTS_VALUE)
+            seg->end_pts = FFMAX(seg->end_pts, pts + FRAME_DURATION(f));
+
+        av_frame_unref(f);
+
+        if (seg->stop_early && v->error_pts != AV_NOPTS_VALUE && v->error_pts < seg->end)
+            break;
+    }
+
+done:
+    // Errors past the end are the next segment's to report
+    if (v->error_pts != AV_NOPTS_VALUE && v->error_pts < seg->end) {
+        seg->error_pts = v->error_pts;
+
+        size_t bad = atomic_load(seg->bad);
+        while (seg->index < bad && !atomic_compare_exchange_weak(seg->bad, &bad, seg->index))
+            ;
+    }
+
+    return NULL;
+}
+
+static int collect_audio(video *v, packet_list *audio)
+{
+    if (v->astream_idx < 0)
+        return 1;
+
+    if (!seek_video_stream(v, stream_start(v)))
+        return 0;
+
+    while (av_read_frame(v->format, v->pkt) >= 0) {
+        if (v->pkt->stream_index == v->astream_idx && !packet_list_push(audio, v->pkt))
+            return 0;
+
+        av_packet_unref(v->pkt);
+    }
+
+    return 1;
+}
+
+static int add_output_streams(video *v, video_output *vo, AVCodecContext *enc)
+{
+    // The video stream, either from the encoder or copied from the
+    // input, followed by the audio stream if it is one we keep.
+    // Anything else in the input is dropped.
+    AVStream *vistream = v->format->streams[v->vstream_idx];
+    AVStream *vostream = avformat_new_stream(vo->format, NULL);
+    if (!vostream)
+        return 0;
+
+    if (enc) {
+        if (avcodec_parameters_from_context(vostream->codecpar, enc) < 0)
+            return 0;
+
+        vostream->time_base = enc->time_base;
+    } else {
+        if (avcodec_parameters_copy(vostream->codecpar, vistream->codecpar) < 0)
+            return 0;
+
+        vostream->codecpar->codec_tag = 0;
+        vostream->time_base = vistream->time_base;
+    }
+
+    if (v->astream_idx > -1) {
+        AVStream *aistream = v->format->streams[v->astream_idx];
+        AVStream *aostream = avformat_new_stream(vo->format, NULL);
+        if (!aostream)
+            return 0;
+
+        if (avcodec_parameters_copy(aostream->codecpar, aistream->codecpar) < 0)
+            return 0;
+
+        aostream->codecpar->codec_tag = 0;
+        aostream->time_base = aistream->time_base;
+    }
+
+    return 1;
+}
+
+static video *remux(video *v, video_output *vo, int faststart)
+{
+    // Stream copy: every kept packet goes out as it came in
+    if (!vo)
+        return NULL;
+
+    if (!add_output_streams(v, vo, NULL))
+        goto error;
+
+    if (avformat_write_header(vo->format, NULL) < 0)
+        goto error;
+
+    if (!seek_video_stream(v, stream_start(v)))
+        goto error;
+
+    advise_access(v, MADV_SEQUENTIAL);
+
+    while (av_read_frame(v->format, v->pkt) >= 0) {
+        int idx = v->pkt->stream_index;
+        int out = idx == v->vstream_idx ? 0 : idx == v->astream_idx ? 1 : -1;
+
+        if (out < 0) {
+            av_packet_unref(v->pkt);
+            continue;
+        }
+
+        av_packet_rescale_ts(v->pkt, v->format->streams[idx]->time_base, vo->format->streams[out]->time_base);
+        v->pkt->stream_index = out;
+        v->pkt->pos = -1;
+
+        // Takes over the packet reference
+        if (av_interleaved_write_frame(vo->format, v->pkt) < 0)
+            goto error;
+    }
+
+    advise_access(v, MADV_NORMAL);
+
+    if (av_write_trailer(vo->format) < 0)
+        goto error;
+
+    return video_output_finish(vo, faststart);
+
+error:
+    advise_access(v, MADV_NORMAL);
+    video_output_free(vo);
+    return NULL;
+}
+
+static int mux_packets(video *v, video_output *vo, AVCodecContext *enc, segment *segs, size_t nsegs, packet_list *audio)
+{
+    // Joins the segments' video packets in order, interleaved by
+    // timestamp with the untouched audio packets
+    AVStream *vostream = vo->format->streams[0];
+    AVStream *aistream = v->astream_idx > -1 ? v->format->streams[v->astream_idx] : NULL;
+    AVStream *aostream = aistream ? vo->format->streams[1] : NULL;
+
+    size_t s = 0, p = 0, a = 0;
+
+    while (1) {
+        while (s < nsegs && p == segs[s].out.n) {
+            s++;
+            p = 0;
+        }
+
+        AVPacket *vpkt = s < nsegs ? segs[s].out.pkts[p] : NULL;
+        AVPacket *apkt = a < audio->n ? audio->pkts[a] : NULL;
+
+        if (!vpkt && !apkt)
+            return 1;
+
+        int take_audio = apkt && (!vpkt ||
+            av_compare_ts(apkt->dts, aistream->time_base, vpkt->dts, enc->time_base) < 0);
+
+        AVPacket *pkt;
+
+        if (take_audio) {
+            pkt = apkt;
+            av_packet_rescale_ts(pkt, aistream->time_base, aostream->time_base);
+            pkt->stream_index = aostream->index;
+            pkt->pos = -1;
+            a++;
+        } else {
+            pkt = vpkt;
+            av_packet_rescale_ts(pkt, enc->time_base, vostream->time_base);
+            pkt->stream_index = vostream->index;
+            p++;
+        }
+
+        if (av_interleaved_write_frame(vo->format, pkt) < 0)
+            return 0;
+    }
+}
+
+// Scale this video proportionally to either a height of max_h,
+// or a width of max_w, whichever is lesser.
+video *video_scale(video *v, size_t max_w, size_t max_h)
+{
+    video_scale_options opts = { .faststart = 1 };
+
+    return video_scale_ex(v, max_w, max_h, &opts, NULL);
+}
+
+// As video_scale, splitting the video into up to workers segments
+// on keyframe boundaries which are transcoded concurrently.
+video *video_scale_parallel(video *v, size_t max_w, size_t max_h, int workers)
+{
+    video_scale_options opts = { .workers = workers, .faststart = 1 };
+
+    return video_scale_ex(v, max_w, max_h, &opts, NULL);
+}
+
+// As video_scale, with options. opts may be NULL.
+video *video_scale_ex(video *v, size_t max_w, size_t max_h, const video_scale_options *opts, video_scale_path *path)
+{
+    // When scaling a video we would like to use the same
+    // - container
+    // - video codec and pixel format
+    // - audio codec and frames
+
+    video_scale_options o = opts ? *opts : (video_scale_options) { 0 };
+    int workers = o.workers;
+
+    video_output *vo = NULL;
+    segment *segs = NULL;
+    size_t nsegs = 0;
+    int64_t *keys = NULL;
+    size_t nkeys = 0;
+    packet_list audio = { 0 };
+
+    if (path)
+        *path = VIDEO_SCALE_FAILED;
+
+    // Codecs are always ones we accept, so a video that already
+    // fits only needs its packets copied to a new container.
+    if (!o.force_transcode && v->dimensions.width <= max_w && v->dimensions.height <= max_h) {
+        video *ret = remux(v, video_output_new(container_format(v->format->iformat)), o.faststart);
+
+        if (ret && path)
+            *path = VIDEO_SCALE_REMUXED;
+
+        return ret;
+    }
+
+    if (!open_video_decoder(v))
+        return NULL;
+
+    // Same container
+    vo = video_output_new(container_format(v->format->iformat));
+    if (!vo)
+        goto error;
+
+    uint32_t old_w = v->dimensions.width;
+    uint32_t old_h = v->dimensions.height;
+
+    double ratio = FFMIN(max_w / (double) old_w, max_h / (double) old_h);
+
+    // Most pixel formats subsample chroma, so keep dimensions even
+    uint32_t new_w = FFMAX((uint32_t) (old_w * ratio) & ~1, 2);
+    uint32_t new_h = FFMAX((uint32_t) (old_h * ratio) & ~1, 2);
+
+    // A streamed input can only be read through once
+    if (v->ring)
+        workers = 1;
+
+    if (workers > 1 && !find_keyframes(v, &keys, &nkeys))
+        goto error;
+
+    nsegs = FFMAX(FFMIN((size_t) FFMAX(workers, 1), nkeys), 1);
+    segs  = (segment *) calloc(nsegs, sizeof(segment));
+    if (!segs)
+        goto error;
+
+    for (size_t i = 0; i < nsegs; ++i) {
+        segment *seg = &segs[i];
+
+        // Split on keyframes, with about as many in each segment
+        seg->start = i == 0 ? INT64_MIN : keys[i * nkeys / nsegs];
+        seg->end   = i == nsegs - 1 ? INT64_MAX : keys[(i + 1) * nkeys / nsegs];
+
+        // The only segment just reads the input itself
+        seg->src = nsegs == 1 ? v : video_borrow(v);
+        if (!seg->src || !open_video_decoder(seg->src))
+            goto error;
+
+        seg->enc = open_encoder(v, vo->format, new_w, new_h, nsegs > 1);
+        if (!seg->enc)
+            goto error;
+    }
+
+    int audio_ok = 1;
+
+    if (nsegs == 1) {
+        // Audio is kept as it goes by, so the input is read only once
+        v->audio_sink = &audio;
+        run_segment(&segs[0]);
+        v->audio_sink = NULL;
+    } else {
+        fan_out f;
+        int started = fan_out_start(&f, &run_segment, segs, sizeof(segment), nsegs);
+
+        // Audio is read on this thread while the segments run
+        audio_ok = started && collect_audio(v, &audio);
+
+        fan_out_join(&f);
+
+        if (!started)
+            goto error;
+    }
+
+    if (!audio_ok)
+        goto error;
+
+    for (size_t i = 0; i < nsegs; ++i)
+        if (!segs[i].ok)
+            goto error;
+
+    // Every segment's encoder is configured alike, so their global
+    // headers must be too; the output stream carries only the first's
+    for (size_t i = 1; i < nsegs; ++i) {
+        if (segs[i].enc->extradata_size != segs[0].enc->extradata_size ||
+            (segs[0].enc->extradata_size > 0 &&
+             memcmp(segs[i].enc->extradata, segs[0].enc->extradata, segs[0].enc->extradata_size) != 0))
+            goto error;
+    }
+
+    // Same video codec, scaled, and (optional) same audio codec
+    if (!add_output_streams(v, vo, segs[0].enc))
+        goto error;
+
+    if (avformat_write_header(vo->format, NULL) < 0)
+        goto error;
+
+    if (!mux_packets(v, vo, segs[0].enc, segs, nsegs, &audio))
+        goto error;
+
+    if (av_write_trailer(vo->format) < 0)
+        goto error;
+
+    video *ret = video_output_finish(vo, o.faststart);
+    vo = NULL;
+
+    if (ret && path)
+        *path = VIDEO_SCALE_TRANSCODED;
+
+    for (size_t i = 0; i < nsegs; ++i) {
+        if (segs[i].src != v)
+            video_free(segs[i].src);
+        avcodec_free_context(&segs[i].enc);
+        packet_list_free(&segs[i].out);
+    }
+
+    free(segs);
+    free(keys);
+    packet_list_free(&audio);
+
+    return ret;
+
+error:
+    for (size_t i = 0; segs && i < nsegs; ++i) {
+        if (segs[i].src != v)
+            video_free(segs[i].src);
+        if (segs[i].enc)
+            avcodec_free_context(&segs[i].enc);
+        packet_list_free(&segs[i].out);
+    }
+
+    free(segs);
+    free(keys);
+    packet_list_free(&audio);
+    video_output_free(vo);
+    return NULL;
+}
+
+typedef struct {
+    video_output *vo;
+    AVCodecContext *enc;
+    AVFrame *frame;          /// Encoder input, in its pixel format
+    AVPacket *pkt;
+    AVPacket *pending;       /// Held back until its duration is known
+    struct SwsContext *sws;
+    int64_t last_duration;
+} animation_encoder;
 
-    // no length?
-    if (v->duration <= 0)
-        return 0;
+static void animation_encoder_free(animation_encoder *ae)
+{
+    if (!ae)
+        return;
 
-    int64_t mid_time = v->duration * AV_TIME_BASE / 2;
-    int64_t mid_pts  = v->last_pts / 2;
+    if (ae->sws)
+        sws_freeContext(ae->sws);
+    if (ae->frame)
+        av_frame_free(&ae->frame);
+    if (ae->pkt)
+        av_packet_free(&ae->pkt);
+    if (ae->pending)
+        av_packet_free(&ae->pending);
+    if (ae->enc)
+        avcodec_free_context(&ae->enc);
+
+    video_output_free(ae->vo);
+    free(ae);
+}
 
-    // the animation may have at minimum one keyframe, so go there
-    av_seek_frame(v->format, -1, mid_time, AVSEEK_FLAG_BACKWARD);
+static animation_encoder *animation_encoder_new(file_type container, uint32_t w, uint32_t h, AVRational time_base)
+{
+    // VP9 (or VP8) in WebM, H.264 in MP4
+    const char *muxer = NULL;
+    AVCodec *codec = NULL;
+
+    switch (container) {
+    case VIDEO_WEBM:
+        muxer = "webm";
+        codec = avcodec_find_encoder(AV_CODEC_ID_VP9);
+        if (!codec)
+            codec = avcodec_find_encoder(AV_CODEC_ID_VP8);
+        break;
+
+    case VIDEO_MP4:
+        muxer = "mp4";
+        codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+        break;
 
-    int found = 0;
+    default:
+        return NULL;
+    }
 
-    // now iterate until we find the frame we're looking for
-    while (!found) {
-        // done reading
-        if (av_read_frame(v->format, v->pkt) < 0)
+    if (!codec)
+        return NULL;
+
+    animation_encoder *ae = (animation_encoder *) calloc(1, sizeof(animation_encoder));
+    if (!ae)
+        return NULL;
+
+    ae->vo      = video_output_new((AVOutputFormat *) av_guess_format(muxer, NULL, NULL));
+    ae->enc     = avcodec_alloc_context3(codec);
+    ae->frame   = av_frame_alloc();
+    ae->pkt     = av_packet_alloc();
+    ae->pending = av_packet_alloc();
+
+    if (!ae->vo || !ae->enc || !ae->frame || !ae->pkt || !ae->pending)
+        goto error;
+
+    AVCodecContext *enc = ae->enc;
+
+    enc->width     = w;
+    enc->height    = h;
+    enc->time_base = time_base;
+    enc->pix_fmt   = AV_PIX_FMT_YUV420P;
+
+    if (codec->pix_fmts)
+        enc->pix_fmt = avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, AV_PIX_FMT_YUV420P, 0, NULL);
+
+    // Frame timing is variable, so keep packets in presentation order
+    enc->max_b_frames = 0;
+
+    // libvpx defaults to a fixed, low bitrate; ask for constant quality
+    if (codec->id == AV_CODEC_ID_VP9 || codec->id == AV_CODEC_ID_VP8) {
+        enc->bit_rate = 0;
+        av_opt_set(enc, "crf", "32", AV_OPT_SEARCH_CHILDREN);
+    }
+
+    if (ae->vo->format->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(enc, codec, NULL) < 0)
+        goto error;
+
+    ae->frame->format = enc->pix_fmt;
+    ae->frame->width  = w;
+    ae->frame->height = h;
+
+    if (av_frame_get_buffer(ae->frame, 0) < 0)
+        goto error;
+
+    AVStream *st = avformat_new_stream(ae->vo->format, NULL);
+    if (!st)
+        goto error;
+
+    if (avcodec_parameters_from_context(st->codecpar, enc) < 0)
+        goto error;
+
+    st->time_base = enc->time_base;
+
+    if (avformat_write_header(ae->vo->format, NULL) < 0)
+        goto error;
+
+    return ae;
+
+error:
+    animation_encoder_free(ae);
+    return NULL;
+}
+
+static int animation_encoder_drain(animation_encoder *ae, AVFrame *f)
+{
+    // Each packet is written once the next one shows up, so that the
+    // last can be given the duration of the last frame.
+    AVStream *st = ae->vo->format->streams[0];
+    int ret = avcodec_send_frame(ae->enc, f);
+
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(ae->enc, ae->pkt);
+        if (ret < 0)
             break;
 
-        if (v->pkt->stream_index == v->vstream_idx) {
-            if (avcodec_send_packet(v->vctx, v->pkt) == 0 && avcodec_receive_frame(v->vctx, v->frame) == 0) {
-                if (v->frame->pts + v->pkt->duration >= mid_pts) {
-                    calculate_frame_intensities(v, i);
-                    found = 1;
-                }
+        if (ae->pending->data) {
+            av_packet_rescale_ts(ae->pending, ae->enc->time_base, st->time_base);
 
-                av_frame_unref(v->frame);
-            }
+            if (av_interleaved_write_frame(ae->vo->format, ae->pending) < 0)
+                return 0;
         }
 
-        av_packet_unref(v->pkt);
+        av_packet_move_ref(ae->pending, ae->pkt);
     }
 
-    return found;
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
 }
 
-static AVOutputFormat *container_format(const AVInputFormat *f)
+static int animation_encoder_write(animation_encoder *ae, const uint8_t *const data[], const int linesize[],
+                                   enum AVPixelFormat fmt, int w, int h, int64_t pts, int64_t duration)
 {
-    // Libav doesn't provide direct access to output container formats
-    // the way it does with e.g. codecs, so we have to look it up ourselves.
-    //
-    // Note that the casting is due to API const breakage.
+    // Scales one frame to the output size and encodes it. pts and
+    // duration are in the encoder time base.
+    AVFrame *out = ae->frame;
 
-    void *state;
-    AVOutputFormat *ret = (AVOutputFormat *) av_muxer_iterate(&state);
+    ae->sws = sws_getCachedContext(ae->sws, w, h, fmt, out->width, out->height, out->format, SWS_BICUBIC, NULL, NULL, NULL);
+    if (!ae->sws)
+        return 0;
 
-    while (ret != NULL) {
-        if (strcmp(f->name, ret->name) == 0)
-            return ret;
+    // The encoder may still hold on to the previous frame
+    if (av_frame_make_writable(out) < 0)
+        return 0;
 
-        ret = (AVOutputFormat *) av_muxer_iterate(&state);
-    }
+    sws_scale(ae->sws, data, linesize, 0, h, out->data, out->linesize);
 
-    return NULL;
+    out->pts = pts;
+    ae->last_duration = duration;
+
+    return animation_encoder_drain(ae, out);
 }
 
-typedef struct {
-    AVFormatContext *format;
-    AVCodecContext *vcodec;
-    AVIOContext *avio;
-    AVPacket *pkt;
-    AVFrame *frame;
-    struct SwsContext *sws;
+static buf_t animation_encoder_finish(animation_encoder *ae, int faststart)
+{
+    buf_t ret = { 0 };
 
-    uint8_t *avio_buf;
-    uint8_t *buf;
-    size_t len;
-    int64_t pos;
-} video_output;
+    if (!animation_encoder_drain(ae, NULL))
+        goto done;
 
-static int write_packet(void *opaque, uint8_t *buf, int buf_size)
+    if (ae->pending->data) {
+        AVStream *st = ae->vo->format->streams[0];
+
+        ae->pending->duration = ae->last_duration;
+        av_packet_rescale_ts(ae->pending, ae->enc->time_base, st->time_base);
+
+        if (av_interleaved_write_frame(ae->vo->format, ae->pending) < 0)
+            goto done;
+    }
+
+    if (av_write_trailer(ae->vo->format) < 0)
+        goto done;
+
+    ret = video_output_take(ae->vo, faststart);
+    ae->vo = NULL;
+
+done:
+    animation_encoder_free(ae);
+    return ret;
+}
+
+// Encodes the frames of this raster_image (typically an animated GIF)
+// as a WebM or MP4 video, per container (VIDEO_WEBM or VIDEO_MP4).
+video *video_from_raster_image(raster_image *ri, file_type container)
 {
-    video_output *vo = (video_output *) opaque;
+    dim_t dim = raster_image_dimensions(ri);
 
-    // Inc by minimum size needed to accomodate packet,
-    // then double the size
-    if (vo->pos + buf_size > vo->len) {
-        vo->len += vo->pos + buf_size - vo->len;
-        vo->len *= 2;
-        vo->buf = (uint8_t *) realloc(vo->buf, vo->len);
+    // Chroma is subsampled, so the output must have even dimensions
+    uint32_t w = FFMAX(dim.width & ~1, 2);
+    uint32_t h = FFMAX(dim.height & ~1, 2);
+
+    // GIF delays are in centiseconds
+    animation_encoder *ae = animation_encoder_new(container, w, h, (AVRational) { 1, 100 });
+    if (!ae)
+        return NULL;
+
+    // Frames are composed and encoded one at a time, so only the
+    // canvas is ever held decoded in addition to the source.
+    raster_frame_iter *it = raster_frame_iter_new(ri);
+    if (!it)
+        goto error;
+
+    const void *pixels;
+    size_t stride;
+    int depth, delay;
+    int64_t pts = 0;
+
+    while ((pixels = raster_frame_iter_next(it, &stride, &depth, &delay))) {
+        // Browsers play very short delays at 10cs, so do the same
+        if (delay < 2)
+            delay = 10;
+
+        const uint8_t *data[] = { pixels };
+        int linesize[] = { stride };
+
+        enum AVPixelFormat fmt = quantum_pixel_format(depth);
+        if (fmt == AV_PIX_FMT_NONE)
+            goto error;
+
+        if (!animation_encoder_write(ae, data, linesize, fmt, dim.width, dim.height, pts, delay))
+            goto error;
+
+        pts += delay;
     }
 
-    memcpy(&vo->buf[vo->pos], buf, buf_size);
+    raster_frame_iter_free(it);
 
-    vo->pos += buf_size;
+    if (pts == 0) {
+        animation_encoder_free(ae);
+        return NULL;
+    }
 
-    // Return how many bytes were written
-    return buf_size;    
+    buf_t out = animation_encoder_finish(ae, 1);
+
+    return out.buf ? video_from_buffer(out.buf, out.len) : NULL;
+
+error:
+    raster_frame_iter_free(it);
+    animation_encoder_free(ae);
+    return NULL;
 }
 
-static void video_output_free(video_output *vo)
+typedef struct {
+    animation_encoder *ae; /// Video output, or
+    raster_image *ri;      /// GIF output, built a frame at a time
+    uint32_t w;
+    uint32_t h;
+    int depth;             /// Of the GIF pixel cache
+    int64_t frames;
+} preview_output;
+
+static int preview_frame(video *v, preview_output *po, const AVFrame *f, int64_t delay_ms)
 {
-    if (vo->sws)
-        sws_freeContext(vo->sws);
-    if (vo->frame)
-        av_frame_free(&vo->frame);
-    if (vo->pkt)
-        av_packet_free(&vo->pkt);
-    if (vo->vcodec)
-        avcodec_free_context(vo->vcodec);
-    if (vo->format)
-        avformat_free_context(vo->format);
-    if (vo->avio->buffer)
-        av_freep(&vo->avio->buffer);
-    if (vo->avio)
-        av_freep(&vo->avio);
-    if (vo->buf)
-        free(vo->buf);
+    if (po->ae) {
+        // Millisecond time base
+        return animation_encoder_write(po->ae, (const uint8_t *const *) f->data, f->linesize, f->format,
+                                       f->width, f->height, po->frames++ * delay_ms, delay_ms);
+    }
+
+    void *pixels;
+    size_t stride;
+
+    if (po->frames == 0) {
+        po->ri = raster_image_new_pixels(po->w, po->h, "GIF", &pixels, &stride, &po->depth);
+        if (!po->ri)
+            return 0;
+    } else if (!raster_image_add_frame(po->ri, &pixels, &stride)) {
+        return 0;
+    }
+
+    enum AVPixelFormat fmt = quantum_pixel_format(po->depth);
+    if (fmt == AV_PIX_FMT_NONE || !cached_sws(v, f, po->w, po->h, fmt, SWS_BICUBIC))
+        return 0;
+
+    uint8_t *dst[] = { pixels };
+    int dst_stride[] = { stride };
+
+    sws_scale(v->sws, (const uint8_t **) f->data, f->linesize, 0, f->height, dst, dst_stride);
+
+    raster_image_set_delay(po->ri, (delay_ms + 5) / 10);
+    po->frames++;
+
+    return raster_image_sync_pixels(po->ri);
 }
 
-// Scale this video proportionally to either a height of max_h,
-// or a width of max_w, whichever is lesser.
-video *video_scale(video *v, size_t max_w, size_t max_h)
+// Builds a short looping preview of this video out of evenly spaced
+// clips, each clip_len seconds long, at fps frames per second.
+buf_t video_preview(video *v, size_t clips, double clip_len, double fps, size_t max_w, size_t max_h, file_type format)
 {
-    // When scaling a video we would like to use the same
-    // - container
-    // - video codec and pixel format
-    // - audio codec and frames
+    buf_t ret = { 0 };
+    preview_output po = { 0 };
 
-    video_output *vo = (video_output *) calloc(1, sizeof(video_output));
-    if (!vo)
-        goto error;
+    double duration = video_duration(v);
+    if (clips == 0 || clip_len <= 0 || fps <= 0 || duration <= 0)
+        return ret;
 
-    // Same container
-    AVOutputFormat *ctr = container_format(v->format->iformat);
-    if (avformat_alloc_output_context2(&vo->format, ctr, NULL, NULL) < 0)
-        goto error;
+    if (!open_video_decoder(v))
+        return ret;
 
-    vo->avio_buf  = av_malloc(4096);
-    vo->avio      = avio_alloc_context(vo->avio_buf, 4096, 0, vo, NULL, &write_packet, NULL);
-    v->format->pb = vo->avio;
+    double ratio = FFMIN(max_w / (double) v->dimensions.width, max_h / (double) v->dimensions.height);
 
-    // Same video codec and pixel format
-    AVStream *vistream = v->format->streams[v->vstream_idx];
-    AVStream *vostream = avformat_new_stream(vo->format, NULL);
-    if (!vostream)
+    // Even dimensions suit both chroma-subsampled video and GIF
+    po.w = FFMAX((uint32_t) (v->dimensions.width * ratio) & ~1, 2);
+    po.h = FFMAX((uint32_t) (v->dimensions.height * ratio) & ~1, 2);
+
+    if (format == VIDEO_WEBM || format == VIDEO_MP4) {
+        po.ae = animation_encoder_new(format, po.w, po.h, (AVRational) { 1, 1000 });
+        if (!po.ae)
+            return ret;
+    } else if (format != IMAGE_GIF) {
+        return ret;
+    }
+
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    int64_t start_pts = stream_start(v);
+    int64_t delay_ms  = FFMAX(1000 / fps, 1);
+    clip_len = FFMIN(clip_len, duration);
+
+    for (size_t k = 0; k < clips; ++k) {
+        // Clips are centered on evenly spaced times, kept inside the video
+        double start = duration * (k + 0.5) / clips - clip_len / 2;
+        start = FFMAX(FFMIN(start, duration - clip_len), 0);
+
+        if (!seek_video_stream(v, start_pts + start / av_q2d(vstream->time_base)))
+            goto error;
+
+        double next = start;
+
+        while (next < start + clip_len && decode_video_frame(v)) {
+            int64_t pts = v->frame->best_effort_timestamp;
+            double t = pts == AV_NOPTS_VALUE ? next : (pts - start_pts) * av_q2d(vstream->time_base);
+
+            // Drop frames down to the target rate
+            if (t >= next) {
+                if (!preview_frame(v, &po, v->frame, delay_ms)) {
+                    av_frame_unref(v->frame);
+                    goto error;
+                }
+
+                next += 1 / fps;
+            }
+
+            av_frame_unref(v->frame);
+        }
+    }
+
+    if (po.frames == 0)
         goto error;
 
-    if (avcodec_parameters_copy(vostream->codecpar, vistream->codecpar) < 0)
+    if (po.ae)
+        return animation_encoder_finish(po.ae, 1);
+
+    raster_image_optimize(po.ri);
+    ret = raster_image_to_buffer(po.ri);
+    raster_image_free(po.ri);
+
+    return ret;
+
+error:
+    animation_encoder_free(po.ae);
+    raster_image_free(po.ri);
+    return ret;
+}
+
+// Decodes the whole video, checking that it decodes cleanly.
+int video_validate(video *v, int workers, int stop_early, video_validation *result)
+{
+    check_segment *segs = NULL;
+    int64_t *keys = NULL;
+    size_t nkeys = 0, nsegs = 0;
+    atomic_size_t bad;
+    int ret = 0;
+
+    *result = (video_validation) { .error_pts = INT64_MIN, .error_time = -1 };
+
+    // A streamed input can only be read through once, by its own demuxer
+    if (v->ring)
+        workers = 1;
+
+    if (workers > 1 && !find_keyframes(v, &keys, &nkeys))
+        return 0;
+
+    nsegs = FFMAX(FFMIN((size_t) FFMAX(workers, 1), nkeys), 1);
+    segs  = (check_segment *) calloc(nsegs, sizeof(check_segment));
+    if (!segs)
         goto error;
 
-    // (Optional) same audio codec
-    if (v->astream_idx > -1) {
-        AVStream *aistream = v->format->streams[v->astream_idx];
-        AVStream *aostream = avformat_new_stream(vo->format, NULL);
-        if (!aostream)
+    atomic_init(&bad, SIZE_MAX);
+
+    for (size_t i = 0; i < nsegs; ++i) {
+        check_segment *seg = &segs[i];
+
+        seg->index      = i;
+        seg->start      = i == 0 ? INT64_MIN : keys[i * nkeys / nsegs];
+        seg->end        = i == nsegs - 1 ? INT64_MAX : keys[(i + 1) * nkeys / nsegs];
+        seg->stop_early = stop_early;
+        seg->bad        = &bad;
+
+        // Each segment gets a decoder of its own which reports errors.
+        // A stream has to reopen its own decoder that way instead.
+        if (v->ring) {
+            seg->src = v;
+            avcodec_free_context(&v->vctx);
+            v->explode = 1;
+        } else {
+            seg->src = video_borrow(v);
+            if (seg->src)
+                seg->src->explode = 1;
+        }
+
+        if (!seg->src || !open_video_decoder(seg->src))
             goto error;
+    }
 
-        if (avcodec_parameters_copy(aostream->codecpar, aistream->codecpar) < 0)
+    if (nsegs == 1) {
+        run_check_segment(&segs[0]);
+    } else {
+        fan_out f;
+        int started = fan_out_start(&f, &run_check_segment, segs, sizeof(check_segment), nsegs);
+
+        fan_out_join(&f);
+
+        if (!started)
             goto error;
     }
 
-    if (avformat_write_header(vo->format, NULL) < 0)
-        goto error;
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    int64_t start = stream_start(v);
+    int64_t end = INT64_MIN;
 
-    uint32_t old_w = v->dimensions.width;
-    uint32_t old_h = v->dimensions.height;
+    ret = 1;
 
-    double ratio = FFMIN(max_w / (double) old_w, max_h / (double) old_h);
+    for (size_t i = 0; i < nsegs; ++i) {
+        result->frames += segs[i].frames;
+        end = FFMAX(end, segs[i].end_pts);
 
-    uint32_t new_w = v->dimensions.width * ratio;
-    uint32_t new_h = v->dimensions.height * ratio;
+        // Segments are in order, so the first error found is the earliest
+        if (ret && segs[i].error_pts != AV_NOPTS_VALUE) {
+            result->error_pts  = segs[i].error_pts;
+            result->error_time = FFMAX(segs[i].error_pts - start, 0) * av_q2d(vstream->time_base);
+            ret = 0;
+        }
+    }
 
-    // Create destination image
-    vo->frame = av_frame_alloc();
-    if (!vo->frame)
-        goto error;
+    if (end != INT64_MIN)
+        result->duration = (end - start) * av_q2d(vstream->time_base);
 
-    vo->frame->format = v->vctx->pix_fmt;
-    vo->frame->width  = new_w;
-    vo->frame->height = new_h;
+    if (result->frames == 0)
+        ret = 0;
 
-    if (av_image_alloc(vo->frame->data, vo->frame->linesize, new_w, new_h, v->vctx->pix_fmt, 32) < 0)
-        goto error;
+error:
+    for (size_t i = 0; segs && i < nsegs; ++i)
+        if (segs[i].src != v)
+            video_free(segs[i].src);
+
+    // Back to concealing errors
+    if (v->explode) {
+        avcodec_free_context(&v->vctx);
+        v->explode = 0;
+    }
+
+    free(segs);
+    free(keys);
+
+    return ret;
+}
 
-    // Setup scaling context
-    vo->sws = sws_getContext(old_w, old_h, v->vctx->pix_fmt, new_w, new_h, v->vctx->pix_fmt, SWS_LANCZOS, NULL, NULL, NULL);
-    if (!vo->sws)
+// Builds a keyframe index of this video. You must free() the returned memory.
+buf_t video_build_index(video *v)
+{
+    buf_t out = { 0 };
+
+    // The index is matched to its input by hashing it
+    if (v->ring) {
+        errno = ESPIPE;
+        return out;
+    }
+
+    double duration = video_duration(v);
+    if (duration <= 0)
+        return out;
+
+    AVStream *vstream = v->format->streams[v->vstream_idx];
+    AVCodecParameters *par = vstream->codecpar;
+
+    size_t cap = 64, nkeys = 0;
+    uint64_t frames = 0;
+
+    uint8_t *blob = (uint8_t *) malloc(INDEX_HEADER_SIZE + cap * INDEX_ENTRY_SIZE);
+    if (!blob)
+        return out;
+
+    // Demux-only pass for the position of every keyframe
+    if (!seek_video_stream(v, stream_start(v)))
         goto error;
 
-    // Reset the input stream
-    av_seek_frame(v->format, -1, 0, AVSEEK_FLAG_BACKWARD);
+    advise_access(v, MADV_SEQUENTIAL);
 
-    AVPacket outpkt;
-    int got_output;
+    while (av_read_frame(v->format, v->pkt) >= 0) {
+        AVPacket *pkt = v->pkt;
 
-    while (1) {
-        // done reading
-        if (av_read_frame(v->format, v->pkt) < 0)
-            break;
+        if (pkt->stream_index == v->vstream_idx) {
+            frames++;
 
-        if (v->pkt->stream_index == v->vstream_idx) {
-            // Video stream: read and scale this frame
-            if (avcodec_send_packet(v->vctx, v->pkt) == 0 && avcodec_receive_frame(v->vctx, v->frame) == 0) {
-                // Initialize output packet
-                av_init_packet(&outpkt);
-                outpkt.data = NULL;
-                outpkt.size = 0;
+            if ((pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE && pkt->pos >= 0) {
+                if (nkeys == cap) {
+                    cap *= 2;
 
-                // Scale image into new frame
-                sws_scale(vo->sws, (const uint8_t **) v->frame->data, v->frame->linesize, 0, old_h, vo->frame->data, vo->frame->linesize);
-                vo->frame->pts = v->frame->pts;
+                    uint8_t *grown = (uint8_t *) realloc(blob, INDEX_HEADER_SIZE + cap * INDEX_ENTRY_SIZE);
+                    if (!grown) {
+                        av_packet_unref(pkt);
+                        goto error;
+                    }
 
-                // Create output data packet
-                // if (avcodec_encode_video2(vo->format
+                    blob = grown;
+                }
 
-                av_frame_unref(v->frame);
+                uint8_t *e = &blob[INDEX_HEADER_SIZE + nkeys * INDEX_ENTRY_SIZE];
+                AV_WL64(&e[0], pkt->pts);
+                AV_WL64(&e[8], pkt->pos);
+                nkeys++;
             }
-        } else if (v->pkt->stream_index == v->astream_idx) {
-            // Audio stream: copy packet verbatim
-            av_interleaved_write_frame(vo->format, v->pkt);
         }
 
-        av_packet_unref(v->pkt);
+        av_packet_unref(pkt);
     }
 
-    if (av_write_trailer(vo->format) < 0)
-        goto error;
+    advise_access(v, MADV_NORMAL);
+    seek_video_stream(v, stream_start(v));
+
+    memset(blob, 0, INDEX_HEADER_SIZE);
+
+    AV_WL32(&blob[0],   INDEX_MAGIC);
+    AV_WL32(&blob[4],   INDEX_VERSION);
+    AV_WL64(&blob[8],   v->len);
+    AV_WL64(&blob[16],  input_hash(v->buf, v->len));
+    AV_WL64(&blob[24],  av_double2int(v->duration));
+    AV_WL64(&blob[32],  v->last_pts);
+    AV_WL64(&blob[40],  frames);
+    AV_WL32(&blob[48],  v->vstream_idx);
+    AV_WL32(&blob[52],  par->codec_id);
+    AV_WL32(&blob[56],  par->width);
+    AV_WL32(&blob[60],  par->height);
+    AV_WL32(&blob[64],  par->format);
+    AV_WL32(&blob[68],  vstream->time_base.num);
+    AV_WL32(&blob[72],  vstream->time_base.den);
+    AV_WL64(&blob[120], nkeys);
+
+    // Demuxer names may be lists, like "matroska,webm"; the
+    // first is enough to find it again
+    const char *name = v->format->iformat->name;
+    memcpy(&blob[88], name, FFMIN(strcspn(name, ","), INDEX_FORMAT_SIZE - 1));
+
+    out.buf = blob;
+    out.len = INDEX_HEADER_SIZE + nkeys * INDEX_ENTRY_SIZE;
+
+    return out;
 
 error:
-    video_output_free(vo);
-    return NULL;
+    advise_access(v, MADV_NORMAL);
+    free(blob);
+    return out;
 }
 
 // Write this video to memory. You must free() the returned memory.
-buf_t video_to_buffer(video *v);
+buf_t video_to_buffer(video *v)
+{
+    buf_t ret = { 0 };
+
+    // A streamed input was never held in full
+    if (!v->buf)
+        return ret;
+
+    ret.buf = malloc(v->len);
+    if (!ret.buf)
+        return ret;
+
+    memcpy(ret.buf, v->buf, v->len);
+    ret.len = v->len;
+
+    return ret;
+}
+
+// Write this video to a file. Returns 1 on success.
+int video_to_file(video *v, const char *filename)
+{
+    if (!v->buf)
+        return 0;
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+
+    int ok = video_to_fd(v, fd);
+
+    close(fd);
+
+    return ok;
+}
+
+// Writes this video to fd, from its current offset. fd is left open.
+// Returns 1 on success.
+int video_to_fd(video *v, int fd)
+{
+    if (!v->buf)
+        return 0;
+
+    size_t written = 0;
+
+    while (written < v->len) {
+        ssize_t ret = write(fd, &v->buf[written], v->len - written);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+
+        written += ret;
+    }
 
-// Write this video to a file.
-int video_to_file(video *v, const char *filename);
+    return written == v->len;
+}
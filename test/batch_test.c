@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "batch.h"
+#include "fingerprint.h"
+
+static const char *paths[] = {
+    "test/test_png.png",
+    "test/test_jpeg.jpg",
+    "test/does_not_exist.png",
+    "test/test_gif_animated.gif",
+    "test/test_webm.webm"
+};
+
+void test_batch_read()
+{
+    batch_reader *b = batch_open(paths, 5, NULL);
+    assert(b != NULL);
+
+    batch_item item;
+    int seen[5] = { 0 };
+
+    while (batch_next(b, &item)) {
+        assert(item.index < 5);
+        assert(!seen[item.index]++);
+
+        if (item.index == 2) {
+            assert(item.error == ENOENT);
+            assert(item.buf.buf == NULL);
+        } else {
+            assert(item.error == 0);
+            assert(fingerprint_buffer(item.buf.buf, item.buf.len) != UNKNOWN);
+        }
+
+        batch_release(b, &item);
+    }
+
+    for (int i = 0; i < 5; ++i)
+        assert(seen[i] == 1);
+
+    batch_close(b);
+}
+
+void test_batch_limit()
+{
+    // Smaller than any one file, so they are read one at a time
+    batch_reader *b = batch_open(paths, 5, &(batch_options) { .max_in_flight = 16 });
+    assert(b != NULL);
+
+    batch_item item;
+    size_t n = 0;
+
+    while (batch_next(b, &item)) {
+        n++;
+
+        // Kept, as video_from_buffer would
+        void *buf = item.buf.buf;
+        batch_detach(b, &item);
+        free(buf);
+    }
+
+    assert(n == 5);
+
+    batch_close(b);
+}
+
+int main(int argc, char *argv[])
+{
+    test_batch_read();
+    test_batch_limit();
+
+    return 0;
+}
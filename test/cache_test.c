@@ -0,0 +1,212 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+static buf_t read_file(const char *filename)
+{
+    buf_t buf = { 0 };
+
+    FILE *fp = fopen(filename, "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    buf.len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf.buf = malloc(buf.len);
+    assert(fread(buf.buf, 1, buf.len, fp) == buf.len);
+    fclose(fp);
+
+    return buf;
+}
+
+static void remove_directory(const char *dir)
+{
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+}
+
+void test_hash()
+{
+    // Reference XXH64 values
+    assert(cache_hash("", 0, 0) == 0xEF46DB3751D8E999ULL);
+    assert(cache_hash("a", 1, 0) == 0xD24EC4F1A98C6E5BULL);
+    assert(cache_hash("abc", 3, 0) == 0x44BC2CF5AD770999ULL);
+
+    cache_key a = cache_key_for("input", 5, "scale", "\1", 1);
+    cache_key b = cache_key_for("input", 5, "scale", "\2", 1);
+
+    assert(a.input == b.input);
+    assert(a.op != b.op);
+}
+
+void test_memory_tier()
+{
+    cache *c = cache_open(&(cache_options) { .memory_limit = 100 });
+    assert(c != NULL);
+
+    cache_key a = cache_key_for("a", 1, "op", NULL, 0);
+    cache_key b = cache_key_for("b", 1, "op", NULL, 0);
+    buf_t out;
+
+    char data[60] = { 1 };
+
+    assert(!cache_get(c, a, &out));
+    assert(cache_put(c, a, data, sizeof(data)));
+    assert(cache_get(c, a, &out));
+    assert(out.len == sizeof(data) && memcmp(out.buf, data, sizeof(data)) == 0);
+    free(out.buf);
+
+    // Doesn't fit alongside a, which is least recently used
+    assert(cache_put(c, b, data, sizeof(data)));
+    assert(!cache_get(c, a, &out));
+
+    cache_stats stats = cache_get_stats(c);
+    assert(stats.memory_hits == 1);
+    assert(stats.memory_misses == 2);
+    assert(stats.memory_evictions == 1);
+
+    cache_close(c);
+}
+
+void test_disk_tier()
+{
+    const char *dir = "test/cache_test.tmp";
+    remove_directory(dir);
+
+    cache_options opts = {
+        .memory_limit = 1,
+        .directory    = dir,
+        .disk_limit   = 4096,
+        .segment_size = 1024
+    };
+
+    cache *c = cache_open(&opts);
+    assert(c != NULL);
+
+    char data[200];
+    buf_t out;
+
+    for (int i = 0; i < 20; ++i) {
+        memset(data, i, sizeof(data));
+        assert(cache_put(c, cache_key_for(&i, sizeof(i), "op", NULL, 0), data, sizeof(data)));
+    }
+
+    cache_close(c);
+
+    // Another process, as far as the cache can tell
+    c = cache_open(&opts);
+    assert(c != NULL);
+
+    int last = 19;
+    assert(cache_get(c, cache_key_for(&last, sizeof(last), "op", NULL, 0), &out));
+    assert(out.len == sizeof(data) && ((char *) out.buf)[0] == 19);
+    free(out.buf);
+
+    // The oldest segments were recycled
+    int first = 0;
+    assert(!cache_get(c, cache_key_for(&first, sizeof(first), "op", NULL, 0), &out));
+
+    cache_stats stats = cache_get_stats(c);
+    assert(stats.disk_insertions == 20);
+    assert(stats.disk_evictions > 0);
+    assert(stats.disk_hits == 1);
+
+    // And a real second process
+    cache_key shared = cache_key_for("shared", 6, "op", NULL, 0);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        cache *child = cache_open(&opts);
+        _exit(child && cache_put(child, shared, "from child", 11) ? 0 : 1);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(cache_get(c, shared, &out));
+    assert(strcmp(out.buf, "from child") == 0);
+    free(out.buf);
+
+    cache_close(c);
+    remove_directory(dir);
+}
+
+void test_disk_fresh()
+{
+    // The first entry of a new disk tier is read back after reopening
+    const char *dir = "test/cache_test_fresh.tmp";
+    remove_directory(dir);
+
+    cache_options opts = {
+        .memory_limit = 1,
+        .directory    = dir,
+        .disk_limit   = 4096,
+        .segment_size = 1024
+    };
+    buf_t out;
+
+    cache *c = cache_open(&opts);
+    assert(c != NULL);
+
+    cache_key key = cache_key_for("first", 5, "op", NULL, 0);
+    assert(cache_put(c, key, "first entry", 12));
+    cache_close(c);
+
+    c = cache_open(&opts);
+    assert(c != NULL);
+
+    assert(cache_get(c, key, &out));
+    assert(strcmp(out.buf, "first entry") == 0);
+    free(out.buf);
+
+    cache_stats stats = cache_get_stats(c);
+    assert(stats.disk_hits == 1);
+    assert(stats.disk_misses == 0);
+
+    cache_close(c);
+    remove_directory(dir);
+}
+
+void test_cached_operations()
+{
+    cache *c = cache_open(NULL);
+    assert(c != NULL);
+
+    buf_t buf = read_file("test/test_png.png");
+    intensity_t first, second;
+
+    assert(cache_intensities(c, buf.buf, buf.len, &first));
+    assert(cache_intensities(c, buf.buf, buf.len, &second));
+    assert(memcmp(&first, &second, sizeof(intensity_t)) == 0);
+
+    buf_t a = cache_thumbnail(c, buf.buf, buf.len, 50, 50);
+    buf_t b = cache_thumbnail(c, buf.buf, buf.len, 50, 50);
+
+    assert(a.buf != NULL && b.buf != NULL);
+    assert(a.len == b.len && memcmp(a.buf, b.buf, a.len) == 0);
+    assert(cache_get_stats(c).memory_hits == 2);
+
+    free(a.buf);
+    free(b.buf);
+    free(buf.buf);
+    cache_close(c);
+}
+
+int main(int argc, char *argv[])
+{
+    test_hash();
+    test_memory_tier();
+    test_disk_tier();
+    test_disk_fresh();
+    test_cached_operations();
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "job.h"
+
+static buf_t read_file(const char *filename)
+{
+    buf_t buf = { 0 };
+
+    FILE *fp = fopen(filename, "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    buf.len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf.buf = malloc(buf.len);
+    assert(fread(buf.buf, 1, buf.len, fp) == buf.len);
+    fclose(fp);
+
+    return buf;
+}
+
+static atomic_int counted;
+
+static void *count(void *arg, int threads)
+{
+    atomic_fetch_add(&counted, 1);
+    return arg;
+}
+
+static void *fan_out(void *arg, int threads)
+{
+    // Jobs submitted and waited on from a job
+    job_engine *e = (job_engine *) arg;
+    job *jobs[8];
+
+    for (int i = 0; i < 8; ++i) {
+        jobs[i] = job_submit(e, &(job_request) { .kind = JOB_CUSTOM, .fn = &count });
+        assert(jobs[i] != NULL);
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        assert(job_wait(jobs[i], NULL));
+        job_free(jobs[i]);
+    }
+
+    return NULL;
+}
+
+static atomic_int budget_used, budget_peak;
+
+static void *nap(void *arg, int threads)
+{
+    usleep(1000);
+    return arg;
+}
+
+static void *use_budget(void *arg, int threads)
+{
+    // Waits on jobs of its own, keeping track of the threads
+    // every job running has
+    job_engine *e = (job_engine *) arg;
+    job *jobs[4];
+
+    int now  = atomic_fetch_add(&budget_used, threads) + threads;
+    int peak = atomic_load(&budget_peak);
+
+    while (now > peak && !atomic_compare_exchange_weak(&budget_peak, &peak, now))
+        ;
+
+    for (int i = 0; i < 4; ++i)
+        jobs[i] = job_submit(e, &(job_request) { .kind = JOB_CUSTOM, .fn = &nap });
+
+    for (int i = 0; i < 4; ++i) {
+        assert(job_wait(jobs[i], NULL));
+        job_free(jobs[i]);
+    }
+
+    atomic_fetch_sub(&budget_used, threads);
+    return NULL;
+}
+
+static void *block(void *arg, int threads)
+{
+    pthread_mutex_t *gate = (pthread_mutex_t *) arg;
+
+    pthread_mutex_lock(gate);
+    pthread_mutex_unlock(gate);
+
+    return NULL;
+}
+
+static void on_done(const job_result *result, void *user)
+{
+    assert(result->ok);
+    raster_image_free(result->image);
+    atomic_fetch_add((atomic_int *) user, 1);
+}
+
+void test_image_jobs()
+{
+    job_engine *e = job_engine_new(&(job_engine_options) { .workers = 4 });
+    assert(e != NULL);
+
+    buf_t buf = read_file("test/test_png.png");
+    job_result res;
+
+    job *j = job_submit(e, &(job_request) { .kind = JOB_FINGERPRINT, .buf = buf.buf, .len = buf.len });
+    assert(j != NULL);
+    assert(job_wait(j, &res));
+    assert(res.type == IMAGE_PNG);
+    job_free(j);
+
+    j = job_submit(e, &(job_request) { .kind = JOB_LOAD_IMAGE, .buf = buf.buf, .len = buf.len });
+    assert(job_wait(j, &res));
+    job_free(j);
+
+    raster_image *ri = res.image;
+
+    j = job_submit(e, &(job_request) { .kind = JOB_SCALE_IMAGE, .image = ri, .max_w = 100, .max_h = 100 });
+    assert(job_wait(j, &res));
+    assert(raster_image_dimensions(res.image).width <= 100);
+    raster_image_free(res.image);
+    job_free(j);
+
+    j = job_submit(e, &(job_request) { .kind = JOB_INTENSITIES, .image = ri });
+    assert(job_wait(j, &res));
+    job_free(j);
+
+    // Completion callbacks, with the jobs released up front
+    atomic_int done = 0;
+
+    for (int i = 0; i < 16; ++i)
+        job_free(job_submit(e, &(job_request) { .kind = JOB_SCALE_IMAGE, .image = ri, .max_w = 50, .max_h = 50, .done = &on_done, .user = &done }));
+
+    job_engine_free(e);
+    assert(done == 16);
+
+    raster_image_free(ri);
+    free(buf.buf);
+}
+
+void test_video_jobs()
+{
+    job_engine *e = job_engine_new(&(job_engine_options) { .workers = 4 });
+    assert(e != NULL);
+
+    buf_t buf = read_file("test/test_webm.webm");
+    job_result res;
+
+    job *j = job_submit(e, &(job_request) { .kind = JOB_LOAD_VIDEO, .buf = buf.buf, .len = buf.len });
+    assert(job_wait(j, &res));
+    job_free(j);
+
+    video *v = res.video;
+
+    // Split between GOP segments
+    j = job_submit(e, &(job_request) { .kind = JOB_SCALE_VIDEO, .video = v, .max_w = 100, .max_h = 100, .threads = 4 });
+    assert(job_wait(j, &res));
+    assert(video_dimensions(res.video).width <= 100);
+    video_free(res.video);
+    job_free(j);
+
+    video_free(v);
+    job_engine_free(e);
+    free(buf.buf);
+}
+
+void test_nested_jobs()
+{
+    job_engine *e = job_engine_new(&(job_engine_options) { .workers = 2, .queue_limit = 2 });
+    assert(e != NULL);
+
+    counted = 0;
+
+    job *jobs[4];
+
+    for (int i = 0; i < 4; ++i)
+        jobs[i] = job_submit(e, &(job_request) { .kind = JOB_CUSTOM, .fn = &fan_out, .arg = e });
+
+    for (int i = 0; i < 4; ++i) {
+        assert(job_wait(jobs[i], NULL));
+        job_free(jobs[i]);
+    }
+
+    assert(counted == 32);
+
+    job_engine_free(e);
+}
+
+void test_thread_budget()
+{
+    // Jobs run by a job waiting on its own take threads of the engine's
+    // like any other, so running jobs never have more than it has
+    job_engine *e = job_engine_new(&(job_engine_options) { .workers = 4, .queue_limit = 4 });
+    assert(e != NULL);
+
+    job *jobs[16];
+
+    for (int i = 0; i < 16; ++i)
+        jobs[i] = job_submit(e, &(job_request) { .kind = JOB_CUSTOM, .fn = &use_budget, .arg = e, .threads = 1 + i % 3 });
+
+    for (int i = 0; i < 16; ++i) {
+        assert(job_wait(jobs[i], NULL));
+        job_free(jobs[i]);
+    }
+
+    assert(budget_peak <= 4);
+
+    job_engine_free(e);
+}
+
+void test_backpressure()
+{
+    pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&gate);
+
+    job_engine *e = job_engine_new(&(job_engine_options) { .workers = 1, .queue_limit = 2 });
+    assert(e != NULL);
+
+    job_request req = { .kind = JOB_CUSTOM, .fn = &block, .arg = &gate };
+    job *jobs[3];
+    size_t n = 0;
+
+    // The third only fits once the first is running, and
+    // then the other two fill the queue
+    for (; n < 3; ++n)
+        assert((jobs[n] = job_submit(e, &req)) != NULL);
+
+    assert(job_try_submit(e, &req) == NULL);
+    assert(errno == EAGAIN);
+
+    pthread_mutex_unlock(&gate);
+
+    for (size_t i = 0; i < n; ++i) {
+        job_wait(jobs[i], NULL);
+        job_free(jobs[i]);
+    }
+
+    job_engine_free(e);
+}
+
+int main(int argc, char *argv[])
+{
+    test_image_jobs();
+    test_video_jobs();
+    test_nested_jobs();
+    test_thread_budget();
+    test_backpressure();
+
+    return 0;
+}
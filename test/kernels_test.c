@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "raster_image.h"
+
+static const char *names[] = { "baseline", "sse4.2", "avx2", "avx512" };
+
+#define NNAMES (sizeof(names) / sizeof(names[0]))
+
+static buf_t read_file(const char *filename)
+{
+    buf_t buf = { 0 };
+
+    FILE *fp = fopen(filename, "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    buf.len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf.buf = malloc(buf.len);
+    assert(fread(buf.buf, 1, buf.len, fp) == buf.len);
+    fclose(fp);
+
+    return buf;
+}
+
+void test_select()
+{
+    const char *best = kernels_active();
+    assert(best != NULL);
+
+    assert(kernels_select("baseline"));
+    assert(strcmp(kernels_active(), "baseline") == 0);
+
+    assert(!kernels_select("mmx"));
+    assert(strcmp(kernels_active(), "baseline") == 0);
+
+    assert(kernels_select(best));
+}
+
+void test_variants_agree()
+{
+    buf_t png = read_file("test/test_png.png");
+    buf_t gif = read_file("test/test_gif_animated.gif");
+    const char *best = kernels_active();
+
+    assert(kernels_select("baseline"));
+
+    raster_image *ri = raster_image_from_buffer(png.buf, png.len);
+    assert(ri != NULL);
+    intensity_t expected = raster_image_get_intensities(ri);
+    raster_image_free(ri);
+
+    ri = raster_image_from_buffer(gif.buf, gif.len);
+    assert(ri != NULL);
+    assert(raster_image_optimize(ri));
+    buf_t expected_gif = raster_image_to_buffer(ri);
+    assert(expected_gif.buf != NULL);
+    raster_image_free(ri);
+
+    // Every variant must give exactly what the baseline does
+    for (size_t i = 1; i < NNAMES; ++i) {
+        if (!kernels_select(names[i]))
+            continue;
+
+        ri = raster_image_from_buffer(png.buf, png.len);
+        assert(ri != NULL);
+        intensity_t actual = raster_image_get_intensities(ri);
+        assert(memcmp(&expected, &actual, sizeof(intensity_t)) == 0);
+        raster_image_free(ri);
+
+        ri = raster_image_from_buffer(gif.buf, gif.len);
+        assert(ri != NULL);
+        assert(raster_image_optimize(ri));
+        buf_t actual_gif = raster_image_to_buffer(ri);
+        assert(actual_gif.len == expected_gif.len);
+        assert(memcmp(actual_gif.buf, expected_gif.buf, actual_gif.len) == 0);
+        free(actual_gif.buf);
+        raster_image_free(ri);
+    }
+
+    assert(kernels_select(best));
+
+    free(expected_gif.buf);
+    free(png.buf);
+    free(gif.buf);
+}
+
+int main(int argc, char *argv[])
+{
+    test_select();
+    test_variants_agree();
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "raster_image.h"
+
+void test_pixel_reuse()
+{
+    // A 561x535 pixel cache is well over the pooling threshold
+    raster_image *ri = raster_image_from_file("test/test_png.png");
+    assert(ri != NULL);
+    raster_image_free(ri);
+
+    pool_stats before = pool_get_stats();
+    assert(before.misses > 0);
+    assert(before.retained > 0);
+
+    // Same sizes again, from the free lists
+    ri = raster_image_from_file("test/test_png.png");
+    assert(ri != NULL);
+
+    buf_t out = raster_image_to_buffer(ri);
+    assert(out.buf != NULL);
+    free(out.buf);
+
+    raster_image_free(ri);
+
+    pool_stats after = pool_get_stats();
+    assert(after.hits > before.hits);
+    assert(after.in_use <= before.in_use);
+}
+
+void test_trim()
+{
+    raster_image *ri = raster_image_from_file("test/test_jpeg.jpg");
+    assert(ri != NULL);
+    raster_image_free(ri);
+
+    pool_stats before = pool_get_stats();
+    assert(before.retained > 0);
+
+    pool_trim();
+
+    pool_stats after = pool_get_stats();
+    assert(after.retained == 0);
+    assert(after.trimmed - before.trimmed == before.retained);
+}
+
+int main(int argc, char *argv[])
+{
+    test_pixel_reuse();
+    test_trim();
+
+    return 0;
+}
@@ -1,7 +1,12 @@
 #include <assert.h>
+#include <math.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
+#include "fingerprint.h"
 #include "raster_image.h"
 
 // Small checkerboard pattern
@@ -13,6 +18,24 @@ static const char inline_png[] =
     "\xBF\x81\xE6\x5B\xF9\x07\x00\x00\x00\x00\x49\x45\x4E\x44\xAE\x42"
     "\x60\x82";
 
+static buf_t read_file(const char *filename)
+{
+    buf_t buf = { 0 };
+
+    FILE *fp = fopen(filename, "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    buf.len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf.buf = malloc(buf.len);
+    assert(fread(buf.buf, 1, buf.len, fp) == buf.len);
+    fclose(fp);
+
+    return buf;
+}
+
 void test_load_buf()
 {
     raster_image *ri = raster_image_from_buffer(inline_png, sizeof(inline_png));
@@ -28,6 +51,25 @@ void test_load_buf()
     raster_image_free(ri);
 }
 
+void test_init_before_fork()
+{
+    // Workers forked after an explicit init load without initializing again
+    image_proc_init();
+    image_proc_init();
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        raster_image *ri = raster_image_from_buffer(inline_png, sizeof(inline_png));
+        _exit(ri != NULL && raster_image_frame_count(ri) == 1 ? 0 : 1);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
 void test_load_file_jpg()
 {
     raster_image *ri = raster_image_from_file("test/test_jpeg.jpg");
@@ -55,6 +97,47 @@ void test_load_file_jpg_orient()
     assert(dim.height == 1024);
     assert(frames == 1);
 
+    // Scaled, then oriented on output
+    raster_image *si = raster_image_scale(ri, 200, 200);
+    assert(si != NULL);
+
+    dim = raster_image_dimensions(si);
+    assert(dim.width == 150);
+    assert(dim.height == 200);
+
+    buf_t buf = raster_image_to_buffer(si);
+    assert(buf.buf != NULL);
+    raster_image_free(si);
+
+    si = raster_image_from_buffer(buf.buf, buf.len);
+    assert(si != NULL);
+    assert(raster_image_dimensions(si).width == 150);
+    assert(raster_image_dimensions(si).height == 200);
+    raster_image_free(si);
+    free(buf.buf);
+
+    // Remapped intensities match those of the rotated pixels,
+    // up to the loss of encoding them again
+    intensity_t lazy = raster_image_get_intensities(ri);
+
+    buf = raster_image_to_buffer(ri);
+    assert(buf.buf != NULL);
+
+    raster_image *oriented = raster_image_from_buffer(buf.buf, buf.len);
+    assert(oriented != NULL);
+    assert(raster_image_dimensions(oriented).width == 768);
+
+    intensity_t rotated = raster_image_get_intensities(oriented);
+
+    assert(fabsf(lazy.nw - rotated.nw) < 1);
+    assert(fabsf(lazy.ne - rotated.ne) < 1);
+    assert(fabsf(lazy.sw - rotated.sw) < 1);
+    assert(fabsf(lazy.se - rotated.se) < 1);
+    assert(fabsf(lazy.avg - rotated.avg) < 1);
+
+    raster_image_free(oriented);
+    free(buf.buf);
+
     raster_image_free(ri);
 }
 
@@ -128,11 +211,100 @@ void test_load_file_gif_animated()
     raster_image_free(ri);
 }
 
+static dim_t transformed_dimensions(buf_t buf)
+{
+    assert(fingerprint_buffer(buf.buf, buf.len) == IMAGE_JPG);
+
+    raster_image *ri = raster_image_from_buffer(buf.buf, buf.len);
+    assert(ri != NULL);
+
+    dim_t dim = raster_image_dimensions(ri);
+    raster_image_free(ri);
+
+    return dim;
+}
+
+void test_transform()
+{
+    buf_t jpg = read_file("test/test_jpeg_orient.jpg");
+    raster_transform_path path;
+
+    // Oriented without decoding; whole MCUs, so nothing is dropped
+    buf_t out = raster_image_transform(jpg.buf, jpg.len, NULL, &path);
+    assert(out.buf != NULL);
+    assert(path == RASTER_TRANSFORM_LOSSLESS);
+
+    dim_t dim = transformed_dimensions(out);
+    assert(dim.width == 768);
+    assert(dim.height == 1024);
+
+    // Same pixels as orienting the decoded image
+    raster_image *ri = raster_image_from_buffer(jpg.buf, jpg.len);
+    raster_image *lossless = raster_image_from_buffer(out.buf, out.len);
+    intensity_t a = raster_image_get_intensities(ri);
+    intensity_t b = raster_image_get_intensities(lossless);
+
+    assert(fabsf(a.nw - b.nw) < 1);
+    assert(fabsf(a.ne - b.ne) < 1);
+    assert(fabsf(a.sw - b.sw) < 1);
+    assert(fabsf(a.se - b.se) < 1);
+
+    raster_image_free(lossless);
+    raster_image_free(ri);
+    free(out.buf);
+
+    // A crop off the MCU grid is exact only through a re-encode...
+    raster_transform_options opts = { .crop = 1, .region = { 100, 100, 400, 500 } };
+    out = raster_image_transform(jpg.buf, jpg.len, &opts, &path);
+    assert(path == RASTER_TRANSFORM_REENCODED);
+
+    dim = transformed_dimensions(out);
+    assert(dim.width == 300);
+    assert(dim.height == 400);
+    free(out.buf);
+
+    // ...unless it may start on the grid before it
+    opts.allow_block_alignment = 1;
+    out = raster_image_transform(jpg.buf, jpg.len, &opts, &path);
+    assert(path == RASTER_TRANSFORM_LOSSLESS);
+
+    dim = transformed_dimensions(out);
+    assert(dim.width == 304);
+    assert(dim.height == 404);
+    free(out.buf);
+
+    opts = (raster_transform_options) { .force_reencode = 1 };
+    out = raster_image_transform(jpg.buf, jpg.len, &opts, &path);
+    assert(path == RASTER_TRANSFORM_REENCODED);
+    assert(transformed_dimensions(out).width == 768);
+    free(out.buf);
+
+    free(jpg.buf);
+
+    // Other formats are re-encoded, and animations are not cropped
+    buf_t gif = read_file("test/test_gif_animated.gif");
+
+    out = raster_image_transform(gif.buf, gif.len, NULL, &path);
+    assert(path == RASTER_TRANSFORM_REENCODED);
+    assert(fingerprint_buffer(out.buf, out.len) == IMAGE_GIF);
+    free(out.buf);
+
+    opts = (raster_transform_options) { .crop = 1, .region = { 0, 0, 100, 100 } };
+    out = raster_image_transform(gif.buf, gif.len, &opts, &path);
+    assert(out.buf == NULL);
+    assert(path == RASTER_TRANSFORM_FAILED);
+
+    free(gif.buf);
+}
+
 int main(int argc, char *argv[])
 {
     // Test loading from buffer
     test_load_buf();
 
+    // Test initializing for a prefork server
+    test_init_before_fork();
+
     // Test loading various files
     test_load_file_jpg();
     test_load_file_jpg_orient();
@@ -140,5 +312,8 @@ int main(int argc, char *argv[])
     test_load_file_gif_static();
     test_load_file_gif_animated();
 
+    // Test lossless JPEG orientation and cropping
+    test_transform();
+
     return 0;
 }
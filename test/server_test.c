@@ -0,0 +1,254 @@
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "raster_image.h"
+#include "server.h"
+
+#define SOCKET_PATH "test/server_test.sock"
+
+static server *srv;
+
+static buf_t read_file(const char *filename)
+{
+    buf_t buf = { 0 };
+
+    FILE *fp = fopen(filename, "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    buf.len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf.buf = malloc(buf.len);
+    assert(fread(buf.buf, 1, buf.len, fp) == buf.len);
+    fclose(fp);
+
+    return buf;
+}
+
+static void stop(int sig)
+{
+    server_stop(srv);
+}
+
+static pid_t start_server(const server_options *opts)
+{
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        srv = server_new(SOCKET_PATH, opts);
+        if (!srv)
+            _exit(1);
+
+        signal(SIGTERM, &stop);
+        server_run(srv);
+        server_free(srv);
+        _exit(0);
+    }
+
+    return pid;
+}
+
+static void stop_server(pid_t pid)
+{
+    int status;
+
+    kill(pid, SIGTERM);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static server_conn *connect_server()
+{
+    server_conn *c = NULL;
+
+    for (int i = 0; i < 500 && !c; ++i)
+        if (!(c = server_connect(SOCKET_PATH)))
+            usleep(10000);
+
+    assert(c != NULL);
+    return c;
+}
+
+void test_operations()
+{
+    server_options opts = { .workers = 2 };
+    pid_t pid = start_server(&opts);
+    server_conn *c = connect_server();
+    server_result res;
+
+    buf_t png  = read_file("test/test_png.png");
+    buf_t gif  = read_file("test/test_gif_animated.gif");
+    buf_t webm = read_file("test/test_webm.webm");
+
+    server_request req = { .op = SERVER_FINGERPRINT, .buf = png.buf, .len = png.len, .fd = -1 };
+    assert(server_call(c, &req, &res));
+    assert(res.type == IMAGE_PNG);
+    assert(res.output.buf == NULL);
+
+    // Intensities match those computed in this process
+    raster_image *ri = raster_image_from_buffer(png.buf, png.len);
+    assert(ri != NULL);
+    intensity_t local = raster_image_get_intensities(ri);
+    raster_image_free(ri);
+
+    req.op = SERVER_INTENSITIES;
+    assert(server_call(c, &req, &res));
+    assert(memcmp(&res.intensities, &local, sizeof(intensity_t)) == 0);
+
+    req.op    = SERVER_SCALE;
+    req.max_w = 50;
+    req.max_h = 50;
+    assert(server_call(c, &req, &res));
+    assert(res.dimensions.width <= 50 && res.dimensions.height <= 50);
+    assert(fingerprint_buffer(res.output.buf, res.output.len) == IMAGE_PNG);
+
+    ri = raster_image_from_buffer(res.output.buf, res.output.len);
+    assert(ri != NULL);
+    assert(raster_image_dimensions(ri).width == res.dimensions.width);
+    raster_image_free(ri);
+    server_result_free(&res);
+
+    // Inputs may be passed as a memfd, reused across requests
+    int fd = server_memfd(gif.buf, gif.len);
+    assert(fd >= 0);
+
+    req = (server_request) { .op = SERVER_PROBE, .fd = fd };
+    assert(server_call(c, &req, &res));
+    assert(res.type == IMAGE_GIF);
+    assert(res.frames > 1);
+
+    req.op = SERVER_OPTIMIZE;
+    assert(server_call(c, &req, &res));
+    assert(fingerprint_buffer(res.output.buf, res.output.len) == IMAGE_GIF);
+    server_result_free(&res);
+    close(fd);
+
+    req = (server_request) { .op = SERVER_FRAME_AT, .buf = webm.buf, .len = webm.len, .fd = -1, .max_w = 100, .max_h = 100, .seconds = 0 };
+    assert(server_call(c, &req, &res));
+    assert(res.type == VIDEO_WEBM);
+    assert(res.dimensions.width <= 100 && res.dimensions.height <= 100);
+    assert(fingerprint_buffer(res.output.buf, res.output.len) == IMAGE_JPG);
+    server_result_free(&res);
+
+    req.op = SERVER_PROBE;
+    assert(server_call(c, &req, &res));
+    assert(res.duration > 0);
+
+    // Not an image or a video
+    req = (server_request) { .op = SERVER_SCALE, .buf = "hello", .len = 5, .fd = -1 };
+    assert(!server_call(c, &req, &res));
+
+    server_disconnect(c);
+    stop_server(pid);
+
+    free(png.buf);
+    free(gif.buf);
+    free(webm.buf);
+}
+
+void test_recycling()
+{
+    // Workers which retire or die are replaced, without failing
+    // any request they had not started
+    server_options opts = { .workers = 1, .max_requests = 3 };
+    pid_t pid = start_server(&opts);
+    server_conn *c = connect_server();
+    server_result res;
+    int pids[6];
+
+    buf_t png = read_file("test/test_png.png");
+    server_request req = { .op = SERVER_FINGERPRINT, .buf = png.buf, .len = png.len, .fd = -1 };
+
+    for (int i = 0; i < 6; ++i) {
+        assert(server_call(c, &req, &res));
+        pids[i] = res.worker_pid;
+    }
+
+    assert(pids[0] == pids[2] && pids[3] == pids[5] && pids[0] != pids[3]);
+
+    // Killed while idle
+    assert(server_call(c, &req, &res));
+    kill(res.worker_pid, SIGKILL);
+    usleep(100000);
+
+    int killed = res.worker_pid;
+    assert(server_call(c, &req, &res));
+    assert(res.worker_pid != killed);
+
+    server_disconnect(c);
+    stop_server(pid);
+
+    free(png.buf);
+}
+
+void test_idle_clients()
+{
+    // Clients which keep their connections between requests hold no
+    // worker, so more of them than there are workers are all served
+    server_options opts = { .workers = 1 };
+    pid_t pid = start_server(&opts);
+    server_conn *c[3];
+    server_result res;
+
+    buf_t png = read_file("test/test_png.png");
+    server_request req = { .op = SERVER_FINGERPRINT, .buf = png.buf, .len = png.len, .fd = -1 };
+
+    for (int i = 0; i < 3; ++i)
+        c[i] = connect_server();
+
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 3; ++i) {
+            assert(server_call(c[i], &req, &res));
+            assert(res.type == IMAGE_PNG);
+        }
+    }
+
+    for (int i = 0; i < 3; ++i)
+        server_disconnect(c[i]);
+
+    stop_server(pid);
+
+    free(png.buf);
+}
+
+void test_timeout()
+{
+    // A request that runs too long fails, and its worker is replaced
+    server_options opts = { .workers = 1, .timeout = 0.001 };
+    pid_t pid = start_server(&opts);
+    server_conn *c = connect_server();
+    server_result res;
+
+    buf_t gif = read_file("test/test_gif_animated.gif");
+    server_request req = { .op = SERVER_OPTIMIZE, .buf = gif.buf, .len = gif.len, .fd = -1 };
+
+    assert(!server_call(c, &req, &res));
+    assert(errno == ECONNRESET);
+
+    req.op = SERVER_FINGERPRINT;
+    assert(server_call(c, &req, &res));
+
+    server_disconnect(c);
+    stop_server(pid);
+
+    free(gif.buf);
+}
+
+int main(int argc, char *argv[])
+{
+    test_operations();
+    test_recycling();
+    test_idle_clients();
+    test_timeout();
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "raster_image.h"
+#include "trace.h"
+#include "video.h"
+
+static buf_t read_file(const char *filename)
+{
+    buf_t buf = { 0 };
+
+    FILE *fp = fopen(filename, "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    buf.len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf.buf = malloc(buf.len);
+    assert(fread(buf.buf, 1, buf.len, fp) == buf.len);
+    fclose(fp);
+
+    return buf;
+}
+
+static int events[TRACE_STAGES];
+
+static void count_event(const trace_event *ev, void *user)
+{
+    assert(user == events);
+    assert(ev->wall >= 0 && ev->cpu >= 0);
+    events[ev->stage]++;
+}
+
+void test_image_stages()
+{
+    buf_t buf = read_file("test/test_gif_animated.gif");
+    trace_stats stats = { 0 };
+
+    trace_set_callback(&count_event, events);
+    trace_enable(1);
+    assert(trace_collect(&stats) == NULL);
+
+    raster_image *ri = raster_image_from_buffer(buf.buf, buf.len);
+    assert(ri != NULL);
+
+    raster_image *si = raster_image_scale(ri, 50, 50);
+    assert(si != NULL);
+
+    buf_t out = raster_image_to_buffer(si);
+    assert(out.buf != NULL);
+
+    assert(trace_collect(NULL) == &stats);
+    trace_enable(0);
+    trace_set_callback(NULL, NULL);
+
+    assert(stats.stages[TRACE_LOAD].calls == 1);
+    assert(stats.stages[TRACE_LOAD].bytes_in == buf.len);
+    assert(stats.stages[TRACE_LOAD].frames == raster_image_frame_count(ri));
+    assert(stats.stages[TRACE_COALESCE].calls == 1);
+    assert(stats.stages[TRACE_RESIZE].frames == raster_image_frame_count(ri));
+    assert(stats.stages[TRACE_ENCODE].bytes_out == out.len);
+    assert(stats.stages[TRACE_LOAD].wall > 0);
+
+    assert(events[TRACE_LOAD] == 1);
+    assert(events[TRACE_ENCODE] == 1);
+
+    // Nothing is recorded while disabled
+    trace_collect(&stats);
+    raster_image *again = raster_image_from_buffer(buf.buf, buf.len);
+    trace_collect(NULL);
+
+    assert(again != NULL);
+    assert(stats.stages[TRACE_LOAD].calls == 1);
+
+    raster_image_free(again);
+    raster_image_free(si);
+    raster_image_free(ri);
+    free(out.buf);
+    free(buf.buf);
+}
+
+void test_chrome_trace()
+{
+    const char *path = "test/trace_test.json";
+
+    assert(trace_chrome_open(path));
+    trace_enable(1);
+
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    intensity_t i;
+    assert(video_get_intensities(v, &i));
+    video_free(v);
+
+    trace_enable(0);
+    trace_chrome_close();
+
+    buf_t json = read_file(path);
+    char *text = (char *) realloc(json.buf, json.len + 1);
+    text[json.len] = '\0';
+
+    assert(text[0] == '[');
+    assert(strstr(text, "\"name\":\"decode\"") != NULL);
+    assert(strstr(text, "\"ph\":\"X\"") != NULL);
+    assert(strcmp(text + json.len - 3, "\n]\n") == 0);
+
+    free(text);
+    remove(path);
+}
+
+void test_nested_spans()
+{
+    trace_stats stats = { 0 };
+
+    trace_enable(1);
+    trace_collect(&stats);
+
+    // A span begun inside another must not hide what
+    // the outer one allocated before it
+    trace_span outer = trace_begin();
+    pool_free(pool_malloc(1024 * 1024));
+
+    trace_span inner = trace_begin();
+    trace_end(TRACE_RESIZE, &inner, 0, 0, 0);
+    trace_end(TRACE_LOAD, &outer, 0, 0, 0);
+
+    trace_collect(NULL);
+    trace_enable(0);
+
+    assert(stats.stages[TRACE_LOAD].peak_bytes >= 1024 * 1024);
+    assert(stats.stages[TRACE_RESIZE].peak_bytes == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    test_image_stages();
+    test_chrome_trace();
+    test_nested_spans();
+
+    return 0;
+}
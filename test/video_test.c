@@ -1,10 +1,44 @@
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "video.h"
 
+// Offset of the first top-level MP4 box of this type, or -1
+static long mp4_box(buf_t buf, const char *type)
+{
+    const uint8_t *p = (const uint8_t *) buf.buf;
+    size_t pos = 0;
+
+    while (pos + 8 <= buf.len) {
+        uint64_t size = (uint32_t) p[pos] << 24 | p[pos + 1] << 16 | p[pos + 2] << 8 | p[pos + 3];
+
+        if (memcmp(p + pos + 4, type, 4) == 0)
+            return (long) pos;
+
+        // A 64-bit size follows the type, and 0 runs to the end
+        if (size == 1 && pos + 16 <= buf.len) {
+            size = 0;
+            for (int i = 0; i < 8; ++i)
+                size = size << 8 | p[pos + 8 + i];
+        } else if (size == 0) {
+            size = buf.len - pos;
+        }
+
+        if (size < 8)
+            return -1;
+
+        pos += size;
+    }
+
+    return -1;
+}
+
 void test_load_gif()
 {
     video *v = video_from_file("test/test_gif_animated.gif");
@@ -59,6 +93,491 @@ void test_load_webm()
     video_free(v);
 }
 
+void test_fast_open_webm()
+{
+    video_options opts = { .fast_open = 1 };
+
+    video *v = video_from_file_ex("test/test_webm.webm", &opts);
+    assert(v != NULL);
+
+    dim_t  dim = video_dimensions(v);
+    double dur = video_duration(v);
+
+    assert(dim.width == 277);
+    assert(dim.height == 344);
+    assert(dur == 17.7);
+
+    intensity_t i;
+    assert(video_get_intensities(v, &i));
+
+    video_free(v);
+}
+
+void test_frame_at_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    raster_image *ri = video_frame_at(v, 5.0, 100, 100);
+    assert(ri != NULL);
+
+    dim_t dim = raster_image_dimensions(ri);
+
+    assert(dim.width <= 100);
+    assert(dim.height <= 100);
+    assert(raster_image_frame_count(ri) == 1);
+
+    buf_t buf = raster_image_to_buffer(ri);
+    assert(buf.buf != NULL && buf.len > 0);
+
+    free(buf.buf);
+    raster_image_free(ri);
+    video_free(v);
+}
+
+void test_storyboard_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    double timestamps[6];
+
+    raster_image *ri = video_storyboard(v, 6, 3, 64, 64, 0, timestamps);
+    assert(ri != NULL);
+
+    dim_t dim = raster_image_dimensions(ri);
+
+    assert(dim.width <= 3 * 64);
+    assert(dim.height <= 2 * 64);
+
+    for (int i = 1; i < 6; ++i)
+        assert(timestamps[i] > timestamps[i - 1]);
+
+    raster_image_free(ri);
+
+    // Keyframe-only pass fills the same layout
+    ri = video_storyboard(v, 6, 3, 64, 64, 1, timestamps);
+    assert(ri != NULL);
+    assert(timestamps[0] >= 0);
+
+    raster_image_free(ri);
+    video_free(v);
+}
+
+void test_next_frame_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    dim_t dim = video_dimensions(v);
+    video_frame f;
+    size_t frames = 0;
+
+    while (video_next_frame(v, &f)) {
+        assert(f.dimensions.width == dim.width);
+        assert(f.dimensions.height == dim.height);
+        assert(f.stride >= dim.width * 3);
+
+        video_frame_release(&f);
+        frames++;
+    }
+
+    assert(frames > 0);
+
+    // Fixed layout, from the start again
+    assert(video_set_frame_format(v, VIDEO_PIX_GRAY8, 64, 48));
+    assert(video_rewind(v));
+
+    size_t again = 0;
+
+    while (video_next_frame(v, &f)) {
+        assert(f.dimensions.width == 64);
+        assert(f.dimensions.height == 48);
+        assert(f.time >= 0);
+
+        video_frame_release(&f);
+        again++;
+    }
+
+    assert(again == frames);
+
+    video_free(v);
+}
+
+void test_analysis_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    intensity_t full, fast;
+    assert(video_get_intensities(v, &full));
+
+    video_validation exact;
+    assert(video_validate(v, 1, 0, &exact));
+
+    assert(video_set_decode_mode(v, VIDEO_DECODE_ANALYSIS));
+    assert(video_get_intensities(v, &fast));
+
+    // Approximate, but close
+    assert(fabs(full.avg - fast.avg) < 8);
+
+    intensity_t points[8];
+    float scene[8];
+    assert(video_get_signature(v, 8, 0, points, scene));
+
+    // Operations which need every frame ignore the mode
+    video_validation serial;
+    assert(video_validate(v, 1, 0, &serial));
+    assert(serial.frames == exact.frames);
+
+    dim_t dim = video_dimensions(v);
+    raster_image *ri = video_frame_at(v, 5.0, dim.width, dim.height);
+    assert(ri != NULL);
+    assert(raster_image_dimensions(ri).width == dim.width);
+    raster_image_free(ri);
+
+    assert(video_set_decode_mode(v, VIDEO_DECODE_FULL));
+    assert(video_get_intensities(v, &fast));
+    assert(full.avg == fast.avg);
+
+    video_free(v);
+}
+
+void test_validate_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    video_validation serial, parallel;
+
+    assert(video_validate(v, 1, 0, &serial));
+    assert(serial.error_time == -1);
+    assert(serial.frames > 0);
+    assert(fabs(serial.duration - video_duration(v)) < 0.5);
+
+    assert(video_validate(v, 4, 1, &parallel));
+    assert(parallel.frames == serial.frames);
+    assert(parallel.duration == serial.duration);
+
+    video_free(v);
+
+    // Damage the middle of the file
+    FILE *fp = fopen("test/test_webm.webm", "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    size_t len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *buf = malloc(len);
+    assert(fread(buf, 1, len, fp) == len);
+    fclose(fp);
+
+    for (size_t i = len / 2; i < len / 2 + 4096 && i < len; ++i)
+        buf[i] = rand();
+
+    v = video_from_buffer(buf, len);
+    assert(v != NULL);
+
+    assert(!video_validate(v, 4, 1, &parallel));
+    assert(parallel.error_time >= 0);
+
+    video_free(v);
+}
+
+void test_fd_webm()
+{
+    // Streamed through a pipe, so that nothing can be seeked
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        close(fds[0]);
+
+        FILE *fp = fopen("test/test_webm.webm", "rb");
+        char chunk[4096];
+        size_t n;
+
+        while (fp && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+            if (write(fds[1], chunk, n) != (ssize_t) n)
+                break;
+
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    video *v = video_from_fd(fds[0], NULL);
+    assert(v != NULL);
+
+    dim_t  dim = video_dimensions(v);
+    double dur = video_duration(v);
+
+    assert(dim.width == 277);
+    assert(dim.height == 344);
+    assert(dur == 17.7);
+
+    intensity_t i;
+    assert(video_get_intensities(v, &i));
+
+    video_free(v);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+}
+
+void test_index_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    buf_t index = video_build_index(v);
+    assert(index.buf != NULL);
+
+    video_free(v);
+
+    video_options opts = { .index = index.buf, .index_len = index.len };
+
+    v = video_from_file_ex("test/test_webm.webm", &opts);
+    assert(v != NULL);
+    assert(video_duration(v) == 17.7);
+
+    raster_image *ri = video_frame_at(v, 10.0, 100, 100);
+    assert(ri != NULL);
+
+    raster_image_free(ri);
+    video_free(v);
+
+    // An index for some other input is ignored
+    v = video_from_file_ex("test/test_gif_animated.gif", &opts);
+    assert(v != NULL);
+    assert(video_duration(v) == 19.1);
+
+    video_free(v);
+
+    // So is one with a pixel format no decoder has
+    ((uint8_t *) index.buf)[67] = 0x7f;
+
+    v = video_from_file_ex("test/test_webm.webm", &opts);
+    assert(v != NULL);
+    assert(video_duration(v) == 17.7);
+
+    video_free(v);
+    free(index.buf);
+}
+
+void test_io_buffer_webm()
+{
+    // Buffer much larger than the whole file
+    video_options opts = { .io_buffer_size = 16 * 1024 * 1024 };
+
+    video *v = video_from_file_ex("test/test_webm.webm", &opts);
+    assert(v != NULL);
+    assert(video_duration(v) == 17.7);
+
+    intensity_t i;
+    assert(video_get_intensities(v, &i));
+
+    video_free(v);
+}
+
+void test_scale_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    video *s = video_scale(v, 100, 100);
+    assert(s != NULL);
+
+    dim_t dim = video_dimensions(s);
+
+    assert(dim.width <= 100);
+    assert(dim.height <= 100);
+    assert(video_duration(s) > 17.0 && video_duration(s) < 18.5);
+
+    video_free(s);
+
+    // Same result when split into segments
+    s = video_scale_parallel(v, 100, 100, 4);
+    assert(s != NULL);
+
+    dim = video_dimensions(s);
+
+    assert(dim.width <= 100);
+    assert(dim.height <= 100);
+    assert(video_duration(s) > 17.0 && video_duration(s) < 18.5);
+
+    intensity_t i;
+    assert(video_get_intensities(s, &i));
+
+    buf_t buf = video_to_buffer(s);
+    assert(buf.buf != NULL && buf.len > 0);
+
+    free(buf.buf);
+    video_free(s);
+    video_free(v);
+}
+
+void test_remux_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    // Already fits, so the packets are just copied
+    video_scale_path path;
+    video *s = video_scale_ex(v, 1000, 1000, NULL, &path);
+    assert(s != NULL);
+    assert(path == VIDEO_SCALE_REMUXED);
+
+    dim_t dim = video_dimensions(s);
+
+    assert(dim.width == 277);
+    assert(dim.height == 344);
+    assert(video_duration(s) > 17.0 && video_duration(s) < 18.5);
+
+    video_free(s);
+
+    video_scale_options opts = { .force_transcode = 1 };
+    s = video_scale_ex(v, 1000, 1000, &opts, &path);
+    assert(s != NULL);
+    assert(path == VIDEO_SCALE_TRANSCODED);
+
+    video_free(s);
+    video_free(v);
+}
+
+void test_gif_to_video()
+{
+    raster_image *ri = raster_image_from_file("test/test_gif_animated.gif");
+    assert(ri != NULL);
+
+    video *v = video_from_raster_image(ri, VIDEO_WEBM);
+    assert(v != NULL);
+
+    dim_t dim = video_dimensions(v);
+
+    assert(dim.width == 276);
+    assert(dim.height == 344);
+    assert(video_duration(v) > 18.5 && video_duration(v) < 19.5);
+
+    video_free(v);
+
+    v = video_from_raster_image(ri, VIDEO_MP4);
+    assert(v != NULL);
+    assert(video_duration(v) > 18.5 && video_duration(v) < 19.5);
+
+    buf_t buf = video_to_buffer(v);
+    assert(fingerprint_buffer(buf.buf, buf.len) == VIDEO_MP4);
+
+    free(buf.buf);
+    video_free(v);
+    raster_image_free(ri);
+}
+
+void test_remux_mp4()
+{
+    raster_image *ri = raster_image_from_file("test/test_gif_animated.gif");
+    assert(ri != NULL);
+
+    video *mp4 = video_from_raster_image(ri, VIDEO_MP4);
+    assert(mp4 != NULL);
+    raster_image_free(ri);
+
+    // Remuxed as the muxer writes it, with the moov atom at the end
+    video_scale_options opts = { 0 };
+    video_scale_path path;
+
+    video *v = video_scale_ex(mp4, 1000, 1000, &opts, &path);
+    assert(v != NULL);
+    assert(path == VIDEO_SCALE_REMUXED);
+
+    buf_t buf = video_to_buffer(v);
+    assert(mp4_box(buf, "mdat") >= 0);
+    assert(mp4_box(buf, "moov") > mp4_box(buf, "mdat"));
+    free(buf.buf);
+
+    // Moved ahead of the media data, with its chunk offsets patched
+    opts.faststart = 1;
+
+    video *s = video_scale_ex(v, 1000, 1000, &opts, &path);
+    assert(s != NULL);
+    assert(path == VIDEO_SCALE_REMUXED);
+
+    buf = video_to_buffer(s);
+    assert(fingerprint_buffer(buf.buf, buf.len) == VIDEO_MP4);
+    assert(mp4_box(buf, "moov") >= 0);
+    assert(mp4_box(buf, "moov") < mp4_box(buf, "mdat"));
+
+    // Reopens, and decodes every frame the same as before
+    video *r = video_from_buffer(buf.buf, buf.len);
+    assert(r != NULL);
+    assert(video_duration(r) == video_duration(mp4));
+
+    video_validation before, after;
+    assert(video_validate(mp4, 1, 0, &before));
+    assert(video_validate(r, 1, 0, &after));
+    assert(after.error_time == -1);
+    assert(after.frames == before.frames);
+
+    intensity_t a, b;
+    assert(video_get_intensities(mp4, &a));
+    assert(video_get_intensities(r, &b));
+    assert(memcmp(&a, &b, sizeof(intensity_t)) == 0);
+
+    video_free(r);
+    video_free(s);
+    video_free(v);
+    video_free(mp4);
+}
+
+void test_signature_gif()
+{
+    raster_image *ri = raster_image_from_file("test/test_gif_animated.gif");
+    assert(ri != NULL);
+
+    video *v = video_from_file("test/test_gif_animated.gif");
+    assert(v != NULL);
+
+    intensity_t rp[16], vp[16];
+    float rs[16], vs[16];
+
+    assert(raster_image_get_signature(ri, 16, rp, rs));
+    assert(video_get_signature(v, 16, 0, vp, vs));
+    assert(rs[0] == 0 && vs[0] == 0);
+
+    // The same animation decoded either way should look the same
+    for (size_t k = 0; k < 16; ++k)
+        assert(fabs(rp[k].avg - vp[k].avg) < 4);
+
+    video_free(v);
+    raster_image_free(ri);
+}
+
+void test_preview_webm()
+{
+    video *v = video_from_file("test/test_webm.webm");
+    assert(v != NULL);
+
+    buf_t buf = video_preview(v, 3, 1.0, 10, 100, 100, IMAGE_GIF);
+    assert(buf.buf != NULL);
+    assert(fingerprint_buffer(buf.buf, buf.len) == IMAGE_GIF);
+
+    raster_image *ri = raster_image_from_buffer(buf.buf, buf.len);
+    assert(ri != NULL);
+    assert(raster_image_frame_count(ri) >= 20);
+
+    raster_image_free(ri);
+    free(buf.buf);
+
+    buf = video_preview(v, 3, 1.0, 10, 100, 100, VIDEO_WEBM);
+    assert(buf.buf != NULL);
+    assert(fingerprint_buffer(buf.buf, buf.len) == VIDEO_WEBM);
+
+    free(buf.buf);
+    video_free(v);
+}
 
 int main(int argc, char *argv[])
 {
@@ -68,4 +587,23 @@ int main(int argc, char *argv[])
 
     // Test WebM
     test_load_webm();
+    test_fast_open_webm();
+    test_io_buffer_webm();
+    test_index_webm();
+    test_frame_at_webm();
+    test_storyboard_webm();
+    test_scale_webm();
+    test_remux_webm();
+    test_next_frame_webm();
+    test_analysis_webm();
+    test_validate_webm();
+
+    // Test animation conversion
+    test_gif_to_video();
+    test_remux_mp4();
+    test_preview_webm();
+    test_signature_gif();
+
+    // Test streaming input
+    test_fd_webm();
 }